@@ -0,0 +1,59 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <blockencodings.h>
+#include <policy/policy.h>
+#include <random.h>
+#include <txmempool.h>
+
+#include <assert.h>
+#include <vector>
+
+static void AddTx(const CTransactionRef& tx, CTxMemPool& pool) EXCLUSIVE_LOCKS_REQUIRED(pool.cs)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, /* fee */ 1000, /* time */ 0, /* height */ 1, /* spendsCoinbase */ false, /* sigOpCost */ 4, lp));
+}
+
+// Reconstructs a 2000 transaction block from a compact block against a
+// 20000 transaction mempool which holds all but one of the block's
+// transactions, so the whole mempool is scanned.
+static void CompactBlockReconstruct(benchmark::State& state)
+{
+    static constexpr int MEMPOOL_TXS = 20000;
+    static constexpr int BLOCK_TXS = 2000;
+
+    FastRandomContext rng(true);
+    CTxMemPool pool;
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    {
+        LOCK(pool.cs);
+        for (int i = 0; i < MEMPOOL_TXS; ++i) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(rng.rand256(), 0);
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_1;
+            tx.vout[0].nValue = i;
+            CTransactionRef ptx = MakeTransactionRef(tx);
+            if (i % (MEMPOOL_TXS / BLOCK_TXS) == 0) block.vtx.push_back(ptx);
+            if (i > 0) AddTx(ptx, pool);
+        }
+    }
+    const CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+    const std::vector<std::pair<uint256, CTransactionRef>> extra_txn;
+
+    while (state.KeepRunning()) {
+        PartiallyDownloadedBlock partial_block(&pool);
+        ReadStatus status = partial_block.InitData(cmpctblock, extra_txn);
+        assert(status == READ_STATUS_OK);
+    }
+}
+
+BENCHMARK(CompactBlockReconstruct, 50);
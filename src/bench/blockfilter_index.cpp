@@ -0,0 +1,59 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <index/blockfilterindex.h>
+#include <script/script.h>
+#include <test/util.h>
+#include <utiltime.h>
+#include <validation.h>
+
+#include <assert.h>
+#include <vector>
+
+// Mines a 1000 block chain, indexes its basic filters and then looks up the
+// filters of the whole chain with one range lookup, as a wallet backend or
+// a getcfilters request does.
+static void BlockFilterIndexRange(benchmark::State& state, size_t filter_cache_bytes)
+{
+    static constexpr int NUM_BLOCKS = 1000;
+
+    const CScript script_pub{CScript() << OP_TRUE};
+    for (int i = 0; i < NUM_BLOCKS; ++i) {
+        MineBlock(script_pub);
+    }
+
+    BlockFilterIndex filter_index(BlockFilterType::BASIC, 1 << 20, true, false, filter_cache_bytes);
+    filter_index.Start();
+    while (!filter_index.BlockUntilSyncedToCurrentChain()) {
+        MilliSleep(10);
+    }
+
+    const CBlockIndex* tip;
+    {
+        LOCK(cs_main);
+        tip = ::ChainActive().Tip();
+    }
+    std::vector<BlockFilter> filters;
+    while (state.KeepRunning()) {
+        bool found = filter_index.LookupFilterRange(1, tip, filters);
+        assert(found && filters.size() == NUM_BLOCKS);
+    }
+
+    filter_index.Interrupt();
+    filter_index.Stop();
+}
+
+static void BlockFilterIndexRangeDisk(benchmark::State& state)
+{
+    BlockFilterIndexRange(state, 0);
+}
+
+static void BlockFilterIndexRangeCached(benchmark::State& state)
+{
+    BlockFilterIndexRange(state, DEFAULT_FILTER_CACHE_BYTES);
+}
+
+BENCHMARK(BlockFilterIndexRangeDisk, 20);
+BENCHMARK(BlockFilterIndexRangeCached, 50);
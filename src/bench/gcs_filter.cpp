@@ -0,0 +1,70 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <blockfilter.h>
+#include <script/script.h>
+
+#include <vector>
+
+static GCSFilter::ElementSet MakeElements(int count, unsigned char tag)
+{
+    GCSFilter::ElementSet elements;
+    for (int i = 0; i < count; ++i) {
+        GCSFilter::Element element(32);
+        element[0] = tag;
+        element[1] = static_cast<unsigned char>(i);
+        element[2] = static_cast<unsigned char>(i >> 8);
+        elements.insert(std::move(element));
+    }
+    return elements;
+}
+
+static void ConstructGCSFilter(benchmark::State& state)
+{
+    GCSFilter::ElementSet elements = MakeElements(10000, 1);
+
+    uint64_t siphash_k0 = 0;
+    while (state.KeepRunning()) {
+        GCSFilter filter({siphash_k0, 0, 20, 1 << 20}, elements);
+
+        siphash_k0++;
+    }
+}
+
+static void DecodeGCSFilter(benchmark::State& state)
+{
+    GCSFilter filter({0, 0, 20, 1 << 20}, MakeElements(10000, 1));
+    const std::vector<unsigned char>& encoded = filter.GetEncoded();
+
+    while (state.KeepRunning()) {
+        GCSFilter decoded(filter.GetParams(), encoded);
+    }
+}
+
+// Matches 10000 wallet scripts, none of them present, against 100 block
+// filters of a few hundred elements each.
+static void MatchAnyBlockFilters(benchmark::State& state)
+{
+    std::vector<BlockFilter> filters;
+    for (int i = 0; i < 100; ++i) {
+        CMutableTransaction tx;
+        for (int j = 0; j < 300; ++j) {
+            tx.vout.emplace_back(1, CScript() << OP_1 << i << j);
+        }
+        CBlock block;
+        block.nNonce = i;
+        block.vtx.push_back(MakeTransactionRef(tx));
+        filters.emplace_back(BlockFilterType::BASIC, block, CBlockUndo());
+    }
+    const GCSFilter::ElementSet scripts = MakeElements(10000, 2);
+
+    while (state.KeepRunning()) {
+        MatchAnyBlockFilter(filters, scripts);
+    }
+}
+
+BENCHMARK(ConstructGCSFilter, 1000);
+BENCHMARK(DecodeGCSFilter, 1000);
+BENCHMARK(MatchAnyBlockFilters, 20);
@@ -0,0 +1,45 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <node/txrequest.h>
+#include <random.h>
+
+#include <assert.h>
+#include <vector>
+
+// Simulates one second of relay at 10k transactions per second with 1000
+// peers, each of which announces a random 1 in 8 of the transactions. Every
+// peer is then polled for requestable transactions, as SendMessages does.
+static void TxRequestAnnounce(benchmark::State& state)
+{
+    static constexpr int NUM_PEERS = 1000;
+    static constexpr int TXS_PER_SECOND = 10000;
+
+    FastRandomContext rng(true);
+    std::vector<uint256> txhashes;
+    for (int i = 0; i < TXS_PER_SECOND; ++i) txhashes.push_back(rng.rand256());
+
+    while (state.KeepRunning()) {
+        TxRequestTracker tracker;
+        int64_t now = 0;
+        for (const uint256& txhash : txhashes) {
+            now += 100; // 10k announcements per second
+            for (NodeId peer = 0; peer < NUM_PEERS; ++peer) {
+                if (rng.randbits(3) != 0) continue;
+                tracker.ReceivedInv(peer, txhash, peer % 8 == 0, now + (peer % 8 == 0 ? 0 : 2000000));
+            }
+        }
+        now += 2000000;
+        for (NodeId peer = 0; peer < NUM_PEERS; ++peer) {
+            for (const uint256& txhash : tracker.GetRequestable(peer, now)) {
+                tracker.RequestedTx(peer, txhash, now + 60000000);
+            }
+        }
+        for (const uint256& txhash : txhashes) tracker.ForgetTxHash(txhash);
+        assert(tracker.Size() == 0);
+    }
+}
+
+BENCHMARK(TxRequestAnnounce, 1);
@@ -13,7 +13,8 @@
 #include <validation.h>
 #include <util.h>
 
-#include <unordered_map>
+#include <limits>
+#include <vector>
 
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
@@ -44,6 +45,70 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
 }
 
 
+namespace {
+/**
+ * Map from a compact block's short IDs to their positions in the block.
+ *
+ * InitData looks up every mempool and extra transaction in this map, so its
+ * cost grows with the mempool rather than the block. It is therefore a flat,
+ * linearly probed array sized for the block (at most half full), which stays
+ * in cache and mostly answers a miss after touching a single slot.
+ * The short IDs are chosen by the peer, so slots are picked with a randomly
+ * keyed multiplicative hash and probe sequences are bounded.
+ */
+class ShortIdTable
+{
+public:
+    /** Give up on a block whose short IDs need longer probe sequences than this. */
+    static constexpr size_t MAX_PROBES = 32;
+
+    explicit ShortIdTable(size_t count) : m_mul(GetRand(std::numeric_limits<uint64_t>::max()) | 1)
+    {
+        m_bits = 1;
+        while ((size_t{1} << m_bits) < 2 * count) m_bits++;
+        m_keys.assign(size_t{1} << m_bits, uint64_t{EMPTY});
+        m_positions.resize(m_keys.size());
+    }
+
+    /** Returns false on a duplicate short ID or an overlong probe sequence. */
+    bool Insert(uint64_t shortid, uint16_t position)
+    {
+        size_t slot = Slot(shortid);
+        for (size_t probes = 0; probes < MAX_PROBES; probes++) {
+            if (m_keys[slot] == EMPTY) {
+                m_keys[slot] = shortid;
+                m_positions[slot] = position;
+                return true;
+            }
+            if (m_keys[slot] == shortid) return false;
+            slot = (slot + 1) & (m_keys.size() - 1);
+        }
+        return false;
+    }
+
+    /** Returns the position of shortid in the block, or -1. */
+    int Find(uint64_t shortid) const
+    {
+        size_t slot = Slot(shortid);
+        while (m_keys[slot] != EMPTY) {
+            if (m_keys[slot] == shortid) return m_positions[slot];
+            slot = (slot + 1) & (m_keys.size() - 1);
+        }
+        return -1;
+    }
+
+private:
+    /** Short IDs are 48 bits, so this never collides with a real one. */
+    static constexpr uint64_t EMPTY = std::numeric_limits<uint64_t>::max();
+
+    size_t Slot(uint64_t shortid) const { return (shortid * m_mul) >> (64 - m_bits); }
+
+    const uint64_t m_mul;
+    int m_bits;
+    std::vector<uint64_t> m_keys;
+    std::vector<uint16_t> m_positions;
+};
+} // namespace
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn) {
     if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
@@ -77,48 +142,36 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     // Because well-formed cmpctblock messages will have a (relatively) uniform distribution
     // of short IDs, any highly-uneven distribution of elements can be safely treated as a
     // READ_STATUS_FAILED.
-    std::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    ShortIdTable shorttxids(cmpctblock.shorttxids.size());
     uint16_t index_offset = 0;
     for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
         while (txn_available[i + index_offset])
             index_offset++;
-        shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
-        // To determine the chance that the number of entries in a bucket exceeds N,
-        // we use the fact that the number of elements in a single bucket is
-        // binomially distributed (with n = the number of shorttxids S, and p =
-        // 1 / the number of buckets), that in the worst case the number of buckets is
-        // equal to S (due to std::unordered_map having a default load factor of 1.0),
-        // and that the chance for any bucket to exceed N elements is at most
-        // buckets * (the chance that any given bucket is above N elements).
-        // Thus: P(max_elements_per_bucket > N) <= S * (1 - cdf(binomial(n=S,p=1/S), N)).
-        // If we assume blocks of up to 16000, allowing 12 elements per bucket should
-        // only fail once per ~1 million block transfers (per peer and connection).
-        if (shorttxids.bucket_size(shorttxids.bucket(cmpctblock.shorttxids[i])) > 12)
-            return READ_STATUS_FAILED;
+        // With the table at most half full, a probe sequence longer than
+        // ShortIdTable::MAX_PROBES is vanishingly unlikely for honest short IDs.
+        // TODO: in the shortid-collision case, we should instead request both transactions
+        // which collided. Falling back to full-block-request here is overkill.
+        if (!shorttxids.Insert(cmpctblock.shorttxids[i], i + index_offset))
+            return READ_STATUS_FAILED; // Short ID collision
     }
-    // TODO: in the shortid-collision case, we should instead request both transactions
-    // which collided. Falling back to full-block-request here is overkill.
-    if (shorttxids.size() != cmpctblock.shorttxids.size())
-        return READ_STATUS_FAILED; // Short ID collision
 
     std::vector<bool> have_txn(txn_available.size());
     {
     LOCK(pool->cs);
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
     for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
+        int idx = shorttxids.Find(cmpctblock.GetShortID(vTxHashes[i].first));
+        if (idx >= 0) {
+            if (!have_txn[idx]) {
+                txn_available[idx] = vTxHashes[i].second->GetSharedTx();
+                have_txn[idx]  = true;
                 mempool_count++;
             } else {
                 // If we find two mempool txn that match the short id, just request it.
                 // This should be rare enough that the extra bandwidth doesn't matter,
                 // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
+                if (txn_available[idx]) {
+                    txn_available[idx].reset();
                     mempool_count--;
                 }
             }
@@ -126,18 +179,17 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
         // Though ideally we'd continue scanning for the two-txn-match-shortid case,
         // the performance win of an early exit here is too good to pass up and worth
         // the extra risk.
-        if (mempool_count == shorttxids.size())
+        if (mempool_count == cmpctblock.shorttxids.size())
             break;
     }
     }
 
     for (size_t i = 0; i < extra_txn.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(extra_txn[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = extra_txn[i].second;
-                have_txn[idit->second]  = true;
+        int idx = shorttxids.Find(cmpctblock.GetShortID(extra_txn[i].first));
+        if (idx >= 0) {
+            if (!have_txn[idx]) {
+                txn_available[idx] = extra_txn[i].second;
+                have_txn[idx]  = true;
                 mempool_count++;
                 extra_count++;
             } else {
@@ -147,9 +199,9 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
                 // but eating a round-trip due to FillBlock failure would be annoying
                 // Note that we don't want duplication between extra_txn and mempool to
                 // trigger this case, so we compare witness hashes first
-                if (txn_available[idit->second] &&
-                        txn_available[idit->second]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
-                    txn_available[idit->second].reset();
+                if (txn_available[idx] &&
+                        txn_available[idx]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
+                    txn_available[idx].reset();
                     mempool_count--;
                     extra_count--;
                 }
@@ -158,7 +210,7 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
         // Though ideally we'd continue scanning for the two-txn-match-shortid case,
         // the performance win of an early exit here is too good to pass up and worth
         // the extra risk.
-        if (mempool_count == shorttxids.size())
+        if (mempool_count == cmpctblock.shorttxids.size())
             break;
     }
 
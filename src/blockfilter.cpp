@@ -6,6 +6,7 @@
 #include <sstream>
 
 #include <blockfilter.h>
+#include <crypto/common.h>
 #include <crypto/siphash.h>
 #include <hash.h>
 #include <primitives/transaction.h>
@@ -39,19 +40,89 @@ static void GolombRiceEncode(BitStreamWriter<OStream>& bitwriter, uint8_t P, uin
     bitwriter.Write(x, P);
 }
 
-template <typename IStream>
-static uint64_t GolombRiceDecode(BitStreamReader<IStream>& bitreader, uint8_t P)
+/**
+ * Reads Golomb-Rice coded values out of an encoded filter. Bits are buffered
+ * a 64-bit word at a time, so the unary quotient is measured with a single
+ * leading-ones count and the remainder taken with one shift, instead of
+ * reading every bit separately.
+ */
+class GolombRiceReader
 {
-    // Read unary-encoded quotient: q 1's followed by one 0.
-    uint64_t q = 0;
-    while (bitreader.Read(1) == 1) {
-        ++q;
+private:
+    const unsigned char* m_pos;
+    const unsigned char* const m_end;
+    uint64_t m_buffer{0};  //!< Unread bits, most significant first
+    int m_bits{0};         //!< Number of unread bits in m_buffer
+
+    void Refill()
+    {
+        if (m_end - m_pos >= 8) {
+            // Load a whole word and keep as many complete bytes of it as fit.
+            // Bits below m_bits are either zero or the same bits that the
+            // next load will OR in again, so they can be left in place.
+            m_buffer |= ReadBE64(m_pos) >> m_bits;
+            m_pos += (63 - m_bits) >> 3;
+            m_bits |= 56;
+            return;
+        }
+        while (m_bits <= 56 && m_pos != m_end) {
+            m_buffer |= uint64_t{*m_pos++} << (56 - m_bits);
+            m_bits += 8;
+        }
     }
 
-    uint64_t r = bitreader.Read(P);
+    void Skip(int nbits)
+    {
+        m_buffer = nbits < 64 ? m_buffer << nbits : 0;
+        m_bits -= nbits;
+    }
 
-    return (q << P) + r;
-}
+public:
+    GolombRiceReader(const unsigned char* begin, const unsigned char* end)
+        : m_pos(begin), m_end(end) {}
+
+    /** Read nbits (at most 64) bits as a big-endian integer. */
+    uint64_t Read(int nbits)
+    {
+        uint64_t data = 0;
+        while (nbits > 0) {
+            if (m_bits < nbits) Refill();
+            if (m_bits == 0) {
+                throw std::ios_base::failure("GolombRiceReader::Read(): end of data");
+            }
+            int n = std::min(nbits, m_bits);
+            data = (n < 64 ? data << n : 0) | (m_buffer >> (64 - n));
+            Skip(n);
+            nbits -= n;
+        }
+        return data;
+    }
+
+    uint64_t Decode(uint8_t P)
+    {
+        // Read unary-encoded quotient: q 1's followed by one 0.
+        uint64_t q = 0;
+        while (true) {
+            if (m_bits < 64) Refill();
+            if (m_bits == 0) {
+                throw std::ios_base::failure("GolombRiceReader::Decode(): end of data");
+            }
+            int ones = 64 - CountBits(~m_buffer);
+            if (ones < m_bits) {
+                q += ones;
+                Skip(ones + 1);
+                break;
+            }
+            q += m_bits;
+            Skip(m_bits);
+        }
+
+        return (q << P) + Read(P);
+    }
+
+    /** Whether whole bytes are left unread, beyond the padding of the last one. */
+    bool HasExcessData() const { return m_pos != m_end || m_bits >= 8; }
+};
 
 // Map a value x that is uniformly distributed in the range [0, 2^64) to a
 // value uniformly distributed in [0, n) by returning the upper 64 bits of
@@ -121,11 +192,11 @@ GCSFilter::GCSFilter(const Params& params, std::vector<unsigned char> encoded_fi
 
     // Verify that the encoded filter contains exactly N elements. If it has too much or too little
     // data, a std::ios_base::failure exception will be raised.
-    BitStreamReader<VectorReader> bitreader(stream);
+    GolombRiceReader reader(m_encoded.data() + GetSizeOfCompactSize(N), m_encoded.data() + m_encoded.size());
     for (uint64_t i = 0; i < m_N; ++i) {
-        GolombRiceDecode(bitreader, m_params.m_P);
+        reader.Decode(m_params.m_P);
     }
-    if (!stream.empty()) {
+    if (reader.HasExcessData()) {
         throw std::ios_base::failure("encoded_filter contains excess data");
     }
 }
@@ -162,36 +233,41 @@ GCSFilter::GCSFilter(const Params& params, const ElementSet& elements)
 
 bool GCSFilter::MatchInternal(const uint64_t* element_hashes, size_t size) const
 {
-    VectorReader stream(GCS_SER_TYPE, GCS_SER_VERSION, m_encoded, 0);
-
-    // Seek forward by size of N
-    uint64_t N = ReadCompactSize(stream);
-    assert(N == m_N);
-
-    BitStreamReader<VectorReader> bitreader(stream);
+    // Skip over N
+    GolombRiceReader reader(m_encoded.data() + GetSizeOfCompactSize(m_N), m_encoded.data() + m_encoded.size());
 
+    // Query sets may be much larger than the filter, e.g. all of a wallet's
+    // scripts, so binary search for each decoded value rather than walking
+    // the query hashes one by one.
+    const uint64_t* hashes_end = element_hashes + size;
     uint64_t value = 0;
-    size_t hashes_index = 0;
     for (uint32_t i = 0; i < m_N; ++i) {
-        uint64_t delta = GolombRiceDecode(bitreader, m_params.m_P);
+        uint64_t delta = reader.Decode(m_params.m_P);
         value += delta;
 
-        while (true) {
-            if (hashes_index == size) {
-                return false;
-            } else if (element_hashes[hashes_index] == value) {
-                return true;
-            } else if (element_hashes[hashes_index] > value) {
-                break;
-            }
-
-            hashes_index++;
+        element_hashes = std::lower_bound(element_hashes, hashes_end, value);
+        if (element_hashes == hashes_end) {
+            return false;
+        } else if (*element_hashes == value) {
+            return true;
         }
     }
 
     return false;
 }
 
+void GCSFilter::Decode(std::vector<uint64_t>& values) const
+{
+    GolombRiceReader reader(m_encoded.data() + GetSizeOfCompactSize(m_N), m_encoded.data() + m_encoded.size());
+
+    values.resize(m_N);
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < m_N; ++i) {
+        value += reader.Decode(m_params.m_P);
+        values[i] = value;
+    }
+}
+
 bool GCSFilter::Match(const Element& element) const
 {
     uint64_t query = HashToRange(element);
@@ -204,6 +280,42 @@ bool GCSFilter::MatchAny(const ElementSet& elements) const
     return MatchInternal(queries.data(), queries.size());
 }
 
+std::vector<size_t> MatchAnyBlockFilter(const std::vector<BlockFilter>& filters, const GCSFilter::ElementSet& elements)
+{
+    // Copy the elements into one contiguous buffer up front, rather than
+    // walking the hash set's nodes again for every filter.
+    std::vector<unsigned char> element_data;
+    std::vector<size_t> element_ends;
+    element_ends.reserve(elements.size());
+    for (const GCSFilter::Element& element : elements) {
+        element_data.insert(element_data.end(), element.begin(), element.end());
+        element_ends.push_back(element_data.size());
+    }
+
+    std::vector<size_t> matches;
+    std::vector<uint64_t> filter_values;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const GCSFilter& filter = filters[i].GetFilter();
+        if (filter.m_N == 0) continue;
+
+        // Each filter is keyed by its block hash, so elements have to be
+        // hashed again for every filter. Decoding the filter once and
+        // searching it for each hash avoids sorting the hashes each time.
+        filter.Decode(filter_values);
+        const CSipHasher hasher(filter.m_params.m_siphash_k0, filter.m_params.m_siphash_k1);
+        size_t begin = 0;
+        for (size_t end : element_ends) {
+            uint64_t hash = CSipHasher(hasher).Write(element_data.data() + begin, end - begin).Finalize();
+            begin = end;
+            if (std::binary_search(filter_values.begin(), filter_values.end(), MapIntoRange(hash, filter.m_F))) {
+                matches.push_back(i);
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
 const std::string& BlockFilterTypeName(BlockFilterType filter_type)
 {
     static std::string unknown_retval = "";
@@ -16,6 +16,8 @@
 #include <undo.h>
 #include <util/bytevectorhash.h>
 
+class BlockFilter;
+
 /**
  * This implements a Golomb-coded set as defined in BIP 158. It is a
  * compact, probabilistic data structure for testing set membership.
@@ -52,6 +54,11 @@ private:
     /** Helper method used to implement Match and MatchAny */
     bool MatchInternal(const uint64_t* sorted_element_hashes, size_t size) const;
 
+    /** Decode the hashes of all elements in the filter, in ascending order. */
+    void Decode(std::vector<uint64_t>& values) const;
+
+    friend std::vector<size_t> MatchAnyBlockFilter(const std::vector<BlockFilter>& filters, const ElementSet& elements);
+
 public:
 
     /** Constructs an empty filter. */
@@ -143,8 +150,8 @@ public:
 
     template <typename Stream>
     void Serialize(Stream& s) const {
-        s << m_block_hash
-          << static_cast<uint8_t>(m_filter_type)
+        s << static_cast<uint8_t>(m_filter_type)
+          << m_block_hash
           << m_filter.GetEncoded();
     }
 
@@ -153,8 +160,8 @@ public:
         std::vector<unsigned char> encoded_filter;
         uint8_t filter_type;
 
-        s >> m_block_hash
-          >> filter_type
+        s >> filter_type
+          >> m_block_hash
           >> encoded_filter;
 
         m_filter_type = static_cast<BlockFilterType>(filter_type);
@@ -167,4 +174,12 @@ public:
     }
 };
 
+/**
+ * Checks which of the block filters may contain any of the given elements, as
+ * calling MatchAny on each of them would, and returns the positions of those
+ * that do. Meant for matching many scripts against a run of filters, e.g. in
+ * a wallet rescan.
+ */
+std::vector<size_t> MatchAnyBlockFilter(const std::vector<BlockFilter>& filters, const GCSFilter::ElementSet& elements);
+
 #endif // BITCOIN_BLOCKFILTER_H
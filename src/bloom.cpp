@@ -130,7 +130,52 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+static void AppendPushes(const CScript& script, std::vector<std::vector<unsigned char>>& vElements)
+{
+    CScript::const_iterator pc = script.begin();
+    std::vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            vElements.push_back(std::move(data));
+    }
+}
+
+CBloomTxElements::CBloomTxElements(const CTransaction& txIn) : tx(txIn)
+{
+    const uint256& hash = tx.GetHash();
+    vElements.emplace_back(hash.begin(), hash.end());
+
+    vOutputEnds.reserve(tx.vout.size());
+    for (const CTxOut& txout : tx.vout)
+    {
+        AppendPushes(txout.scriptPubKey, vElements);
+        vOutputEnds.push_back(vElements.size());
+    }
+
+    for (const CTxIn& txin : tx.vin)
+    {
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << txin.prevout;
+        vElements.emplace_back(stream.begin(), stream.end());
+        AppendPushes(txin.scriptSig, vElements);
+    }
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    // Avoid extracting anything for filters that match everything or nothing.
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -139,25 +184,21 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         return true;
     if (isEmpty)
         return false;
+    const CTransaction& tx = elements.tx;
     const uint256& hash = tx.GetHash();
-    if (contains(hash))
+    if (contains(elements.vElements[0]))
         fFound = true;
 
+    size_t nElement = 1;
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        std::vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (; nElement < elements.vOutputEnds[i]; nElement++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.vElements[nElement]))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
@@ -166,35 +207,26 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
                 {
                     txnouttype type;
                     std::vector<std::vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
+                    if (Solver(tx.vout[i].scriptPubKey, type, vSolutions) &&
                             (type == TX_PUBKEY || type == TX_MULTISIG))
                         insert(COutPoint(hash, i));
                 }
                 break;
             }
         }
+        nElement = elements.vOutputEnds[i];
     }
 
     if (fFound)
         return true;
 
-    for (const CTxIn& txin : tx.vin)
+    // Match if the filter contains an outpoint tx spends, or any arbitrary
+    // script data element in any scriptSig in tx. These are the remaining
+    // elements, each input's prevout followed by its pushes.
+    for (; nElement < elements.vElements.size(); nElement++)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(elements.vElements[nElement]))
             return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        std::vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
     }
 
     return false;
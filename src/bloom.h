@@ -30,6 +30,29 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that CBloomFilter::IsRelevantAndUpdate
+ * tests: its txid, the data pushes of its scripts and the outpoints it
+ * spends. Extracting them once lets a transaction be checked against the
+ * filters of many peers without parsing its scripts and serializing its
+ * outpoints again for each. The transaction must outlive this object.
+ */
+class CBloomTxElements
+{
+private:
+    const CTransaction& tx;
+    //! The txid, each output's scriptPubKey pushes, then each input's
+    //! serialized prevout followed by its scriptSig pushes
+    std::vector<std::vector<unsigned char>> vElements;
+    //! For each output, the index in vElements past its last push
+    std::vector<uint32_t> vOutputEnds;
+
+    friend class CBloomFilter;
+
+public:
+    explicit CBloomTxElements(const CTransaction& txIn);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -98,6 +121,9 @@ public:
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
 
+    //! Same as above, using data elements extracted beforehand
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
+
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
@@ -52,6 +52,10 @@ private:
     //! The temporary evaluation result.
     bool fAllOk;
 
+    //! The first check that failed, if fHaveFailedCheck.
+    T failedCheck;
+    bool fHaveFailedCheck;
+
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
@@ -63,19 +67,31 @@ private:
     unsigned int nBatchSize;
 
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(bool fMaster = false, T* pfailedCheck = nullptr)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
         bool fOk = true;
+        T localFailedCheck;
+        bool fLocalFailed = false;
         do {
             {
                 boost::unique_lock<boost::mutex> lock(mutex);
                 // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
                 if (nNow) {
                     fAllOk &= fOk;
+                    if (fLocalFailed) {
+                        // only the first failure is kept; drop later ones here
+                        T check;
+                        check.swap(localFailedCheck);
+                        if (!fHaveFailedCheck) {
+                            failedCheck.swap(check);
+                            fHaveFailedCheck = true;
+                        }
+                        fLocalFailed = false;
+                    }
                     nTodo -= nNow;
                     if (nTodo == 0 && !fMaster)
                         // We processed the last element; inform the master it can exit and return the result
@@ -89,9 +105,15 @@ private:
                     if (fMaster && nTodo == 0) {
                         nTotal--;
                         bool fRet = fAllOk;
+                        if (pfailedCheck && fHaveFailedCheck)
+                            pfailedCheck->swap(failedCheck);
                         // reset the status for new work later
-                        if (fMaster)
+                        if (fMaster) {
                             fAllOk = true;
+                            fHaveFailedCheck = false;
+                            T check;
+                            check.swap(failedCheck);
+                        }
                         // return the current status
                         return fRet;
                     }
@@ -117,8 +139,10 @@ private:
             }
             // execute work
             for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
+                if (fOk && !(fOk = check())) {
+                    check.swap(localFailedCheck);
+                    fLocalFailed = true;
+                }
             vChecks.clear();
         } while (true);
     }
@@ -128,7 +152,7 @@ public:
     boost::mutex ControlMutex;
 
     //! Create a new check queue
-    explicit CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
+    explicit CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), fHaveFailedCheck(false), nTodo(0), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
@@ -137,9 +161,10 @@ public:
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
-    bool Wait()
+    //! If not, the first check that failed is swapped into pfailedCheck when given.
+    bool Wait(T* pfailedCheck = nullptr)
     {
-        return Loop(true);
+        return Loop(true, pfailedCheck);
     }
 
     //! Add a batch of checks to the queue
@@ -186,11 +211,11 @@ public:
         }
     }
 
-    bool Wait()
+    bool Wait(T* pfailedCheck = nullptr)
     {
         if (pqueue == nullptr)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(pfailedCheck);
         fDone = true;
         return fRet;
     }
@@ -102,8 +102,19 @@ typedef void* sockopt_arg_type;
 typedef char* sockopt_arg_type;
 #endif
 
+// The socket handler waits on sockets with epoll on Linux and poll() on other
+// POSIX systems; both have no limit on descriptor values, unlike select().
+// WIN32 poll is broken https://daniel.haxx.se/blog/2012/10/10/wsapoll-is-broken/
+// __APPLE__ poll is broken for some descriptor types, so it keeps using select().
+#if defined(__linux__)
+#define USE_EPOLL
+#endif
+#if !defined(WIN32) && !defined(__APPLE__)
+#define USE_POLL
+#endif
+
 bool static inline IsSelectableSocket(const SOCKET& s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -31,6 +31,12 @@ constexpr char DB_FILTER_POS = 'P';
 constexpr unsigned int MAX_FLTR_FILE_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for fltr?????.dat files */
 constexpr unsigned int FLTR_FILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Maximum number of checkpoint filter headers kept in memory (a chain of 2 million blocks) */
+constexpr size_t CF_HEADERS_CACHE_MAX_SZ{2000};
+/** Maximum number of other recently used filter headers kept in memory */
+constexpr size_t RECENT_HEADERS_CACHE_SIZE{10000};
+/** Buffer size for reading runs of filters from a fltr?????.dat file */
+constexpr size_t FLTR_READ_BUFFER_SIZE{1 << 16};
 
 namespace {
 
@@ -96,9 +102,19 @@ struct DBHashKey {
 
 static std::map<BlockFilterType, BlockFilterIndex> g_filter_indexes;
 
+static size_t HeaderCost(const uint256&) { return 1; }
+
+static size_t FilterCost(const BlockFilter& filter)
+{
+    return sizeof(BlockFilter) + filter.GetEncodedFilter().size();
+}
+
 BlockFilterIndex::BlockFilterIndex(BlockFilterType filter_type,
-                                   size_t n_cache_size, bool f_memory, bool f_wipe)
-    : m_filter_type(filter_type)
+                                   size_t n_cache_size, bool f_memory, bool f_wipe,
+                                   size_t filter_cache_bytes)
+    : m_filter_type(filter_type),
+      m_recent_headers(RECENT_HEADERS_CACHE_SIZE, HeaderCost),
+      m_recent_filters(filter_cache_bytes, FilterCost)
 {
     const std::string& filter_name = BlockFilterTypeName(filter_type);
     if (filter_name.empty()) throw std::invalid_argument("unknown filter_type");
@@ -166,6 +182,46 @@ bool BlockFilterIndex::ReadFilterFromDisk(const FlatFilePos& pos, BlockFilter& f
     return true;
 }
 
+bool BlockFilterIndex::ReadFiltersFromDisk(const std::vector<FlatFilePos>& positions,
+                                           std::vector<BlockFilter>& filters_out) const
+{
+    filters_out.resize(positions.size());
+
+    std::unique_ptr<CAutoFile> filein;
+    // Position of the next unread byte of filein
+    FlatFilePos next_pos;
+    for (size_t i = 0; i < positions.size(); ++i) {
+        const FlatFilePos& pos = positions[i];
+        if (!filein || pos.nFile != next_pos.nFile) {
+            FILE* file = m_filter_fileseq->Open(FlatFilePos(pos.nFile, 0), true);
+            if (!file) {
+                return false;
+            }
+            // Runs of filters are read through a larger buffer than stdio's default.
+            setvbuf(file, nullptr, _IOFBF, FLTR_READ_BUFFER_SIZE);
+            filein.reset(new CAutoFile(file, SER_DISK, CLIENT_VERSION));
+            next_pos = FlatFilePos(pos.nFile, 0);
+        }
+        if (pos.nPos != next_pos.nPos && fseek(filein->Get(), pos.nPos, SEEK_SET)) {
+            return error("%s: Failed to seek to %s", __func__, pos.ToString());
+        }
+
+        uint256 block_hash;
+        std::vector<unsigned char> encoded_filter;
+        try {
+            *filein >> block_hash >> encoded_filter;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Failed to deserialize block filter from disk: %s", __func__, e.what());
+        }
+        next_pos.nPos = pos.nPos + GetSerializeSize(block_hash, CLIENT_VERSION) +
+                        GetSerializeSize(encoded_filter, CLIENT_VERSION);
+        filters_out[i] = BlockFilter(GetFilterType(), block_hash, std::move(encoded_filter));
+    }
+
+    return true;
+}
+
 size_t BlockFilterIndex::WriteFilterToDisk(FlatFilePos& pos, const BlockFilter& filter)
 {
     assert(filter.GetFilterType() == GetFilterType());
@@ -252,6 +308,18 @@ bool BlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex
     }
 
     m_next_filter_pos.nPos += bytes_written;
+
+    // Filters of new blocks are the ones light clients ask for first.
+    {
+        LOCK(m_cs_headers_cache);
+        if (pindex->nHeight % CFCHECKPT_INTERVAL != 0) {
+            m_recent_headers.Insert(value.first, value.second.header);
+        }
+    }
+    {
+        LOCK(m_cs_filter_cache);
+        m_recent_filters.Insert(value.first, filter);
+    }
     return true;
 }
 
@@ -379,21 +447,58 @@ static bool LookupRange(CDBWrapper& db, const std::string& index_name, int start
 
 bool BlockFilterIndex::LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const
 {
+    {
+        LOCK(m_cs_filter_cache);
+        if (m_recent_filters.Get(block_index->GetBlockHash(), filter_out)) {
+            return true;
+        }
+    }
+
     DBVal entry;
     if (!LookupOne(*m_db, block_index, entry)) {
         return false;
     }
 
-    return ReadFilterFromDisk(entry.pos, filter_out);
+    if (!ReadFilterFromDisk(entry.pos, filter_out)) {
+        return false;
+    }
+
+    LOCK(m_cs_filter_cache);
+    m_recent_filters.Insert(block_index->GetBlockHash(), filter_out);
+    return true;
 }
 
 bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const
 {
+    LOCK(m_cs_headers_cache);
+
+    // Checkpoint headers are cached by block hash, so a header of a block
+    // that was reorganized out of the active chain is never returned for
+    // the block that replaced it.
+    bool is_checkpoint{block_index->nHeight % CFCHECKPT_INTERVAL == 0};
+    if (is_checkpoint) {
+        auto header = m_headers_cache.find(block_index->GetBlockHash());
+        if (header != m_headers_cache.end()) {
+            header_out = header->second;
+            return true;
+        }
+    } else if (m_recent_headers.Get(block_index->GetBlockHash(), header_out)) {
+        return true;
+    }
+
     DBVal entry;
     if (!LookupOne(*m_db, block_index, entry)) {
         return false;
     }
 
+    if (is_checkpoint) {
+        if (m_headers_cache.size() < CF_HEADERS_CACHE_MAX_SZ) {
+            m_headers_cache.emplace(block_index->GetBlockHash(), entry.header);
+        }
+    } else {
+        m_recent_headers.Insert(block_index->GetBlockHash(), entry.header);
+    }
+
     header_out = entry.header;
     return true;
 }
@@ -401,20 +506,50 @@ bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* block_index, uint25
 bool BlockFilterIndex::LookupFilterRange(int start_height, const CBlockIndex* stop_index,
                                          std::vector<BlockFilter>& filters_out) const
 {
+    if (start_height < 0 || start_height > stop_index->nHeight) {
+        // Let LookupRange report the invalid range.
+        std::vector<DBVal> entries;
+        return LookupRange(*m_db, m_name, start_height, stop_index, entries);
+    }
+
+    // Fill in what is cached, and note the span of heights that is not.
+    filters_out.resize(static_cast<size_t>(stop_index->nHeight - start_height + 1));
+    int miss_start = stop_index->nHeight + 1;
+    const CBlockIndex* miss_stop_index = nullptr;
+    {
+        LOCK(m_cs_filter_cache);
+        for (const CBlockIndex* block_index = stop_index;
+             block_index && block_index->nHeight >= start_height;
+             block_index = block_index->pprev) {
+            size_t i = static_cast<size_t>(block_index->nHeight - start_height);
+            if (m_recent_filters.Get(block_index->GetBlockHash(), filters_out[i])) continue;
+            if (!miss_stop_index) miss_stop_index = block_index;
+            miss_start = block_index->nHeight;
+        }
+    }
+    if (!miss_stop_index) {
+        return true;
+    }
+
     std::vector<DBVal> entries;
-    if (!LookupRange(*m_db, m_name, start_height, stop_index, entries)) {
+    if (!LookupRange(*m_db, m_name, miss_start, miss_stop_index, entries)) {
         return false;
     }
-
-    filters_out.resize(entries.size());
-    auto filter_pos_it = filters_out.begin();
+    std::vector<FlatFilePos> positions;
+    positions.reserve(entries.size());
     for (const auto& entry : entries) {
-        if (!ReadFilterFromDisk(entry.pos, *filter_pos_it)) {
-            return false;
-        }
-        ++filter_pos_it;
+        positions.push_back(entry.pos);
+    }
+    std::vector<BlockFilter> filters;
+    if (!ReadFiltersFromDisk(positions, filters)) {
+        return false;
     }
 
+    LOCK(m_cs_filter_cache);
+    for (size_t i = 0; i < filters.size(); ++i) {
+        m_recent_filters.Insert(filters[i].GetBlockHash(), filters[i]);
+        filters_out[miss_start - start_height + i] = std::move(filters[i]);
+    }
     return true;
 }
 
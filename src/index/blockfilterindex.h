@@ -7,8 +7,75 @@
 
 #include <blockfilter.h>
 #include <chain.h>
+#include <crypto/common.h>
 #include <flatfile.h>
 #include <index/base.h>
+#include <sync.h>
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+/** Interval between compact filter checkpoints. See BIP 157. */
+static constexpr int CFCHECKPT_INTERVAL = 1000;
+
+/** Default size of the in-memory cache of recently used filters, in bytes */
+static constexpr size_t DEFAULT_FILTER_CACHE_BYTES = 16 << 20;
+
+struct FilterHeaderHasher
+{
+    size_t operator()(const uint256& hash) const { return ReadLE64(hash.begin()); }
+};
+
+/**
+ * Least recently used cache of values by block hash, bounded by the total
+ * cost of the values as given by CostFn. Not thread-safe; callers provide
+ * locking.
+ */
+template <typename V>
+class BlockHashLRU
+{
+public:
+    typedef size_t (*CostFn)(const V&);
+
+    BlockHashLRU(size_t max_cost, CostFn cost) : m_max_cost(max_cost), m_cost(cost) {}
+
+    /** Copy the value for hash into value_out and mark it most recently used. */
+    bool Get(const uint256& hash, V& value_out)
+    {
+        auto it = m_index.find(hash);
+        if (it == m_index.end()) return false;
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        value_out = it->second->second;
+        return true;
+    }
+
+    /** Add a value, evicting least recently used ones to stay within the cost limit. */
+    void Insert(const uint256& hash, const V& value)
+    {
+        size_t cost = m_cost(value);
+        if (cost > m_max_cost || m_index.count(hash)) return;
+        while (!m_lru.empty() && m_total_cost + cost > m_max_cost) {
+            m_total_cost -= m_cost(m_lru.back().second);
+            m_index.erase(m_lru.back().first);
+            m_lru.pop_back();
+        }
+        m_lru.emplace_front(hash, value);
+        m_index.emplace(hash, m_lru.begin());
+        m_total_cost += cost;
+    }
+
+    size_t Size() const { return m_lru.size(); }
+
+private:
+    typedef std::list<std::pair<uint256, V>> LruList;
+
+    const size_t m_max_cost;
+    const CostFn m_cost;
+    size_t m_total_cost{0};
+    LruList m_lru;
+    std::unordered_map<uint256, typename LruList::iterator, FilterHeaderHasher> m_index;
+};
 
 /**
  * BlockFilterIndex is used to store and retrieve block filters, hashes, and headers for a range of
@@ -28,8 +95,24 @@ private:
     std::unique_ptr<FlatFileSeq> m_filter_fileseq;
 
     bool ReadFilterFromDisk(const FlatFilePos& pos, BlockFilter& filter) const;
+    /**
+     * Read the filters at the given positions. Filters stored back to back
+     * in the same file, as those of consecutive blocks are, are read
+     * sequentially through one buffered file handle.
+     */
+    bool ReadFiltersFromDisk(const std::vector<FlatFilePos>& positions, std::vector<BlockFilter>& filters_out) const;
     size_t WriteFilterToDisk(FlatFilePos& pos, const BlockFilter& filter);
 
+    mutable CCriticalSection m_cs_headers_cache;
+    /** Filter headers of checkpoint blocks by block hash, to answer getcfcheckpt without disk access. */
+    mutable std::unordered_map<uint256, uint256, FilterHeaderHasher> m_headers_cache GUARDED_BY(m_cs_headers_cache);
+    /** Recently used filter headers of other blocks. */
+    mutable BlockHashLRU<uint256> m_recent_headers GUARDED_BY(m_cs_headers_cache);
+
+    mutable CCriticalSection m_cs_filter_cache;
+    /** Recently used or written filters by block hash. */
+    mutable BlockHashLRU<BlockFilter> m_recent_filters GUARDED_BY(m_cs_filter_cache);
+
 protected:
     bool Init() override;
 
@@ -46,17 +129,21 @@ protected:
 public:
     /** Constructs the index, which becomes available to be queried. */
     explicit BlockFilterIndex(BlockFilterType filter_type,
-                              size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+                              size_t n_cache_size, bool f_memory = false, bool f_wipe = false,
+                              size_t filter_cache_bytes = DEFAULT_FILTER_CACHE_BYTES);
 
     BlockFilterType GetFilterType() const { return m_filter_type; }
 
     /** Get a single filter by block. */
     bool LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const;
 
-    /** Get a single filter header by block. */
+    /** Get a single filter header by block. Headers of checkpoint blocks are cached. */
     bool LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const;
 
-    /** Get a range of filters between two heights on a chain. */
+    /**
+     * Get a range of filters between two heights on a chain. Cached filters
+     * are used where possible, and only the remaining span is looked up.
+     */
     bool LookupFilterRange(int start_height, const CBlockIndex* stop_index,
                            std::vector<BlockFilter>& filters_out) const;
 
@@ -35,6 +35,8 @@
 #include <netbase.h>
 #include <net.h>
 #include <net_processing.h>
+#include <node/blockcache.h>
+#include <node/headerssync.h>
 #include <policy/feerate.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
@@ -269,6 +271,7 @@ void Shutdown()
     // destruct and reset all to nullptr.
     peerLogic.reset();
     g_connman.reset();
+    g_block_msg_cache.reset();
     g_txindex.reset();
     DestroyAllBlockFilterIndexes();
 
@@ -440,10 +443,12 @@ void SetupServerArgs()
 >>>>>>> upstream/0.18
     gArgs.AddArg("-debuglogfile=<file>", strprintf("Specify location of debug log file. Relative paths will be prefixed by a net-specific datadir location. (-nodebuglogfile to disable; default: %s)", DEFAULT_DEBUGLOGFILE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER), true, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-headersanchor=<height>:<hash>", "Hash of the best chain block at <height>. Headers between anchors (and checkpoints) are downloaded from several peers at once during initial sync; they are still fully validated. This option can be specified multiple times.", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-includeconf=<file>", "Specify additional configuration file, relative to the -datadir path (only useable from configuration file, not command line)", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-loadblock=<file>", "Imports blocks from external blk000??.dat file on startup", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-maxmempool=<n>", strprintf("Keep the transaction memory pool below <n> megabytes (default: %u)", DEFAULT_MAX_MEMPOOL_SIZE), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-maxorphantx=<n>", strprintf("Keep at most <n> unconnectable transactions in memory (default: %u)", DEFAULT_MAX_ORPHAN_TRANSACTIONS), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-maxorphanweight=<n>", strprintf("Keep unconnectable transactions of at most <n> total weight in memory; peers using the most are evicted from first (default: %u)", DEFAULT_MAX_ORPHAN_WEIGHT), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-mempoolexpiry=<n>", strprintf("Do not keep transactions in the mempool longer than <n> hours (default: %u)", DEFAULT_MEMPOOL_EXPIRY), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-minimumchainwork=<hex>", strprintf("Minimum work assumed to exist on a valid chain in hex (default: %s, testnet: %s)", defaultChainParams->GetConsensus().nMinimumChainWork.GetHex(), testnetChainParams->GetConsensus().nMinimumChainWork.GetHex()), true, OptionsCategory::OPTIONS);
     gArgs.AddArg("-par=<n>", strprintf("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)",
@@ -470,6 +475,7 @@ void SetupServerArgs()
     gArgs.AddArg("-banscore=<n>", strprintf("Threshold for disconnecting misbehaving peers (default: %u)", DEFAULT_BANSCORE_THRESHOLD), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-bantime=<n>", strprintf("Number of seconds to keep misbehaving peers from reconnecting (default: %u)", DEFAULT_MISBEHAVING_BANTIME), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-bind=<addr>", "Bind to given address and always listen on it. Use [host]:port notation for IPv6", false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-blockservecache=<n>", strprintf("Size in MiB of the cache of serialized blocks served to peers, 0 to disable (default: %d)", DEFAULT_BLOCK_SERVE_CACHE), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-connect=<ip>", "Connect only to the specified node; -noconnect disables automatic connections (the rules for this peer are the same as for -addnode). This option can be specified multiple times to connect to multiple nodes.", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-discover", "Discover own IP addresses (default: 1 when listening and no -externalip or -proxy)", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-dns", strprintf("Allow DNS lookups for -addnode, -seednode and -connect (default: %u)", DEFAULT_NAME_LOOKUP), false, OptionsCategory::CONNECTION);
@@ -484,9 +490,13 @@ void SetupServerArgs()
     gArgs.AddArg("-maxsendbuffer=<n>", strprintf("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)", DEFAULT_MAXSENDBUFFER), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-maxtimeadjustment", strprintf("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)", DEFAULT_MAX_TIME_ADJUSTMENT), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-maxuploadtarget=<n>", strprintf("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)", DEFAULT_MAX_UPLOAD_TARGET), false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-msghandlerthreads=<n>", strprintf("Number of threads processing peer messages. Each peer is always handled by the same thread (1 to %d, default: %d)", MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-onion=<ip:port>", "Use separate SOCKS5 proxy to reach peers via Tor hidden services, set -noonion to disable (default: -proxy)", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-onlynet=<net>", "Make outgoing connections only through network <net> (ipv4, ipv6 or onion). Incoming connections are not affected by this option. This option can be specified multiple times to allow multiple networks.", false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-peerblockfilters", strprintf("Serve compact block filters to peers per BIP 157 (default: %u)", DEFAULT_PEERBLOCKFILTERS), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-peerbloomfilters", strprintf("Support filtering of blocks and transaction with bloom filters (default: %u)", DEFAULT_PEERBLOOMFILTERS), false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-peeruploadrate=<n>", strprintf("Limit the upload rate to each peer to <n> KB/s, not counting control messages; whitelisted peers are exempt. 0 = no limit (default: %u)", DEFAULT_PEER_UPLOAD_RATE), false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-peeruploadrateclass=<class>:<n>", "Limit the upload rate of one class of messages (block, cmpctblock, tx or addr) to each peer to <n> KB/s; whitelisted peers are exempt. This option can be specified multiple times to limit several classes.", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-permitbaremultisig", strprintf("Relay non-P2SH multisig (default: %u)", DEFAULT_PERMIT_BAREMULTISIG), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-port=<port>", strprintf("Listen for connections on <port> (default: %u or testnet: %u)", defaultChainParams->GetDefaultPort(), testnetChainParams->GetDefaultPort()), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-proxy=<ip:port>", "Connect through SOCKS5 proxy, set -noproxy to disable (default: disabled)", false, OptionsCategory::CONNECTION);
@@ -1021,6 +1031,15 @@ bool AppInitBasicSetup()
     return true;
 }
 
+/** Parse a -peeruploadrateclass value of the form <class>:<rate>. */
+static bool ParsePeerUploadRateClass(const std::string& str, SendClass& send_class, int64_t& rate)
+{
+    std::vector<std::string> vClassRate;
+    boost::split(vClassRate, str, boost::is_any_of(":"));
+    return vClassRate.size() == 2 && GetSendClassByName(vClassRate[0], send_class) && ParseInt64(vClassRate[1], &rate) &&
+           rate >= 0 && rate <= MAX_PEER_UPLOAD_RATE;
+}
+
 bool AppInitParameterInteraction()
 {
     const CChainParams& chainparams = Params();
@@ -1074,6 +1093,14 @@ bool AppInitParameterInteraction()
         }
     }
 
+    // Signal NODE_COMPACT_FILTERS if peerblockfilters and basic filters index are both enabled.
+    if (gArgs.GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS)) {
+        if (std::find(g_enabled_filter_types.begin(), g_enabled_filter_types.end(), BlockFilterType::BASIC) == g_enabled_filter_types.end()) {
+            return InitError(_("Cannot set -peerblockfilters without -blockfilterindex."));
+        }
+        nLocalServices = ServiceFlags(nLocalServices | NODE_COMPACT_FILTERS);
+    }
+
     // -bind and -whitebind can't be set when not listening
     size_t nUserBind = gArgs.GetArgs("-bind").size() + gArgs.GetArgs("-whitebind").size();
     if (nUserBind != 0 && !gArgs.GetBoolArg("-listen", DEFAULT_LISTEN)) {
@@ -1087,8 +1114,13 @@ bool AppInitParameterInteraction()
 
     // Trim requested connection counts, to fit into system limitations
     // <int> in std::min<int>(...) to work around FreeBSD compilation issue described in #2695
-    nMaxConnections = std::max(std::min<int>(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS), 0);
-    nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + MAX_ADDNODE_CONNECTIONS);
+    nFD = RaiseFileDescriptorLimit(nMaxConnections + nBind + MIN_CORE_FILEDESCRIPTORS + MAX_ADDNODE_CONNECTIONS);
+#ifdef USE_POLL
+    int fd_max = nFD;
+#else
+    int fd_max = FD_SETSIZE;
+#endif
+    nMaxConnections = std::max(std::min<int>(nMaxConnections, fd_max - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS), 0);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
     nMaxConnections = std::min(nFD - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS, nMaxConnections);
@@ -1165,6 +1197,27 @@ bool AppInitParameterInteraction()
         LogPrintf("Warning: nMinimumChainWork set below default value of %s\n", chainparams.GetConsensus().nMinimumChainWork.GetHex());
     }
 
+    for (const std::string& strAnchor : gArgs.GetArgs("-headersanchor")) {
+        int nHeight;
+        uint256 hash;
+        if (!ParseHeadersAnchor(strAnchor, nHeight, hash)) {
+            return InitError(strprintf(_("Invalid -headersanchor, expecting height:hash: '%s'"), strAnchor));
+        }
+    }
+
+    // Rates are kept in millionths of a byte per second; bound them so that can't overflow.
+    const int64_t nPeerUploadRate = gArgs.GetArg("-peeruploadrate", DEFAULT_PEER_UPLOAD_RATE);
+    if (nPeerUploadRate < 0 || nPeerUploadRate > MAX_PEER_UPLOAD_RATE) {
+        return InitError(strprintf(_("Invalid -peeruploadrate: '%d' (must be between 0 and %d)"), nPeerUploadRate, MAX_PEER_UPLOAD_RATE));
+    }
+    for (const std::string& strClassRate : gArgs.GetArgs("-peeruploadrateclass")) {
+        SendClass send_class;
+        int64_t nRate;
+        if (!ParsePeerUploadRateClass(strClassRate, send_class, nRate)) {
+            return InitError(strprintf(_("Invalid -peeruploadrateclass, expecting class:rate with a rate between 0 and %d: '%s'"), MAX_PEER_UPLOAD_RATE, strClassRate));
+        }
+    }
+
     // mempool limits
     int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     int64_t nMempoolSizeMin = gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
@@ -1895,6 +1948,11 @@ bool AppInitMain()
         StartMapPort();
     }
 
+    int64_t nBlockServeCache = gArgs.GetArg("-blockservecache", DEFAULT_BLOCK_SERVE_CACHE);
+    if (nBlockServeCache > 0) {
+        g_block_msg_cache = MakeUnique<BlockMsgCache>((size_t)nBlockServeCache << 20);
+    }
+
     CConnman::Options connOptions;
     connOptions.nLocalServices = nLocalServices;
     connOptions.nMaxConnections = nMaxConnections;
@@ -1906,11 +1964,21 @@ bool AppInitMain()
     connOptions.m_msgproc = peerLogic.get();
     connOptions.nSendBufferMaxSize = 1000*gArgs.GetArg("-maxsendbuffer", DEFAULT_MAXSENDBUFFER);
     connOptions.nReceiveFloodSize = 1000*gArgs.GetArg("-maxreceivebuffer", DEFAULT_MAXRECEIVEBUFFER);
+    connOptions.nMsgHandlerThreads = gArgs.GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS);
     connOptions.m_added_nodes = gArgs.GetArgs("-addnode");
 
     connOptions.nMaxOutboundTimeframe = nMaxOutboundTimeframe;
     connOptions.nMaxOutboundLimit = nMaxOutboundLimit;
 
+    // Checked in AppInitParameterInteraction
+    connOptions.m_peer_upload_rate = (uint64_t)gArgs.GetArg("-peeruploadrate", DEFAULT_PEER_UPLOAD_RATE) * 1000;
+    for (const std::string& strClassRate : gArgs.GetArgs("-peeruploadrateclass")) {
+        SendClass send_class;
+        int64_t nRate;
+        if (ParsePeerUploadRateClass(strClassRate, send_class, nRate))
+            connOptions.m_peer_class_upload_rate[(int)send_class] = (uint64_t)nRate * 1000;
+    }
+
     for (const std::string& strBind : gArgs.GetArgs("-bind")) {
         CService addrBind;
         if (!Lookup(strBind.c_str(), addrBind, GetListenPort(), false)) {
@@ -37,27 +37,60 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter* filter, const std:
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
-uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid) {
+CFilteredBlockData::CFilteredBlockData(std::shared_ptr<const CBlock> blockIn) : block(std::move(blockIn))
+{
+    std::vector<uint256> vHashes;
+
+    vTxElements.reserve(block->vtx.size());
+    vHashes.reserve(block->vtx.size());
+
+    for (const CTransactionRef& tx : block->vtx) {
+        vTxElements.emplace_back(*tx);
+        vHashes.push_back(tx->GetHash());
+    }
+
+    vTreeLevels = CPartialMerkleTree::CalcTreeLevels(vHashes);
+}
+
+CMerkleBlock::CMerkleBlock(const CFilteredBlockData& data, CBloomFilter& filter)
+{
+    const CBlock& block = *data.block;
+    header = block.GetBlockHeader();
+
+    std::vector<bool> vMatch(block.vtx.size(), false);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (filter.IsRelevantAndUpdate(data.vTxElements[i])) {
+            vMatch[i] = true;
+            vMatchedTxn.emplace_back(i, block.vtx[i]->GetHash());
+        }
+    }
+
+    txn = CPartialMerkleTree(data.vTreeLevels, vMatch);
+}
+
+std::vector<std::vector<uint256>> CPartialMerkleTree::CalcTreeLevels(const std::vector<uint256> &vTxid) {
     //we can never have zero txs in a merkle block, we always need the coinbase tx
     //if we do not have this assert, we can hit a memory access violation when indexing into vTxid
     assert(vTxid.size() != 0);
-    if (height == 0) {
-        // hash at height 0 is the txids themself
-        return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height-1, pos*2, vTxid), right;
-        // calculate right hash if not beyond the end of the array - copy left hash otherwise
-        if (pos*2+1 < CalcTreeWidth(height-1))
-            right = CalcHash(height-1, pos*2+1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+    // hashes at height 0 are the txids themselves
+    std::vector<std::vector<uint256>> vTreeLevels{vTxid};
+    while (vTreeLevels.back().size() > 1) {
+        const std::vector<uint256> &vBelow = vTreeLevels.back();
+        std::vector<uint256> vLevel((vBelow.size() + 1) / 2);
+        for (unsigned int pos = 0; pos < vLevel.size(); pos++) {
+            const uint256 &left = vBelow[pos*2];
+            // use the right hash if not beyond the end of the array - copy left hash otherwise
+            const uint256 &right = pos*2+1 < vBelow.size() ? vBelow[pos*2+1] : left;
+            // combine subhashes
+            vLevel[pos] = Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+        }
+        vTreeLevels.push_back(std::move(vLevel));
     }
+    return vTreeLevels;
 }
 
-void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<std::vector<uint256>> &vTreeLevels, const std::vector<bool> &vMatch) {
     // determine whether this node is the parent of at least one matched txid
     bool fParentOfMatch = false;
     for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
@@ -66,12 +99,12 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     vBits.push_back(fParentOfMatch);
     if (height==0 || !fParentOfMatch) {
         // if at height 0, or nothing interesting below, store hash and stop
-        vHash.push_back(CalcHash(height, pos, vTxid));
+        vHash.push_back(vTreeLevels[height][pos]);
     } else {
         // otherwise, don't store any hash, but descend into the subtrees
-        TraverseAndBuild(height-1, pos*2, vTxid, vMatch);
+        TraverseAndBuild(height-1, pos*2, vTreeLevels, vMatch);
         if (pos*2+1 < CalcTreeWidth(height-1))
-            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch);
+            TraverseAndBuild(height-1, pos*2+1, vTreeLevels, vMatch);
     }
 }
 
@@ -113,18 +146,18 @@ uint256 CPartialMerkleTree::TraverseAndExtract(int height, unsigned int pos, uns
     }
 }
 
-CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) : nTransactions(vTxid.size()), fBad(false) {
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) : CPartialMerkleTree(CalcTreeLevels(vTxid), vMatch) {}
+
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<std::vector<uint256>> &vTreeLevels, const std::vector<bool> &vMatch) : nTransactions(vTreeLevels[0].size()), fBad(false) {
     // reset state
     vBits.clear();
     vHash.clear();
 
-    // calculate height of tree
-    int nHeight = 0;
-    while (CalcTreeWidth(nHeight) > 1)
-        nHeight++;
+    // the top level holds the root
+    int nHeight = vTreeLevels.size() - 1;
 
     // traverse the partial tree
-    TraverseAndBuild(nHeight, 0, vTxid, vMatch);
+    TraverseAndBuild(nHeight, 0, vTreeLevels, vMatch);
 }
 
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
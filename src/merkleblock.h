@@ -11,6 +11,7 @@
 #include <primitives/block.h>
 #include <bloom.h>
 
+#include <memory>
 #include <vector>
 
 /** Data structure that represents a partial merkle tree.
@@ -67,11 +68,8 @@ protected:
         return (nTransactions+(1 << height)-1) >> height;
     }
 
-    /** calculate the hash of a node in the merkle tree (at leaf level: the txid's themselves) */
-    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
-
     /** recursive function that traverses tree nodes, storing the data as bits and hashes */
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<std::vector<uint256>> &vTreeLevels, const std::vector<bool> &vMatch);
 
     /**
      * recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
@@ -107,6 +105,12 @@ public:
     /** Construct a partial merkle tree from a list of transaction ids, and a mask that selects a subset of them */
     CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    /** Construct a partial merkle tree from the hashes of every level of the tree, as returned by CalcTreeLevels */
+    CPartialMerkleTree(const std::vector<std::vector<uint256>> &vTreeLevels, const std::vector<bool> &vMatch);
+
+    /** Calculate the hashes of every level of the merkle tree over vTxid, from the txids themselves up to the root */
+    static std::vector<std::vector<uint256>> CalcTreeLevels(const std::vector<uint256> &vTxid);
+
     CPartialMerkleTree();
 
     /**
@@ -124,6 +128,22 @@ public:
 };
 
 
+/**
+ * The parts of a block that building a filtered CMerkleBlock needs no matter
+ * which filter it is built for: the bloom filter data elements of each
+ * transaction and the hashes of its merkle tree. Computed once, it can be
+ * shared by every filtered peer the block is sent to.
+ */
+class CFilteredBlockData
+{
+public:
+    const std::shared_ptr<const CBlock> block;
+    std::vector<CBloomTxElements> vTxElements;
+    std::vector<std::vector<uint256>> vTreeLevels;
+
+    explicit CFilteredBlockData(std::shared_ptr<const CBlock> blockIn);
+};
+
 /**
  * Used to relay blocks as header + vector<merkle branch>
  * to filtered nodes.
@@ -152,6 +172,9 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter) : CMerkleBlock(block, &filter, nullptr) { }
 
+    // Create from precomputed block data, filtering transactions according to filter as above
+    CMerkleBlock(const CFilteredBlockData& data, CBloomFilter& filter);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids) : CMerkleBlock(block, nullptr, &txids) { }
 
@@ -25,6 +25,15 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -43,6 +52,17 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+/** Maximum time the socket handler waits for socket events, also bounds how late pnode->vSend is noticed */
+static const uint64_t SELECT_TIMEOUT_MILLISECONDS = 50;
+
+/** Maximum number of queued send buffers handed to a single sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+
+// Queued messages are moved to a peer's send buffer while it holds less than
+// this, so a new block announcement waits for at most this much and one more
+// message of lower priority data.
+static const size_t SEND_SCHEDULE_BYTES = 64 * 1024;
+
 // MSG_NOSIGNAL is not available on some platforms, if it doesn't exist define it as 0
 #if !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
@@ -87,7 +107,8 @@ std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfLimited[NET_MAX] = {};
 std::string strSubVersion;
 
-limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CRecvBufferPool g_recv_buffer_pool;
+CTxAnnounceQueue g_tx_announce_queue;
 
 void CConnman::AddOneShot(const std::string& strDest)
 {
@@ -746,12 +767,13 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     LOCK(cs_vRecv);
     nLastRecv = nTimeMicros / 1000000;
     nRecvBytes += nBytes;
+    const CMessageHeader::MessageStartChars& message_start = Params().MessageStart();
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            vRecvMsg.emplace_back(message_start, SER_NETWORK, INIT_PROTO_VERSION);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -774,16 +796,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         nBytes -= handled;
 
         if (msg.complete()) {
-
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
-
-            msg.nTime = nTimeMicros;
+            RecordRecvMsgComplete(msg, nTimeMicros);
             complete = true;
         }
     }
@@ -791,6 +804,54 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+bool CNode::GetRecvBuffer(char*& pch, unsigned int& nMax)
+{
+    LOCK(cs_vRecv);
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return false;
+    CNetMessage& msg = vRecvMsg.back();
+    // Small remainders are cheaper to copy out of the caller's buffer than
+    // to spend a separate recv() call on.
+    if (msg.hdr.nMessageSize - msg.nDataPos < nMax)
+        return false;
+    pch = msg.GetDataBuffer(nMax);
+    return true;
+}
+
+bool CNode::ReceiveMsgBytesInPlace(unsigned int nBytes, bool& complete)
+{
+    complete = false;
+    int64_t nTimeMicros = GetTimeMicros();
+    LOCK(cs_vRecv);
+    nLastRecv = nTimeMicros / 1000000;
+    nRecvBytes += nBytes;
+
+    assert(!vRecvMsg.empty() && vRecvMsg.back().in_data);
+    CNetMessage& msg = vRecvMsg.back();
+    msg.CommitData(nBytes);
+    g_recv_buffer_pool.RecordInPlace(nBytes);
+
+    if (msg.complete()) {
+        RecordRecvMsgComplete(msg, nTimeMicros);
+        complete = true;
+    }
+
+    return true;
+}
+
+void CNode::RecordRecvMsgComplete(CNetMessage& msg, int64_t nTimeMicros)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = nTimeMicros;
+}
+
 void CNode::SetSendVersion(int nVersionIn)
 {
     // Send version may only be changed in the version message, and
@@ -820,23 +881,25 @@ int CNode::GetSendVersion() const
 
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
-    // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    unsigned int nCopy;
+    if (nHdrPos == 0 && nBytes >= CMessageHeader::HEADER_SIZE) {
+        // the whole header is at hand (the usual case when several messages
+        // arrive in one read): parse it where it is
+        hdr.ReadFromBuffer(reinterpret_cast<const unsigned char*>(pch));
+        nCopy = CMessageHeader::HEADER_SIZE;
+    } else {
+        // copy data to temporary parsing buffer
+        unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+        nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
-    nHdrPos += nCopy;
+        memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+        nHdrPos += nCopy;
 
-    // if header incomplete, exit
-    if (nHdrPos < 24)
-        return nCopy;
+        // if header incomplete, exit
+        if (nHdrPos < CMessageHeader::HEADER_SIZE)
+            return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (const std::exception&) {
-        return -1;
+        hdr.ReadFromBuffer(hdrbuf);
     }
 
     // reject messages larger than MAX_SIZE
@@ -846,24 +909,317 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // draw the payload buffer from the pool now that its size is known
+    if (hdr.nMessageSize > 0 && hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH) {
+        CSerializeData buf = g_recv_buffer_pool.Acquire(hdr.nMessageSize);
+        vRecv.SwapBuffer(buf);
+    }
+
     return nCopy;
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nCopy = nBytes;
+    char* pchDest = GetDataBuffer(nCopy);
+
+    memcpy(pchDest, pch, nCopy);
+    CommitData(nCopy);
+    g_recv_buffer_pool.RecordCopied(nCopy);
+
+    return nCopy;
+}
+
+char* CNetMessage::GetDataBuffer(unsigned int& nMax)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    nMax = std::min(nRemaining, nMax);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nMax) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        // A pooled buffer usually has the capacity already, so this only zero-fills.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nMax + 256 * 1024));
     }
 
-    hasher.Write((const unsigned char*)pch, nCopy);
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
 
-    return nCopy;
+void CNetMessage::CommitData(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= hdr.nMessageSize && nDataPos + nBytes <= vRecv.size());
+    hasher.Write((const unsigned char*)&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData buf;
+    vRecv.SwapBuffer(buf);
+    g_recv_buffer_pool.Release(std::move(buf));
+}
+
+int CRecvBufferPool::SizeClass(size_t nSize)
+{
+    int nClass = 0;
+    while (nClass < NUM_CLASSES - 1 && (MIN_CLASS_SIZE << nClass) < nSize)
+        nClass++;
+    return nClass;
+}
+
+CSerializeData CRecvBufferPool::Acquire(size_t nSize)
+{
+    {
+        LOCK(cs_pool);
+        // Buffers are filed by the largest class they can serve, so one class
+        // down may still hold a big enough buffer; one class up always does.
+        int nClass = SizeClass(nSize);
+        for (int i = std::max(nClass - 1, 0); i < std::min(nClass + 2, (int)NUM_CLASSES); i++) {
+            std::vector<CSerializeData>& vBufs = vFree[i];
+            for (auto it = vBufs.rbegin(); it != vBufs.rend(); ++it) {
+                if (it->capacity() < nSize)
+                    continue;
+                CSerializeData buf;
+                buf.swap(*it);
+                vBufs.erase(std::next(it).base());
+                nPooledBytes -= buf.capacity();
+                nHits++;
+                return buf;
+            }
+        }
+    }
+    nMisses++;
+    CSerializeData buf;
+    // Small buffers are cheap; size them so they can be pooled afterwards.
+    if (nSize <= MIN_CLASS_SIZE)
+        buf.reserve(MIN_CLASS_SIZE);
+    return buf;
+}
+
+void CRecvBufferPool::Release(CSerializeData&& buf)
+{
+    size_t nCapacity = buf.capacity();
+    if (nCapacity < MIN_CLASS_SIZE)
+        return;
+    // File under the largest class the buffer can fully serve.
+    int nClass = SizeClass(nCapacity);
+    if ((MIN_CLASS_SIZE << nClass) > nCapacity)
+        nClass--;
+    buf.clear();
+
+    LOCK(cs_pool);
+    if (nPooledBytes + nCapacity > nMaxPooledBytes || vFree[nClass].size() >= MAX_BUFFERS_PER_CLASS)
+        return;
+    vFree[nClass].emplace_back(std::move(buf));
+    nPooledBytes += nCapacity;
+}
+
+CRecvBufferPool::Stats CRecvBufferPool::GetStats() const
+{
+    Stats stats;
+    {
+        LOCK(cs_pool);
+        stats.nPooledBytes = nPooledBytes;
+    }
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nBytesCopied = nBytesCopied;
+    stats.nBytesInPlace = nBytesInPlace;
+    return stats;
+}
+
+void CPeerNetStats::Add(const CPeerNetStats& other)
+{
+    fConnected |= other.fConnected;
+    nConnections += other.nConnections;
+    nLastSeen = std::max(nLastSeen, other.nLastSeen);
+    nBytesSent += other.nBytesSent;
+    nBytesRecv += other.nBytesRecv;
+    nMsgsProcessed += other.nMsgsProcessed;
+    nProcessTimeMicros += other.nProcessTimeMicros;
+    nSendQueue += other.nSendQueue;
+    nProcessQueue += other.nProcessQueue;
+    nMaxSendQueue = std::max(nMaxSendQueue, other.nMaxSendQueue);
+    nMaxProcessQueue = std::max(nMaxProcessQueue, other.nMaxProcessQueue);
+}
+
+CNetStats::CNetStats()
+{
+    for (const std::string &msg : getAllNetMessageTypes())
+        mapMsgCounters[msg];
+    mapMsgCounters[NET_MESSAGE_COMMAND_OTHER];
+}
+
+CNetStats::MsgCounters& CNetStats::GetCounters(const std::string& command)
+{
+    auto it = mapMsgCounters.find(command);
+    if (it == mapMsgCounters.end())
+        it = mapMsgCounters.find(NET_MESSAGE_COMMAND_OTHER);
+    return it->second;
+}
+
+void CNetStats::RecordRecv(const std::string& command, uint64_t nBytes)
+{
+    MsgCounters& counters = GetCounters(command);
+    counters.nMsgsRecv++;
+    counters.nBytesRecv += nBytes;
+}
+
+void CNetStats::RecordSend(const std::string& command, uint64_t nBytes)
+{
+    MsgCounters& counters = GetCounters(command);
+    counters.nMsgsSent++;
+    counters.nBytesSent += nBytes;
+}
+
+void CNetStats::RecordProcessed(const std::string& command, int64_t nMicros)
+{
+    MsgCounters& counters = GetCounters(command);
+    const uint64_t nTime = std::max<int64_t>(nMicros, 0);
+    counters.nProcessTimeMicros += nTime;
+    int nBucket = 0;
+    while (nBucket < CNetMsgStats::TIME_BUCKETS - 1 && (nTime >> nBucket) != 0)
+        nBucket++;
+    counters.vProcessTimeHistogram[nBucket]++;
+}
+
+void CNetStats::RecordDisconnect(const CPeerNetStats& stats)
+{
+    LOCK(cs_peers);
+    auto it = mapPeers.find(stats.addr);
+    if (it == mapPeers.end()) {
+        if (mapPeers.size() >= MAX_PEERS) {
+            // Forget the address that was seen longest ago
+            auto oldest = std::min_element(mapPeers.begin(), mapPeers.end(),
+                [](const std::pair<const CNetAddr, CPeerNetStats>& a, const std::pair<const CNetAddr, CPeerNetStats>& b) {
+                    return a.second.nLastSeen < b.second.nLastSeen;
+                });
+            mapPeers.erase(oldest);
+        }
+        it = mapPeers.emplace(stats.addr, CPeerNetStats()).first;
+        it->second.addr = stats.addr;
+    }
+    CPeerNetStats& total = it->second;
+    total.Add(stats);
+    total.fConnected = false;
+    total.nSendQueue = 0;
+    total.nProcessQueue = 0;
+}
+
+std::map<std::string, CNetMsgStats> CNetStats::GetMsgStats() const
+{
+    std::map<std::string, CNetMsgStats> mapStats;
+    for (const auto& entry : mapMsgCounters) {
+        const MsgCounters& counters = entry.second;
+        if (counters.nMsgsRecv == 0 && counters.nMsgsSent == 0)
+            continue;
+        CNetMsgStats& stats = mapStats[entry.first];
+        stats.nMsgsRecv = counters.nMsgsRecv;
+        stats.nBytesRecv = counters.nBytesRecv;
+        stats.nMsgsSent = counters.nMsgsSent;
+        stats.nBytesSent = counters.nBytesSent;
+        stats.nProcessTimeMicros = counters.nProcessTimeMicros;
+        for (int i = 0; i < CNetMsgStats::TIME_BUCKETS; i++)
+            stats.vProcessTimeHistogram[i] = counters.vProcessTimeHistogram[i];
+    }
+    return mapStats;
+}
+
+std::map<CNetAddr, CPeerNetStats> CNetStats::GetPeerStats() const
+{
+    LOCK(cs_peers);
+    return mapPeers;
+}
+
+void CTxAnnounceQueue::AddPeer(NodeId id)
+{
+    LOCK(cs_queue);
+    mapCursors[id] = nLogStart + vLog.size();
+}
+
+void CTxAnnounceQueue::RemovePeer(NodeId id)
+{
+    LOCK(cs_queue);
+    mapCursors.erase(id);
+    if (mapCursors.empty()) {
+        nLogStart += vLog.size();
+        vLog.clear();
+        vPending.clear();
+    }
+}
+
+void CTxAnnounceQueue::Push(const uint256& txid)
+{
+    LOCK(cs_queue);
+    // Nobody to announce to
+    if (mapCursors.empty())
+        return;
+    vPending.push_back(txid);
+}
+
+void CTxAnnounceQueue::Seal(const std::function<void(std::vector<uint256>&)>& sort)
+{
+    std::vector<uint256> vBatch;
+    {
+        LOCK(cs_queue);
+        vBatch.swap(vPending);
+    }
+    if (vBatch.empty())
+        return;
+    // Sort outside cs_queue, so that the mempool lock isn't taken under it.
+    sort(vBatch);
+
+    LOCK(cs_queue);
+    vLog.insert(vLog.end(), vBatch.begin(), vBatch.end());
+    Prune();
+}
+
+void CTxAnnounceQueue::Prune()
+{
+    AssertLockHeld(cs_queue);
+    uint64_t nEnd = nLogStart + vLog.size();
+    uint64_t nMinCursor = nEnd;
+    for (const auto& cursor : mapCursors) {
+        nMinCursor = std::min(nMinCursor, cursor.second);
+    }
+    // Drop what every peer has gone through, and the oldest entries beyond
+    // MAX_LOG_SIZE; peers that far behind resume at the start of the log.
+    uint64_t nNewStart = std::max(nMinCursor, nEnd - std::min<uint64_t>(nEnd, MAX_LOG_SIZE));
+    if (nNewStart > nLogStart) {
+        vLog.erase(vLog.begin(), vLog.begin() + (nNewStart - nLogStart));
+        nLogStart = nNewStart;
+    }
+}
+
+uint64_t CTxAnnounceQueue::Get(NodeId id, size_t nMax, std::vector<uint256>& txids) const
+{
+    LOCK(cs_queue);
+    auto it = mapCursors.find(id);
+    uint64_t nEnd = nLogStart + vLog.size();
+    uint64_t nPos = it == mapCursors.end() ? nEnd : std::max(it->second, nLogStart);
+    size_t nCount = std::min<uint64_t>(nMax, nEnd - nPos);
+    auto begin = vLog.begin() + (nPos - nLogStart);
+    txids.assign(begin, begin + nCount);
+    return nPos;
+}
+
+void CTxAnnounceQueue::SetCursor(NodeId id, uint64_t nPos)
+{
+    LOCK(cs_queue);
+    auto it = mapCursors.find(id);
+    if (it != mapCursors.end())
+        it->second = nPos;
+}
+
+void CTxAnnounceQueue::SkipToEnd(NodeId id)
+{
+    LOCK(cs_queue);
+    SetCursor(id, nLogStart + vLog.size());
+}
+
+size_t CTxAnnounceQueue::LogSize() const
+{
+    LOCK(cs_queue);
+    return vLog.size();
 }
 
 const uint256& CNetMessage::GetMessageHash() const
@@ -882,34 +1238,120 @@ const uint256& CNetMessage::GetMessageHash() const
 
 
 
+// requires LOCK(cs_vSend)
+void CConnman::ScheduleSendData(CNode *pnode) const
+{
+    if (pnode->nSendQueuedSize == 0)
+        return;
+
+    // Whitelisted peers are not rate limited
+    const bool fLimited = !pnode->fWhitelisted;
+    const int64_t nNow = GetTimeMicros();
+    if (fLimited && m_peer_upload_rate)
+        pnode->m_send_bucket.Refill(m_peer_upload_rate, nNow);
+
+    for (int c = 0; c < SEND_CLASS_COUNT; ++c) {
+        auto& queue = pnode->vSendQueue[c];
+        CTokenBucket& class_bucket = pnode->m_send_class_bucket[c];
+        const uint64_t class_rate = fLimited ? m_peer_class_upload_rate[c] : 0;
+        if (class_rate)
+            class_bucket.Refill(class_rate, nNow);
+        // Control messages are counted against the peer's limit but never held
+        // back by it, so pings and handshakes keep flowing.
+        const bool fPeerLimited = fLimited && m_peer_upload_rate && c != (int)SendClass::CONTROL;
+
+        while (!queue.empty()) {
+            if (pnode->nSendSize - pnode->nSendQueuedSize >= SEND_SCHEDULE_BYTES)
+                return;
+            if ((class_rate && !class_bucket.HasTokens()) || (fPeerLimited && !pnode->m_send_bucket.HasTokens()))
+                break;
+
+            const CSharedNetMsg& msg = queue.front();
+            size_t nTotalSize = msg.data->size() + CMessageHeader::HEADER_SIZE;
+            if (class_rate)
+                class_bucket.Consume(nTotalSize);
+            if (fLimited && m_peer_upload_rate)
+                pnode->m_send_bucket.Consume(nTotalSize);
+
+            pnode->vSendMsg.push_back(msg.header);
+            if (!msg.data->empty())
+                pnode->vSendMsg.push_back(msg.data);
+            pnode->nSendQueuedSize -= nTotalSize;
+            queue.pop_front();
+        }
+    }
+}
+
 // requires LOCK(cs_vSend)
 size_t CConnman::SocketSendData(CNode *pnode) const
+{
+    size_t nSentSize = 0;
+    size_t nBytes;
+    do {
+        ScheduleSendData(pnode);
+        nBytes = SocketSendBuffer(pnode);
+        nSentSize += nBytes;
+        // Keep going while the buffer drains and more messages are let through
+    } while (nBytes && pnode->vSendMsg.empty() && pnode->nSendQueuedSize);
+    return nSentSize;
+}
+
+// requires LOCK(cs_vSend)
+size_t CConnman::SocketSendBuffer(CNode *pnode) const
 {
     auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
     while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+        size_t nToSend = 0;
         int nBytes = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            const auto &data = **it;
+            nToSend = data.size() - pnode->nSendOffset;
+            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Hand as many queued buffers as possible to the kernel in one call
+            struct iovec iov[MAX_SEND_IOVECS];
+            int nIov = 0;
+            for (auto it2 = it; it2 != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++it2, ++nIov) {
+                const auto &data = **it2;
+                size_t nOffset = (it2 == it) ? pnode->nSendOffset : 0;
+                iov[nIov].iov_base = const_cast<unsigned char*>(data.data()) + nOffset;
+                iov[nIov].iov_len = data.size() - nOffset;
+                nToSend += iov[nIov].iov_len;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nIov;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
-                pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
-                it++;
-            } else {
-                // could not send full message; stop sending more
+            // Advance past everything that was written
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const auto &data = **it;
+                size_t nChunk = std::min(nLeft, data.size() - pnode->nSendOffset);
+                pnode->nSendOffset += nChunk;
+                nLeft -= nChunk;
+                if (pnode->nSendOffset == data.size()) {
+                    pnode->nSendOffset = 0;
+                    pnode->nSendSize -= data.size();
+                    it++;
+                }
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -929,7 +1371,7 @@ size_t CConnman::SocketSendData(CNode *pnode) const
 
     if (it == pnode->vSendMsg.end()) {
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
+        assert(pnode->nSendSize == pnode->nSendQueuedSize);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
     return nSentSize;
@@ -1153,6 +1595,233 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+void CConnman::InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+        else if (!pnode->fSuccessfullyConnected)
+        {
+            LogPrint(BCLog::NET, "version handshake timeout from %d\n", pnode->GetId());
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+bool CConnman::GenerateSelectSet(std::map<SOCKET, SocketInterest>& interest)
+{
+    for (const ListenSocket& hListenSocket : vhListenSocket) {
+        interest[hListenSocket.socket] = SocketInterest(-1, true, false);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
+        {
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is space left in the receive buffer, select() for
+            //   receiving data.
+            // * Hand off all complete messages to the processor, to be handled without
+            //   blocking here.
+            // Errors are reported for every socket regardless.
+
+            bool select_recv = !pnode->fPauseRecv;
+            bool select_send;
+            {
+                LOCK(pnode->cs_vSend);
+                select_send = !pnode->vSendMsg.empty();
+            }
+
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            interest[pnode->hSocket] = SocketInterest(pnode->GetId(), select_recv && !select_send, select_send);
+        }
+    }
+
+    return !interest.empty();
+}
+
+#ifdef USE_EPOLL
+void CConnman::SocketEventsEpoll(const std::map<SOCKET, SocketInterest>& interest, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    // Registrations persist across iterations, so only sockets that appeared,
+    // went away or changed interest cost a system call. Registrations are
+    // keyed on the owning node as well, because a socket closed by another
+    // thread is dropped from the epoll set by the kernel and its descriptor
+    // may have been reused by a new connection since.
+    for (auto it = m_epoll_registered.begin(); it != m_epoll_registered.end();) {
+        auto wanted = interest.find(it->first);
+        if (wanted == interest.end() || wanted->second.node != it->second.first) {
+            // Fails with ENOENT/EBADF if the socket was closed already; that's fine.
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+            it = m_epoll_registered.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (const auto& entry : interest) {
+        // Level-triggered: with edge-triggered events, data left unread while
+        // fPauseRecv is set would never be signalled again.
+        struct epoll_event ev = {};
+        ev.events = (entry.second.recv ? EPOLLIN : 0) | (entry.second.send ? EPOLLOUT : 0);
+        ev.data.fd = entry.first;
+        auto reg = m_epoll_registered.find(entry.first);
+        if (reg == m_epoll_registered.end()) {
+            if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, entry.first, &ev) != 0) {
+                LogPrintf("socket epoll add error %s\n", NetworkErrorString(WSAGetLastError()));
+                continue;
+            }
+            m_epoll_registered.emplace(entry.first, std::make_pair(entry.second.node, (uint32_t)ev.events));
+        } else if (reg->second.second != ev.events) {
+            if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, entry.first, &ev) != 0) {
+                LogPrintf("socket epoll modify error %s\n", NetworkErrorString(WSAGetLastError()));
+                m_epoll_registered.erase(reg);
+                continue;
+            }
+            reg->second.second = ev.events;
+        }
+    }
+
+    std::vector<struct epoll_event> events(std::max<size_t>(m_epoll_registered.size(), 1));
+    int nEvents = epoll_wait(m_epoll_fd, events.data(), (int)events.size(), SELECT_TIMEOUT_MILLISECONDS);
+    if (nEvents < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        SOCKET hSocket = events[i].data.fd;
+        if (events[i].events & EPOLLIN)               recv_set.insert(hSocket);
+        if (events[i].events & EPOLLOUT)              send_set.insert(hSocket);
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) error_set.insert(hSocket);
+    }
+}
+#endif
+
+#ifdef USE_POLL
+void CConnman::SocketEventsPoll(const std::map<SOCKET, SocketInterest>& interest, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    std::vector<struct pollfd> vpollfds;
+    vpollfds.reserve(interest.size());
+    for (const auto& entry : interest) {
+        struct pollfd pollfd_entry = {};
+        pollfd_entry.fd = entry.first;
+        if (entry.second.recv) pollfd_entry.events |= POLLIN;
+        if (entry.second.send) pollfd_entry.events |= POLLOUT;
+        vpollfds.push_back(pollfd_entry);
+    }
+
+    if (poll(vpollfds.data(), vpollfds.size(), SELECT_TIMEOUT_MILLISECONDS) < 0) {
+        if (interruptNet) return;
+        LogPrintf("socket poll error %s\n", NetworkErrorString(WSAGetLastError()));
+        interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        return;
+    }
+
+    for (const struct pollfd& pollfd_entry : vpollfds) {
+        if (pollfd_entry.revents & POLLIN)              recv_set.insert(pollfd_entry.fd);
+        if (pollfd_entry.revents & POLLOUT)             send_set.insert(pollfd_entry.fd);
+        if (pollfd_entry.revents & (POLLERR | POLLHUP)) error_set.insert(pollfd_entry.fd);
+    }
+}
+#else
+void CConnman::SocketEventsSelect(const std::map<SOCKET, SocketInterest>& interest, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SELECT_TIMEOUT_MILLISECONDS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+
+    for (const auto& entry : interest) {
+        if (entry.second.recv) FD_SET(entry.first, &fdsetRecv);
+        if (entry.second.send) FD_SET(entry.first, &fdsetSend);
+        // Listen sockets only ever wait for incoming connections
+        if (entry.second.node >= 0) FD_SET(entry.first, &fdsetError);
+        hSocketMax = std::max(hSocketMax, entry.first);
+    }
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (interruptNet)
+        return;
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+        for (const auto& entry : interest)
+            recv_set.insert(entry.first);
+        interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        return;
+    }
+
+    for (const auto& entry : interest) {
+        if (FD_ISSET(entry.first, &fdsetRecv))  recv_set.insert(entry.first);
+        if (FD_ISSET(entry.first, &fdsetSend))  send_set.insert(entry.first);
+        if (FD_ISSET(entry.first, &fdsetError)) error_set.insert(entry.first);
+    }
+}
+#endif
+
+void CConnman::SocketEvents(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    std::map<SOCKET, SocketInterest> interest;
+    if (!GenerateSelectSet(interest)) {
+        interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        return;
+    }
+
+#ifdef USE_EPOLL
+    if (m_epoll_fd >= 0) {
+        SocketEventsEpoll(interest, recv_set, send_set, error_set);
+        return;
+    }
+#endif
+#ifdef USE_POLL
+    SocketEventsPoll(interest, recv_set, send_set, error_set);
+#else
+    SocketEventsSelect(interest, recv_set, send_set, error_set);
+#endif
+}
+
 void CConnman::ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
@@ -1233,91 +1902,18 @@ void CConnman::ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
-            {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
-
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
+        std::set<SOCKET> recv_set, send_set, error_set;
+        SocketEvents(recv_set, send_set, error_set);
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
         if (interruptNet)
             return;
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
-                return;
-        }
-
         //
         // Accept new connections
         //
         for (const ListenSocket& hListenSocket : vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && recv_set.count(hListenSocket.socket) > 0)
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1348,25 +1944,31 @@ void CConnman::ThreadSocketHandler()
                 LOCK(pnode->cs_hSocket);
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+                recvSet = recv_set.count(pnode->hSocket) > 0;
+                sendSet = send_set.count(pnode->hSocket) > 0;
+                errorSet = error_set.count(pnode->hSocket) > 0;
             }
             if (recvSet || errorSet)
             {
                 // typical socket buffer is 8K-64K
                 char pchBuf[0x10000];
+                // large payloads are received straight into their message buffer
+                char* pchDest = pchBuf;
+                unsigned int nMax = sizeof(pchBuf);
+                bool fInPlace = false;
                 int nBytes = 0;
                 {
                     LOCK(pnode->cs_hSocket);
                     if (pnode->hSocket == INVALID_SOCKET)
                         continue;
-                    nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                    fInPlace = pnode->GetRecvBuffer(pchDest, nMax);
+                    nBytes = recv(pnode->hSocket, pchDest, nMax, MSG_DONTWAIT);
                 }
                 if (nBytes > 0)
                 {
                     bool notify = false;
-                    if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+                    bool fReceived = fInPlace ? pnode->ReceiveMsgBytesInPlace(nBytes, notify) : pnode->ReceiveMsgBytes(pchBuf, nBytes, notify);
+                    if (!fReceived)
                         pnode->CloseSocketDisconnect();
                     RecordBytesRecv(nBytes);
                     if (notify) {
@@ -1376,14 +1978,16 @@ void CConnman::ThreadSocketHandler()
                             if (!it->complete())
                                 break;
                             nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+                            m_net_stats.RecordRecv(it->hdr.GetCommand(), it->vRecv.size() + CMessageHeader::HEADER_SIZE);
                         }
                         {
                             LOCK(pnode->cs_vProcessMsg);
                             pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
                             pnode->nProcessQueueSize += nSizeAdded;
+                            pnode->nMaxProcessQueueSize = std::max(pnode->nMaxProcessQueueSize, pnode->nProcessQueueSize);
                             pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
                         }
-                        WakeMessageHandler();
+                        WakeMessageHandler(pnode->GetId());
                     }
                 }
                 else if (nBytes == 0)
@@ -1410,47 +2014,19 @@ void CConnman::ThreadSocketHandler()
             //
             // Send
             //
-            if (sendSet)
             {
                 LOCK(pnode->cs_vSend);
-                size_t nBytes = SocketSendData(pnode);
-                if (nBytes) {
-                    RecordBytesSent(nBytes);
+                // Messages held back by a rate limit are retried on every
+                // iteration, as nothing is waiting on the socket for them.
+                if (sendSet || (pnode->vSendMsg.empty() && pnode->nSendQueuedSize)) {
+                    size_t nBytes = SocketSendData(pnode);
+                    if (nBytes) {
+                        RecordBytesSent(nBytes);
+                    }
                 }
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-                else if (!pnode->fSuccessfullyConnected)
-                {
-                    LogPrint(BCLog::NET, "version handshake timeout from %d\n", pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1462,11 +2038,20 @@ void CConnman::ThreadSocketHandler()
 
 void CConnman::WakeMessageHandler()
 {
-    {
-        std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+    std::lock_guard<std::mutex> lock(mutexMsgProc);
+    vMsgProcWake.assign(vMsgProcWake.size(), true);
+    for (const auto& cond : vCondMsgProc) {
+        cond->notify_one();
     }
-    condMsgProc.notify_one();
+}
+
+void CConnman::WakeMessageHandler(NodeId node)
+{
+    std::lock_guard<std::mutex> lock(mutexMsgProc);
+    if (vCondMsgProc.empty()) return;
+    const size_t worker = node % vCondMsgProc.size();
+    vMsgProcWake[worker] = true;
+    vCondMsgProc[worker]->notify_one();
 }
 
 
@@ -2030,15 +2615,19 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
     }
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int worker)
 {
     while (!flagInterruptMsgProc)
     {
+        // Peers are pinned to a worker, so messages of one peer are always
+        // processed in order, by a single thread.
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
+            for (CNode* pnode : vNodes) {
+                if (pnode->GetId() % nMsgHandlerThreads != worker)
+                    continue;
+                vNodesCopy.push_back(pnode);
                 pnode->AddRef();
             }
         }
@@ -2073,9 +2662,9 @@ void CConnman::ThreadMessageHandler()
 
         std::unique_lock<std::mutex> lock(mutexMsgProc);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            vCondMsgProc[worker]->wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this, worker] { return vMsgProcWake[worker] || flagInterruptMsgProc; });
         }
-        fMsgProcWake = false;
+        vMsgProcWake[worker] = false;
     }
 }
 
@@ -2354,8 +2943,20 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 
     {
         std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+        vMsgProcWake.assign(nMsgHandlerThreads, false);
+        vCondMsgProc.clear();
+        for (int worker = 0; worker < nMsgHandlerThreads; worker++) {
+            vCondMsgProc.emplace_back(new std::condition_variable());
+        }
+    }
+
+#ifdef USE_EPOLL
+    m_epoll_registered.clear();
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0) {
+        LogPrintf("epoll_create1 failed (%s), falling back to poll()\n", NetworkErrorString(WSAGetLastError()));
     }
+#endif
 
     // Send and receive from sockets, accept connections
     threadSocketHandler = std::thread(&TraceThread<std::function<void()> >, "net", std::function<void()>(std::bind(&CConnman::ThreadSocketHandler, this)));
@@ -2380,7 +2981,13 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    for (int worker = 0; worker < nMsgHandlerThreads; worker++) {
+        std::string name = worker == 0 ? "msghand" : strprintf("msghand.%d", worker);
+        threadMessageHandler.emplace_back([this, worker, name] {
+            TraceThread(name.c_str(), std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, worker)));
+        });
+    }
+    LogPrintf("Using %d message handler thread(s)\n", nMsgHandlerThreads);
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2408,8 +3015,10 @@ void CConnman::Interrupt()
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
         flagInterruptMsgProc = true;
+        for (const auto& cond : vCondMsgProc) {
+            cond->notify_all();
+        }
     }
-    condMsgProc.notify_all();
 
     interruptNet();
     InterruptSocks5(true);
@@ -2429,8 +3038,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (std::thread& thread : threadMessageHandler) {
+        if (thread.joinable())
+            thread.join();
+    }
+    threadMessageHandler.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2440,6 +3052,14 @@ void CConnman::Stop()
     if (threadSocketHandler.joinable())
         threadSocketHandler.join();
 
+#ifdef USE_EPOLL
+    if (m_epoll_fd >= 0) {
+        close(m_epoll_fd);
+        m_epoll_fd = -1;
+    }
+    m_epoll_registered.clear();
+#endif
+
     if (fAddressesInitialized)
     {
         DumpData();
@@ -2476,6 +3096,7 @@ void CConnman::DeleteNode(CNode* pnode)
     if(fUpdateConnectionTime) {
         addrman.Connected(pnode->addr);
     }
+    m_net_stats.RecordDisconnect(GetConnectionNetStats(pnode));
     delete pnode;
 }
 
@@ -2560,6 +3181,67 @@ void CConnman::GetNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+CPeerNetStats CConnman::GetConnectionNetStats(CNode* pnode)
+{
+    CPeerNetStats stats;
+    stats.addr = pnode->addr;
+    stats.fConnected = true;
+    stats.nConnections = 1;
+    stats.nLastSeen = GetTime();
+    stats.nMsgsProcessed = pnode->nMsgsProcessed;
+    stats.nProcessTimeMicros = pnode->nProcessTimeMicros;
+    {
+        LOCK(pnode->cs_vSend);
+        stats.nBytesSent = pnode->nSendBytes;
+        stats.nSendQueue = pnode->nSendSize;
+        stats.nMaxSendQueue = pnode->nMaxSendSize;
+    }
+    {
+        LOCK(pnode->cs_vRecv);
+        stats.nBytesRecv = pnode->nRecvBytes;
+    }
+    {
+        LOCK(pnode->cs_vProcessMsg);
+        stats.nProcessQueue = pnode->nProcessQueueSize;
+        stats.nMaxProcessQueue = pnode->nMaxProcessQueueSize;
+    }
+    return stats;
+}
+
+std::map<std::string, CNetMsgStats> CConnman::GetMsgNetStats() const
+{
+    return m_net_stats.GetMsgStats();
+}
+
+void CConnman::GetPeerNetStats(std::vector<CPeerNetStats>& vstats)
+{
+    std::map<CNetAddr, CPeerNetStats> mapStats = m_net_stats.GetPeerStats();
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            CPeerNetStats stats = GetConnectionNetStats(pnode);
+            auto it = mapStats.find(stats.addr);
+            if (it == mapStats.end()) {
+                mapStats.emplace(stats.addr, stats);
+            } else {
+                it->second.Add(stats);
+            }
+        }
+    }
+    vstats.clear();
+    vstats.reserve(mapStats.size());
+    for (const auto& entry : mapStats) {
+        vstats.push_back(entry.second);
+    }
+}
+
+void CConnman::RecordMessageProcessed(CNode* pnode, const std::string& command, int64_t nMicros)
+{
+    m_net_stats.RecordProcessed(command, nMicros);
+    pnode->nMsgsProcessed++;
+    pnode->nProcessTimeMicros += std::max<int64_t>(nMicros, 0);
+}
+
 bool CConnman::DisconnectNode(const std::string& strNode)
 {
     LOCK(cs_vNodes);
@@ -2787,59 +3469,95 @@ CNode::~CNode()
     CloseSocket(hSocket);
 }
 
-void CNode::AskFor(const CInv& inv)
-{
-    if (mapAskFor.size() > MAPASKFOR_MAX_SZ || setAskFor.size() > SETASKFOR_MAX_SZ)
-        return;
-    // a peer may not have multiple non-responded queue positions for a single inv item
-    if (!setAskFor.insert(inv.hash).second)
-        return;
-
-    // We're using mapAskFor as a priority queue,
-    // the key is the earliest time the request can be sent
-    int64_t nRequestTime;
-    limitedmap<uint256, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv.hash);
-    if (it != mapAlreadyAskedFor.end())
-        nRequestTime = it->second;
-    else
-        nRequestTime = 0;
-    LogPrint(BCLog::NET, "askfor %s  %d (%s) peer=%d\n", inv.ToString(), nRequestTime, FormatISO8601Time(nRequestTime/1000000), id);
-
-    // Make sure not to reuse time indexes to keep things in the same order
-    int64_t nNow = GetTimeMicros() - 1000000;
-    static int64_t nLastTime;
-    ++nLastTime;
-    nNow = std::max(nNow, nLastTime);
-    nLastTime = nNow;
-
-    // Each retry is 2 minutes after the last
-    nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-    if (it != mapAlreadyAskedFor.end())
-        mapAlreadyAskedFor.update(it, nRequestTime);
-    else
-        mapAlreadyAskedFor.insert(std::make_pair(inv.hash, nRequestTime));
-    mapAskFor.insert(std::make_pair(nRequestTime, inv));
-}
-
 bool CConnman::NodeFullyConnected(const CNode* pnode)
 {
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
-void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+CSharedNetMsg::CSharedNetMsg(CSerializedNetMsg&& msg) : command(std::move(msg.command))
 {
     size_t nMessageSize = msg.data.size();
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
-    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
-
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
     uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
+    CMessageHeader hdr(Params().MessageStart(), command.c_str(), nMessageSize);
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
 
+    header = std::make_shared<const std::vector<unsigned char>>(std::move(serializedHeader));
+    data = std::make_shared<const std::vector<unsigned char>>(std::move(msg.data));
+}
+
+SendClass GetSendClass(const std::string& command)
+{
+    if (command == NetMsgType::CMPCTBLOCK || command == NetMsgType::BLOCKTXN || command == NetMsgType::HEADERS)
+        return SendClass::CMPCTBLOCK;
+    // Merkle blocks stay in order with the transactions that follow them.
+    if (command == NetMsgType::INV || command == NetMsgType::TX || command == NetMsgType::MERKLEBLOCK)
+        return SendClass::TX;
+    if (command == NetMsgType::ADDR)
+        return SendClass::ADDR;
+    if (command == NetMsgType::BLOCK)
+        return SendClass::BLOCK;
+    return SendClass::CONTROL;
+}
+
+bool GetSendClassByName(const std::string& name, SendClass& send_class)
+{
+    static const std::map<std::string, SendClass> mapSendClassNames{
+        {"cmpctblock", SendClass::CMPCTBLOCK},
+        {"tx", SendClass::TX},
+        {"addr", SendClass::ADDR},
+        {"block", SendClass::BLOCK},
+    };
+    auto it = mapSendClassNames.find(name);
+    if (it == mapSendClassNames.end())
+        return false;
+    send_class = it->second;
+    return true;
+}
+
+// A full bucket at the highest rate, plus the debt of the largest message, fits in int64_t.
+static_assert(MAX_PEER_UPLOAD_RATE * 1000 <= std::numeric_limits<int64_t>::max() / 1000000 / 2, "MAX_PEER_UPLOAD_RATE overflows CTokenBucket");
+
+void CTokenBucket::Refill(uint64_t rate, int64_t now_micros)
+{
+    if (now_micros <= m_last_refill)
+        return;
+    // Tokens are millionths of a byte, so that one accrues every microsecond at
+    // one byte per second and nothing is lost to rounding between refills.
+    const int64_t nCapacity = (int64_t)rate * 1000000;
+    const int64_t nElapsed = now_micros - m_last_refill;
+    if (nElapsed >= (nCapacity - m_tokens) / (int64_t)rate) {
+        m_tokens = nCapacity;
+    } else {
+        m_tokens += nElapsed * (int64_t)rate;
+    }
+    m_last_refill = now_micros;
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    PushMessage(pnode, CSharedNetMsg(std::move(msg)));
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg)
+{
+    PushMessage(pnode, msg, GetSendClass(msg.command));
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg, SendClass send_class)
+{
+    PushMessage(pnode, CSharedNetMsg(std::move(msg)), send_class);
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg, SendClass send_class)
+{
+    size_t nMessageSize = msg.data->size();
+    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
+
     size_t nBytesSent = 0;
     {
         LOCK(pnode->cs_vSend);
@@ -2848,12 +3566,13 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
         //log total amount of bytes per command
         pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
         pnode->nSendSize += nTotalSize;
+        pnode->nSendQueuedSize += nTotalSize;
+        pnode->nMaxSendSize = std::max(pnode->nMaxSendSize, pnode->nSendSize);
+        m_net_stats.RecordSend(msg.command, nTotalSize);
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+        pnode->vSendQueue[(int)send_class].push_back(msg);
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
@@ -13,7 +13,6 @@
 #include <bloom.h>
 #include <compat.h>
 #include <hash.h>
-#include <limitedmap.h>
 #include <netaddress.h>
 #include <policy/feerate.h>
 #include <protocol.h>
@@ -23,8 +22,12 @@
 #include <uint256.h>
 #include <threadinterrupt.h>
 
+#include <array>
 #include <atomic>
 #include <deque>
+#include <functional>
+#include <map>
+#include <set>
 #include <stdint.h>
 #include <thread>
 #include <memory>
@@ -66,22 +69,26 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
-/** The maximum number of entries in mapAskFor */
-static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
-/** The maximum number of entries in setAskFor (larger due to getdata latency)*/
-static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 /** The default timeframe for -maxuploadtarget. 1 day. */
 static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** The default for -peeruploadrate. 0 = Unlimited */
+static const uint64_t DEFAULT_PEER_UPLOAD_RATE = 0;
+/** The highest -peeruploadrate and -peeruploadrateclass rate, in KB/s (1 TB/s) */
+static const int64_t MAX_PEER_UPLOAD_RATE = 1000000000;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
 
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default number of message handler threads. Each peer is always handled by the same thread. */
+static const int DEFAULT_MSGHANDLER_THREADS = 1;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
@@ -112,6 +119,139 @@ struct CSerializedNetMsg
     std::string command;
 };
 
+/**
+ * A network message whose header and payload are serialized once and shared,
+ * so the same block can be queued to many peers without copying it.
+ */
+struct CSharedNetMsg
+{
+    explicit CSharedNetMsg(CSerializedNetMsg&& msg);
+
+    std::string command;
+    std::shared_ptr<const std::vector<unsigned char>> header;
+    std::shared_ptr<const std::vector<unsigned char>> data;
+};
+
+/**
+ * Classes of outgoing messages. Each peer queues them separately and moves
+ * them to the socket in this order, so that fresh block announcements are not
+ * stuck behind historical blocks being served to the same peer.
+ */
+enum class SendClass : int
+{
+    CMPCTBLOCK = 0, //!< cmpctblock, blocktxn and headers
+    CONTROL,        //!< everything not in another class; never rate limited
+    TX,             //!< inv, tx and merkleblock
+    ADDR,           //!< addr
+    BLOCK,          //!< full blocks
+};
+static const int SEND_CLASS_COUNT = 5;
+
+/** Return the class a message is queued in by its command */
+SendClass GetSendClass(const std::string& command);
+/** Look up a rate limited class by its -peeruploadrateclass name */
+bool GetSendClassByName(const std::string& name, SendClass& send_class);
+
+/**
+ * Token bucket limiting the average byte rate of a stream of messages. A
+ * message may go out as long as any tokens are left and may leave the bucket
+ * in debt, so messages larger than the bucket are sent as well, just not more
+ * often than the rate allows.
+ */
+class CTokenBucket
+{
+private:
+    int64_t m_tokens{0};
+    int64_t m_last_refill{0};
+
+public:
+    /** Add the tokens accrued at rate bytes per second since the last refill, holding at most one second's worth */
+    void Refill(uint64_t rate, int64_t now_micros);
+    bool HasTokens() const { return m_tokens > 0; }
+    void Consume(size_t bytes) { m_tokens -= (int64_t)bytes * 1000000; }
+};
+
+/** Statistics of one message command, over all peers */
+struct CNetMsgStats
+{
+    /** Number of buckets in the processing time histogram. Bucket i counts
+     *  messages processed in less than 2^i microseconds (and at least half
+     *  that), the last bucket everything slower. */
+    static const int TIME_BUCKETS = 24;
+
+    uint64_t nMsgsRecv = 0;
+    uint64_t nBytesRecv = 0;
+    uint64_t nMsgsSent = 0;
+    uint64_t nBytesSent = 0;
+    uint64_t nProcessTimeMicros = 0;
+    std::array<uint64_t, TIME_BUCKETS> vProcessTimeHistogram{};
+};
+
+/** Statistics of one peer address, summed over all its connections */
+struct CPeerNetStats
+{
+    CNetAddr addr;
+    bool fConnected = false;
+    uint64_t nConnections = 0;
+    int64_t nLastSeen = 0;
+    uint64_t nBytesSent = 0;
+    uint64_t nBytesRecv = 0;
+    uint64_t nMsgsProcessed = 0;
+    uint64_t nProcessTimeMicros = 0;
+    // Current and highest sizes of the send and receive processing queues, in bytes
+    size_t nSendQueue = 0;
+    size_t nProcessQueue = 0;
+    size_t nMaxSendQueue = 0;
+    size_t nMaxProcessQueue = 0;
+
+    void Add(const CPeerNetStats& other);
+};
+
+/**
+ * Network statistics that outlive connections: totals per message command,
+ * kept in atomic counters set up once for every known command so recording
+ * never takes a lock, and totals per peer address, updated when a connection
+ * closes.
+ */
+class CNetStats
+{
+public:
+    /** Number of peer addresses whose statistics are kept after they disconnect */
+    static const size_t MAX_PEERS = 1000;
+
+    CNetStats();
+
+    void RecordRecv(const std::string& command, uint64_t nBytes);
+    void RecordSend(const std::string& command, uint64_t nBytes);
+    void RecordProcessed(const std::string& command, int64_t nMicros);
+    /** Add the statistics of a closed connection to its address's totals */
+    void RecordDisconnect(const CPeerNetStats& stats);
+
+    /** Statistics of the commands that were sent or received at least once */
+    std::map<std::string, CNetMsgStats> GetMsgStats() const;
+    /** Totals of the addresses of closed connections */
+    std::map<CNetAddr, CPeerNetStats> GetPeerStats() const;
+
+private:
+    struct MsgCounters {
+        std::atomic<uint64_t> nMsgsRecv{0};
+        std::atomic<uint64_t> nBytesRecv{0};
+        std::atomic<uint64_t> nMsgsSent{0};
+        std::atomic<uint64_t> nBytesSent{0};
+        std::atomic<uint64_t> nProcessTimeMicros{0};
+        std::array<std::atomic<uint64_t>, CNetMsgStats::TIME_BUCKETS> vProcessTimeHistogram{};
+    };
+
+    /** Counters of a command, or of NET_MESSAGE_COMMAND_OTHER if it is unknown */
+    MsgCounters& GetCounters(const std::string& command);
+
+    // Filled in by the constructor and never modified after, so it can be read without a lock
+    std::map<std::string, MsgCounters> mapMsgCounters;
+
+    mutable CCriticalSection cs_peers;
+    std::map<CNetAddr, CPeerNetStats> mapPeers GUARDED_BY(cs_peers);
+};
+
 class NetEventsInterface;
 class CConnman
 {
@@ -136,8 +276,11 @@ public:
         NetEventsInterface* m_msgproc = nullptr;
         unsigned int nSendBufferMaxSize = 0;
         unsigned int nReceiveFloodSize = 0;
+        int nMsgHandlerThreads = DEFAULT_MSGHANDLER_THREADS;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
+        uint64_t m_peer_upload_rate = 0;
+        std::array<uint64_t, SEND_CLASS_COUNT> m_peer_class_upload_rate{};
         std::vector<std::string> vSeedNodes;
         std::vector<CSubNet> vWhitelistedRange;
         std::vector<CService> vBinds, vWhiteBinds;
@@ -157,11 +300,14 @@ public:
         m_msgproc = connOptions.m_msgproc;
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
+        nMsgHandlerThreads = std::max(1, std::min(connOptions.nMsgHandlerThreads, MAX_MSGHANDLER_THREADS));
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
             nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
         }
+        m_peer_upload_rate = connOptions.m_peer_upload_rate;
+        m_peer_class_upload_rate = connOptions.m_peer_class_upload_rate;
         vWhitelistedRange = connOptions.vWhitelistedRange;
         {
             LOCK(cs_vAddedNodes);
@@ -193,6 +339,10 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg);
+    /** Queue msg in send_class rather than its own class, to keep it in order behind messages it depends on */
+    void PushMessage(CNode* pnode, CSerializedNetMsg&& msg, SendClass send_class);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg, SendClass send_class);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -286,6 +436,12 @@ public:
 
     size_t GetNodeCount(NumConnections num);
     void GetNodeStats(std::vector<CNodeStats>& vstats);
+    //! statistics per message command, across disconnects
+    std::map<std::string, CNetMsgStats> GetMsgNetStats() const;
+    //! statistics per peer address, of current connections and past ones
+    void GetPeerNetStats(std::vector<CPeerNetStats>& vstats);
+    //! record the time it took to process a message from pnode
+    void RecordMessageProcessed(CNode* pnode, const std::string& command, int64_t nMicros);
     bool DisconnectNode(const std::string& node);
     bool DisconnectNode(NodeId id);
 
@@ -323,7 +479,10 @@ public:
 
     unsigned int GetReceiveFloodSize() const;
 
+    /** Wake all message handler workers */
     void WakeMessageHandler();
+    /** Wake only the message handler worker that node is pinned to */
+    void WakeMessageHandler(NodeId node);
 
     /** Attempts to obfuscate tx time through exponentially distributed emitting.
         Works assuming that a single interval is used.
@@ -346,8 +505,31 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    /** Process messages of the peers pinned to one worker (GetId() % nMsgHandlerThreads == worker) */
+    void ThreadMessageHandler(int worker);
+    /** Events the socket handler waits for on one socket */
+    struct SocketInterest {
+        NodeId node; //!< owning node, or -1 for listen sockets
+        bool recv;
+        bool send;
+
+        SocketInterest() : node(-1), recv(false), send(false) {}
+        SocketInterest(NodeId node_, bool recv_, bool send_) : node(node_), recv(recv_), send(send_) {}
+    };
+
     void AcceptConnection(const ListenSocket& hListenSocket);
+    void InactivityCheck(CNode *pnode);
+    bool GenerateSelectSet(std::map<SOCKET, SocketInterest>& interest);
+    /** Wait up to SELECT_TIMEOUT_MILLISECONDS for socket readiness and return the ready sockets */
+    void SocketEvents(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+#ifdef USE_EPOLL
+    void SocketEventsEpoll(const std::map<SOCKET, SocketInterest>& interest, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+#endif
+#ifdef USE_POLL
+    void SocketEventsPoll(const std::map<SOCKET, SocketInterest>& interest, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+#else
+    void SocketEventsSelect(const std::map<SOCKET, SocketInterest>& interest, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+#endif
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -366,6 +548,9 @@ private:
 
     NodeId GetNewNodeId();
 
+    /** Move pnode's queued messages to its send buffer, in class order, as far as the rate limits allow */
+    void ScheduleSendData(CNode *pnode) const;
+    size_t SocketSendBuffer(CNode *pnode) const;
     size_t SocketSendData(CNode *pnode) const;
     //!check is the banlist has unwritten changes
     bool BannedSetIsDirty();
@@ -381,6 +566,9 @@ private:
     void RecordBytesRecv(uint64_t bytes);
     void RecordBytesSent(uint64_t bytes);
 
+    // Statistics of a connection, for CNetStats
+    static CPeerNetStats GetConnectionNetStats(CNode* pnode);
+
     // Whether the node should be passed out in ForEach* callbacks
     static bool NodeFullyConnected(const CNode* pnode);
 
@@ -396,14 +584,28 @@ private:
     uint64_t nMaxOutboundLimit GUARDED_BY(cs_totalBytesSent);
     uint64_t nMaxOutboundTimeframe GUARDED_BY(cs_totalBytesSent);
 
+    // Statistics per message command and peer address, kept across disconnects
+    CNetStats m_net_stats;
+
     // Whitelisted ranges. Any node connecting from these is automatically
     // whitelisted (as well as those connecting to whitelisted binds).
     std::vector<CSubNet> vWhitelistedRange;
 
     unsigned int nSendBufferMaxSize;
     unsigned int nReceiveFloodSize;
+    // Upload rate limits per peer and per peer and message class, in bytes per second (0 = no limit)
+    uint64_t m_peer_upload_rate;
+    std::array<uint64_t, SEND_CLASS_COUNT> m_peer_class_upload_rate;
+    int nMsgHandlerThreads;
 
     std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+    /** epoll instance of the socket handler, or -1 to fall back to poll() */
+    int m_epoll_fd{-1};
+    /** Sockets registered with m_epoll_fd: socket -> (owning node or -1, registered events).
+     *  Only touched by the socket handler thread. */
+    std::map<SOCKET, std::pair<NodeId, uint32_t>> m_epoll_registered;
+#endif
     std::atomic<bool> fNetworkActive;
     banmap_t setBanned;
     CCriticalSection cs_setBanned;
@@ -435,10 +637,10 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    /** flags and condition variables for waking the message processors, one per worker. */
+    std::vector<bool> vMsgProcWake;
+    std::vector<std::unique_ptr<std::condition_variable>> vCondMsgProc;
 
-    std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
     std::atomic<bool> flagInterruptMsgProc;
 
@@ -448,7 +650,7 @@ private:
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandler;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -532,8 +734,6 @@ extern bool fDiscover;
 extern bool fListen;
 extern bool g_relay_txes;
 
-extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
-
 /** Subversion as sent to the P2P network in `version` messages */
 extern std::string strSubVersion;
 
@@ -581,6 +781,111 @@ public:
 
 
 
+/**
+ * Pool of reusable message receive buffers, bucketed into power-of-two size
+ * classes. A CNetMessage draws its payload buffer from the pool once the
+ * header is known and hands it back when it is destroyed, so repeated block
+ * and cmpctblock traffic doesn't reallocate (and re-zero on free) megabytes
+ * per message.
+ */
+class CRecvBufferPool
+{
+public:
+    static const size_t MIN_CLASS_SIZE = 4 * 1024;
+    static const int NUM_CLASSES = 11; // 4 KiB .. 4 MiB
+    static const size_t DEFAULT_MAX_POOLED_BYTES = 32 * 1024 * 1024;
+    static const size_t MAX_BUFFERS_PER_CLASS = 64;
+
+    struct Stats {
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nPooledBytes;
+        uint64_t nBytesCopied;
+        uint64_t nBytesInPlace;
+    };
+
+    explicit CRecvBufferPool(size_t nMaxPooledBytesIn = DEFAULT_MAX_POOLED_BYTES) : nMaxPooledBytes(nMaxPooledBytesIn), nPooledBytes(0), nHits(0), nMisses(0), nBytesCopied(0), nBytesInPlace(0) {}
+
+    /** Return an empty buffer, with capacity for at least nSize bytes if one was pooled. */
+    CSerializeData Acquire(size_t nSize);
+    /** Give a buffer back to the pool. Buffers that don't fit are freed. */
+    void Release(CSerializeData&& buf);
+
+    void RecordCopied(uint64_t nBytes) { nBytesCopied += nBytes; }
+    void RecordInPlace(uint64_t nBytes) { nBytesInPlace += nBytes; }
+
+    Stats GetStats() const;
+
+private:
+    static int SizeClass(size_t nSize);
+
+    const size_t nMaxPooledBytes;
+    mutable CCriticalSection cs_pool;
+    std::vector<CSerializeData> vFree[NUM_CLASSES] GUARDED_BY(cs_pool);
+    size_t nPooledBytes GUARDED_BY(cs_pool);
+
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nBytesCopied;
+    std::atomic<uint64_t> nBytesInPlace;
+};
+
+extern CRecvBufferPool g_recv_buffer_pool;
+
+/**
+ * Transactions to announce to peers, shared by all of them. A relayed txid
+ * is appended once rather than once per peer. At a trickle, the txids
+ * appended since the last trickle (of any peer) are put in mempool order once
+ * and sealed onto the announcement log; each peer then only keeps a cursor
+ * into the log, next to its filterInventoryKnown.
+ */
+class CTxAnnounceQueue
+{
+public:
+    /** Maximum number of sealed txids kept for peers that fall behind. */
+    static const size_t MAX_LOG_SIZE = 200000;
+
+    CTxAnnounceQueue() : nLogStart(0) {}
+
+    /** Start tracking a peer; it is announced txids relayed from now on. */
+    void AddPeer(NodeId id);
+    void RemovePeer(NodeId id);
+
+    /** Queue a txid for announcement to all peers. */
+    void Push(const uint256& txid);
+
+    /**
+     * Seal the txids queued since the last call onto the log, ordered by
+     * sort (which may also drop txids that shouldn't be announced).
+     */
+    void Seal(const std::function<void(std::vector<uint256>&)>& sort);
+
+    /**
+     * Copy up to nMax txids from the peer's cursor onwards into txids.
+     * Returns the log position of the first one, to be passed to SetCursor
+     * along with the number of txids the peer went through.
+     */
+    uint64_t Get(NodeId id, size_t nMax, std::vector<uint256>& txids) const;
+    void SetCursor(NodeId id, uint64_t nPos);
+    /** Skip everything sealed so far for the peer. */
+    void SkipToEnd(NodeId id);
+
+    size_t LogSize() const;
+
+private:
+    void Prune() EXCLUSIVE_LOCKS_REQUIRED(cs_queue);
+
+    mutable CCriticalSection cs_queue;
+    std::vector<uint256> vPending GUARDED_BY(cs_queue);
+    std::deque<uint256> vLog GUARDED_BY(cs_queue);
+    /** Log position of vLog.front() */
+    uint64_t nLogStart GUARDED_BY(cs_queue);
+    std::map<NodeId, uint64_t> mapCursors GUARDED_BY(cs_queue);
+};
+
+extern CTxAnnounceQueue g_tx_announce_queue;
+
+
 class CNetMessage {
 private:
     mutable CHash256 hasher;
@@ -588,7 +893,7 @@ private:
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    unsigned char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -597,14 +902,17 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    CNetMessage(const CNetMessage&) = delete;
+    CNetMessage& operator=(const CNetMessage&) = delete;
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -616,12 +924,16 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Expose the next part of the payload buffer, so data can be received into it directly. */
+    char* GetDataBuffer(unsigned int& nMax);
+    /** Account for nBytes written at GetDataBuffer(). */
+    void CommitData(unsigned int nBytes);
 };
 
 
@@ -633,10 +945,16 @@ public:
     // socket
     std::atomic<ServiceFlags> nServices;
     SOCKET hSocket;
-    size_t nSendSize; // total size of all vSendMsg entries
+    size_t nSendSize; // total size of all vSendMsg entries and queued messages
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<std::shared_ptr<const std::vector<unsigned char>>> vSendMsg;
+    // Messages waiting to be moved to vSendMsg, per SendClass
+    std::array<std::deque<CSharedNetMsg>, SEND_CLASS_COUNT> vSendQueue;
+    size_t nSendQueuedSize{0}; // total size of all vSendQueue entries
+    size_t nMaxSendSize{0}; // highest nSendSize so far
+    CTokenBucket m_send_bucket;
+    std::array<CTokenBucket, SEND_CLASS_COUNT> m_send_class_bucket;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -644,6 +962,10 @@ public:
     CCriticalSection cs_vProcessMsg;
     std::list<CNetMessage> vProcessMsg;
     size_t nProcessQueueSize;
+    size_t nMaxProcessQueueSize{0}; // highest nProcessQueueSize so far
+    // Number of this peer's messages processed, and the time it took
+    std::atomic<uint64_t> nMsgsProcessed{0};
+    std::atomic<uint64_t> nProcessTimeMicros{0};
 
     CCriticalSection cs_sendProcessing;
 
@@ -716,8 +1038,11 @@ public:
     std::atomic<int> nStartingHeight;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    // Addresses are pushed by other peers' message handlers (RelayAddress),
+    // which may run on a different thread than this peer's.
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend GUARDED_BY(cs_addrSend);
+    CRollingBloomFilter addrKnown GUARDED_BY(cs_addrSend);
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -725,16 +1050,12 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
-    // Set of transaction ids we still have to announce.
-    // They are sorted by the mempool before relay, so the order is not important.
-    std::set<uint256> setInventoryTxToSend;
+    // Transactions still to be announced are kept in g_tx_announce_queue.
     // List of block ids we still have announce.
     // There is no final sorting before sending, as they are always sent immediately
     // and in the order requested.
     std::vector<uint256> vInventoryBlockToSend;
     CCriticalSection cs_inventory;
-    std::set<uint256> setAskFor;
-    std::multimap<int64_t, CInv> mapAskFor;
 <<<<<<< HEAD
     int64_t nNextInvSend;
 =======
@@ -770,10 +1091,6 @@ public:
     CAmount lastSentFeeFilter;
     int64_t nextSendTimeFeeFilter;
 
-    std::set<uint256> orphan_work_set;
-
-    std::set<uint256> orphan_work_set;
-
     CNode(NodeId id, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn, SOCKET hSocketIn, const CAddress &addrIn, uint64_t nKeyedNetGroupIn, uint64_t nLocalHostNonceIn, const CAddress &addrBindIn, const std::string &addrNameIn = "", bool fInboundIn = false);
     ~CNode();
     CNode(const CNode&) = delete;
@@ -788,6 +1105,8 @@ private:
     int nSendVersion;
     std::list<CNetMessage> vRecvMsg;  // Used only by SocketHandler thread
 
+    void RecordRecvMsgComplete(CNetMessage& msg, int64_t nTimeMicros) EXCLUSIVE_LOCKS_REQUIRED(cs_vRecv);
+
     mutable CCriticalSection cs_addrName;
     std::string addrName;
 
@@ -815,6 +1134,10 @@ public:
     }
 
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
+    /** If a large payload is being received, point pch at its buffer so recv() can fill it directly. */
+    bool GetRecvBuffer(char*& pch, unsigned int& nMax);
+    /** Like ReceiveMsgBytes, for nBytes already received into the buffer from GetRecvBuffer. */
+    bool ReceiveMsgBytesInPlace(unsigned int nBytes, bool& complete);
 
     void SetRecvVersion(int nVersionIn)
     {
@@ -846,11 +1169,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -872,14 +1197,11 @@ public:
         }
     }
 
+    // Transactions are announced through g_tx_announce_queue instead.
     void PushInventory(const CInv& inv)
     {
         LOCK(cs_inventory);
-        if (inv.type == MSG_TX) {
-            if (!filterInventoryKnown.contains(inv.hash)) {
-                setInventoryTxToSend.insert(inv.hash);
-            }
-        } else if (inv.type == MSG_BLOCK) {
+        if (inv.type == MSG_BLOCK) {
             vInventoryBlockToSend.push_back(inv.hash);
         }
     }
@@ -890,8 +1212,6 @@ public:
         vBlockHashesToAnnounce.push_back(hash);
     }
 
-    void AskFor(const CInv& inv);
-
     void CloseSocketDisconnect();
 
     void copyStats(CNodeStats &stats);
@@ -11,10 +11,15 @@
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
+#include <index/blockfilterindex.h>
 #include <validation.h>
 #include <merkleblock.h>
 #include <netmessagemaker.h>
 #include <netbase.h>
+#include <node/blockcache.h>
+#include <node/headerssync.h>
+#include <node/txorphanage.h>
+#include <node/txrequest.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
 #include <primitives/block.h>
@@ -42,10 +47,6 @@
 # error "Bitcoin cannot be compiled without assertions."
 #endif
 
-/** Expiration time for orphan transactions in seconds */
-static constexpr int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
-/** Minimum time between orphan transactions expire time checks in seconds */
-static constexpr int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Headers download timeout expressed in microseconds
  *  Timeout = base + per_header * (expected number of headers) */
 static constexpr int64_t HEADERS_DOWNLOAD_TIMEOUT_BASE = 15 * 60 * 1000000; // 15 minutes
@@ -70,18 +71,28 @@ static constexpr int STALE_RELAY_AGE_LIMIT = 30 * 24 * 60 * 60;
 /// Age after which a block is considered historical for purposes of rate
 /// limiting block relay. Set to one week, denominated in seconds.
 static constexpr int HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Bounds on a peer's adaptive number of blocks in flight. Peers start out at MAX_BLOCKS_IN_TRANSIT_PER_PEER. */
+static constexpr int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static constexpr int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** A peer's block window is sized to take about this long (in microseconds) to download at its measured rate. */
+static constexpr int64_t BLOCK_DOWNLOAD_QUEUE_TARGET = 10 * 1000000;
+/** Minimum time (in microseconds) a block must have been in flight before it is re-requested from a faster peer. */
+static constexpr int64_t BLOCK_STRAGGLER_MIN_AGE = 1000000;
+/** Re-request a straggling block only from a peer expected to deliver it at least this many times sooner. */
+static constexpr int64_t BLOCK_STRAGGLER_SPEEDUP = 2;
+/** Maximum number of transaction announcements tracked per peer, requested or not. */
+static constexpr size_t MAX_PEER_TX_ANNOUNCEMENTS = 2 * MAX_INV_SZ;
+/** Delay (in microseconds) before requesting a transaction announced by a non-preferred peer, giving preferred peers a head start. */
+static constexpr int64_t NONPREF_PEER_TX_DELAY = 2 * 1000000;
+/** How long (in microseconds) to wait for a requested transaction before asking another announcer. */
+static constexpr int64_t TX_REQUEST_TIMEOUT = 60 * 1000000;
+/** Maximum number of compact filters that may be requested with one getcfilters. See BIP 157. */
+static constexpr uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of cf hashes that may be requested with one getcfheaders. See BIP 157. */
+static constexpr uint32_t MAX_GETCFHEADERS_SIZE = 2000;
 
-struct COrphanTx {
-    // When modifying, adapt the copy of this definition in tests/DoS_tests.
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-    size_t list_pos;
-};
 static CCriticalSection g_cs_orphans;
-std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(g_cs_orphans);
-
-void EraseOrphansFor(NodeId peer);
+static TxOrphanage g_orphanage GUARDED_BY(g_cs_orphans);
 
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch, const std::string& message="") EXCLUSIVE_LOCKS_REQUIRED(cs_main);
@@ -100,6 +111,8 @@ static constexpr unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_
 static constexpr unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
 /** Maximum feefilter broadcast delay after significant change. */
 static constexpr unsigned int MAX_FEEFILTER_CHANGE_DELAY = 5 * 60;
+/** Number of announced transactions whose bloom filter data elements are kept for filtered peers. */
+static constexpr size_t MAX_RELAY_TX_ELEMENTS = 1000;
 
 // Internal stuff
 namespace {
@@ -142,12 +155,19 @@ namespace {
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
+        int64_t nTimeRequested;                                  //!< When the block was requested (in microseconds, by GetMockableTimeMicros).
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight GUARDED_BY(cs_main);
 
     /** Stack of nodes which we have set to announce using compact blocks */
     std::list<NodeId> lNodesAnnouncingHeaderAndIDs GUARDED_BY(cs_main);
 
+    /** Transaction announcements and in-flight transaction requests. */
+    TxRequestTracker g_txrequest GUARDED_BY(cs_main);
+
+    /** Header ranges between anchors, fetched from peers other than the sync peer. */
+    HeadersSyncSegments g_headers_sync GUARDED_BY(cs_main);
+
     /** Number of preferable block download peers. */
     int nPreferredDownload GUARDED_BY(cs_main) = 0;
 
@@ -166,17 +186,21 @@ namespace {
     /** Expiration-time ordered list of (expire time, relay map entry) pairs. */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration GUARDED_BY(cs_main);
 
-    struct IteratorComparator
+    /** A transaction being announced, together with its bloom filter data elements. */
+    struct RelayTxElements
     {
-        template<typename I>
-        bool operator()(const I& a, const I& b) const
-        {
-            return &(*a) < &(*b);
-        }
-    };
-    std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(g_cs_orphans);
+        const CTransactionRef tx;
+        const CBloomTxElements elements;
 
-    std::vector<std::map<uint256, COrphanTx>::iterator> g_orphan_list GUARDED_BY(g_cs_orphans); //! For random eviction
+        explicit RelayTxElements(CTransactionRef txIn) : tx(std::move(txIn)), elements(*tx) {}
+    };
+    /**
+     * Data elements of recently announced transactions, extracted for the
+     * first peer with a bloom filter that a transaction is checked against
+     * and reused for the others. Oldest entries are dropped first.
+     */
+    std::map<uint256, std::shared_ptr<const RelayTxElements>> mapRelayTxElements GUARDED_BY(cs_main);
+    std::deque<uint256> vRelayTxElementsOrder GUARDED_BY(cs_main);
 
     static size_t vExtraTxnForCompactIt GUARDED_BY(g_cs_orphans) = 0;
     static std::vector<std::pair<uint256, CTransactionRef>> vExtraTxnForCompact GUARDED_BY(g_cs_orphans);
@@ -229,6 +253,20 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How many blocks may be in flight from this peer, adapted to its measured download rate.
+    int m_max_blocks_in_flight;
+    //! Moving average of the time (in microseconds) each requested block took to arrive after the
+    //! previous one (or its request, if later), i.e. the inverse of the peer's block rate. 0 until measured.
+    int64_t m_block_service_time;
+    //! Moving average of the time (in microseconds) from requesting a block to receiving it.
+    int64_t m_block_latency;
+    //! When the last requested block arrived from this peer (in microseconds).
+    int64_t m_last_block_received;
+    //! Requested blocks received from this peer, and their total size.
+    uint64_t m_blocks_downloaded;
+    uint64_t m_block_bytes_downloaded;
+    //! Blocks that were in flight from this peer and re-requested from a faster one.
+    uint64_t m_blocks_rerequested;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -378,6 +416,13 @@ struct CNodeState {
         fSupportsDesiredCmpctVersion = false;
         m_chain_sync = { 0, nullptr, false, false };
         m_last_block_announcement = 0;
+        m_max_blocks_in_flight = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        m_block_service_time = 0;
+        m_block_latency = 0;
+        m_last_block_received = 0;
+        m_blocks_downloaded = 0;
+        m_block_bytes_downloaded = 0;
+        m_blocks_rerequested = 0;
     }
 };
 
@@ -466,7 +511,7 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr), GetMockableTimeMicros()});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -482,6 +527,79 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     return true;
 }
 
+/**
+ * Update nodeid's download rate measurements and block window for the arrival
+ * of a block we requested from it. Must be called before MarkBlockAsReceived.
+ */
+static void RecordBlockDownload(NodeId nodeid, const uint256& hash, size_t nBytes) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState *state = State(nodeid);
+    assert(state != nullptr);
+
+    int64_t nNow = GetMockableTimeMicros();
+    int64_t nTimeRequested = itInFlight->second.second->nTimeRequested;
+    // Blocks arrive one after another over the connection, so the time since
+    // the previous arrival (or the request, if later) is what this block cost.
+    int64_t nServiceTime = std::max<int64_t>(nNow - std::max(nTimeRequested, state->m_last_block_received), 1);
+    int64_t nLatency = std::max<int64_t>(nNow - nTimeRequested, 1);
+    if (state->m_block_service_time == 0) {
+        state->m_block_service_time = nServiceTime;
+        state->m_block_latency = nLatency;
+    } else {
+        state->m_block_service_time = (3 * state->m_block_service_time + nServiceTime) / 4;
+        state->m_block_latency = (3 * state->m_block_latency + nLatency) / 4;
+    }
+    state->m_last_block_received = nNow;
+    state->m_blocks_downloaded++;
+    state->m_block_bytes_downloaded += nBytes;
+
+    int64_t nWindow = BLOCK_DOWNLOAD_QUEUE_TARGET / state->m_block_service_time;
+    state->m_max_blocks_in_flight = std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nWindow));
+}
+
+/**
+ * Whether pindex, in flight from another peer, would likely arrive sooner if
+ * requested from nodeid instead, judging by both peers' measured rates.
+ */
+static bool IsStragglingBlock(NodeId nodeid, const CBlockIndex* pindex, int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first == nodeid)
+        return false;
+    const CNodeState *state = State(nodeid);
+    const CNodeState *holder = State(itInFlight->second.first);
+    assert(state != nullptr && holder != nullptr);
+    const QueuedBlock& queued = *itInFlight->second.second;
+
+    // Compact block reconstructions are never reassigned.
+    if (queued.partialBlock || state->m_block_service_time == 0)
+        return false;
+    int64_t nWaited = nNow - queued.nTimeRequested;
+    if (nWaited < BLOCK_STRAGGLER_MIN_AGE)
+        return false;
+
+    int64_t nOurEta = (state->nBlocksInFlight + 1) * state->m_block_service_time;
+    if (holder->m_block_service_time == 0) {
+        // No measurements for the holder: compare against how long it has had the block.
+        return nOurEta * BLOCK_STRAGGLER_SPEEDUP < nWaited;
+    }
+    int nAhead = 0;
+    for (const QueuedBlock& other : holder->vBlocksInFlight) {
+        if (&other == &queued) break;
+        nAhead++;
+    }
+    // The holder has been working on its first queued block since it was
+    // requested or since the previous block arrived, whichever was later.
+    int64_t nHolderSince = std::max(holder->vBlocksInFlight.front().nTimeRequested, holder->m_last_block_received);
+    int64_t nHolderEta = (nAhead + 1) * holder->m_block_service_time - (nNow - nHolderSince);
+    if (nHolderEta <= 0) {
+        // Overdue at the holder's own pace.
+        return nOurEta < nWaited;
+    }
+    return nOurEta * BLOCK_STRAGGLER_SPEEDUP < nHolderEta;
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 static void ProcessBlockAvailability(NodeId nodeid) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
     CNodeState *state = State(nodeid);
@@ -584,7 +702,7 @@ static bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex) EXCLUSIV
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
  *  at most count entries. */
-static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexWaitingFor, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     if (count == 0)
         return;
@@ -671,6 +789,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -702,6 +821,7 @@ void PeerLogicValidation::InitializeNode(CNode *pnode) {
         LOCK(cs_main);
         mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName), pnode->fInbound, pnode->m_manual_connection));
     }
+    g_tx_announce_queue.AddPeer(nodeid);
     if(!pnode->fInbound)
         PushNodeVersion(pnode, connman, GetTime());
 }
@@ -722,7 +842,13 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
     for (const QueuedBlock& entry : state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
+    {
+        LOCK(g_cs_orphans);
+        g_orphanage.EraseForPeer(nodeid);
+    }
+    g_txrequest.DisconnectedPeer(nodeid);
+    g_headers_sync.DisconnectedPeer(nodeid);
+    g_tx_announce_queue.RemovePeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -737,6 +863,7 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
         assert(nPreferredDownload == 0);
         assert(nPeersWithValidatedDownloads == 0);
         assert(g_outbound_peers_with_protect_from_disconnect == 0);
+        assert(g_txrequest.Size() == 0);
     }
     LogPrint(BCLog::NET, "Cleared nodestate for peer=%d\n", nodeid);
 }
@@ -749,6 +876,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.nMaxBlocksInFlight = state->m_max_blocks_in_flight;
+    stats.nBlockServiceTime = state->m_block_service_time;
+    stats.nBlockLatency = state->m_block_latency;
+    stats.nBlocksDownloaded = state->m_blocks_downloaded;
+    stats.nBlockBytesDownloaded = state->m_block_bytes_downloaded;
+    stats.nBlocksReRequested = state->m_blocks_rerequested;
     for (const QueuedBlock& queue : state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -758,7 +891,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// mapOrphanTransactions
+// Orphan transactions
 //
 
 static void AddToCompactExtraTransactions(const CTransactionRef& tx) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
@@ -772,130 +905,6 @@ static void AddToCompactExtraTransactions(const CTransactionRef& tx) EXCLUSIVE_L
     vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
 }
 
-bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
-{
-    const uint256& hash = tx->GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 100 orphans, each of which is at most 100,000 bytes big is
-    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
-    unsigned int sz = GetTransactionWeight(*tx);
-    if (sz > MAX_STANDARD_TX_WEIGHT)
-    {
-        LogPrint(BCLog::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, g_orphan_list.size()});
-    assert(ret.second);
-    g_orphan_list.push_back(ret.first);
-    for (const CTxIn& txin : tx->vin) {
-        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
-    }
-
-    AddToCompactExtraTransactions(tx);
-
-    LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
-{
-    std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return 0;
-    for (const CTxIn& txin : it->second.tx->vin)
-    {
-        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(it);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-
-    size_t old_pos = it->second.list_pos;
-    assert(g_orphan_list[old_pos] == it);
-    if (old_pos + 1 != g_orphan_list.size()) {
-        // Unless we're deleting the last entry in g_orphan_list, move the last
-        // entry to the position we're deleting.
-        auto it_last = g_orphan_list.back();
-        g_orphan_list[old_pos] = it_last;
-        it_last->second.list_pos = old_pos;
-    }
-    g_orphan_list.pop_back();
-
-    mapOrphanTransactions.erase(it);
-    return 1;
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    LOCK(g_cs_orphans);
-    int nErased = 0;
-    std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        std::map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-        }
-    }
-    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx from peer=%d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    LOCK(g_cs_orphans);
-
-    unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
-    int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
-        int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            std::map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
-            }
-        }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
-        if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx due to expiration\n", nErased);
-    }
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-<<<<<<< HEAD
-        uint256 randomhash = GetRandHash();
-        std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-=======
-        size_t randompos = rng.randrange(g_orphan_list.size());
-        EraseOrphanTx(g_orphan_list[randompos]->first);
->>>>>>> upstream/0.18
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
 /**
  * Mark a misbehaving peer to be banned depending upon the value of `-banscore`.
  */
@@ -1034,6 +1043,21 @@ PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &schedu
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
 
+    {
+        LOCK(cs_main);
+        g_headers_sync = HeadersSyncSegments();
+        for (const auto& checkpoint : Params().Checkpoints().mapCheckpoints) {
+            g_headers_sync.AddAnchor(checkpoint.first, checkpoint.second);
+        }
+        for (const std::string& anchor : gArgs.GetArgs("-headersanchor")) {
+            int height;
+            uint256 hash;
+            if (ParseHeadersAnchor(anchor, height, hash)) {
+                g_headers_sync.AddAnchor(height, hash);
+            }
+        }
+    }
+
     const Consensus::Params& consensusParams = Params().GetConsensus();
     // Stale tip checking and peer eviction are on two different timers, but we
     // don't want them to get out of sync due to drift in the scheduler, so we
@@ -1044,36 +1068,13 @@ PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &schedu
 }
 
 /**
- * Evict orphan txn pool entries (EraseOrphanTx) based on a newly connected
+ * Evict orphan txn pool entries based on a newly connected
  * block. Also save the time of the last tip update.
  */
 void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex, const std::vector<CTransactionRef>& vtxConflicted) {
-    LOCK(g_cs_orphans);
-
-    std::vector<uint256> vOrphanErase;
-
-    for (const CTransactionRef& ptx : pblock->vtx) {
-        const CTransaction& tx = *ptx;
-
-        // Which orphan pool entries must we evict?
-        for (const auto& txin : tx.vin) {
-            auto itByPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-            if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-            for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-                const CTransaction& orphanTx = *(*mi)->second.tx;
-                const uint256& orphanHash = orphanTx.GetHash();
-                vOrphanErase.push_back(orphanHash);
-            }
-        }
-    }
-
-    // Erase orphan transactions included or precluded by this block
-    if (vOrphanErase.size()) {
-        int nErased = 0;
-        for (uint256 &orphanHash : vOrphanErase) {
-            nErased += EraseOrphanTx(orphanHash);
-        }
-        LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    {
+        LOCK(g_cs_orphans);
+        g_orphanage.EraseForBlock(*pblock);
     }
 
     g_last_tip_update = GetTime();
@@ -1085,6 +1086,61 @@ static std::shared_ptr<const CBlock> most_recent_block GUARDED_BY(cs_most_recent
 static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block GUARDED_BY(cs_most_recent_block);
 static uint256 most_recent_block_hash GUARDED_BY(cs_most_recent_block);
 static bool fWitnessesPresentInMostRecentCompactBlock GUARDED_BY(cs_most_recent_block);
+// Serialized "block" messages for most_recent_block, built on first request and shared by all peers
+static std::shared_ptr<const CSharedNetMsg> most_recent_block_msg GUARDED_BY(cs_most_recent_block);
+static std::shared_ptr<const CSharedNetMsg> most_recent_block_msg_no_witness GUARDED_BY(cs_most_recent_block);
+// Filter-independent merkleblock data for most_recent_block, built on first request and shared by all peers
+static std::shared_ptr<const CFilteredBlockData> most_recent_filtered_block GUARDED_BY(cs_most_recent_block);
+
+/**
+ * Return the serialized "block" message for pblock, serializing it at most
+ * once per witness mode, or nullptr if pblock is no longer the most recent block.
+ */
+static std::shared_ptr<const CSharedNetMsg> GetRecentBlockMsg(const std::shared_ptr<const CBlock>& pblock, bool fWitness)
+{
+    LOCK(cs_most_recent_block);
+    if (most_recent_block != pblock)
+        return nullptr;
+    std::shared_ptr<const CSharedNetMsg>& msg = fWitness ? most_recent_block_msg : most_recent_block_msg_no_witness;
+    if (!msg) {
+        int nSendFlags = fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        msg = std::make_shared<const CSharedNetMsg>(CNetMsgMaker(PROTOCOL_VERSION).Make(nSendFlags, NetMsgType::BLOCK, *pblock));
+    }
+    return msg;
+}
+
+/**
+ * Return the bloom filter data elements of a transaction being announced,
+ * extracting them only for the first filtered peer it is checked against.
+ */
+static const CBloomTxElements& GetRelayTxElements(const CTransactionRef& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    auto it = mapRelayTxElements.find(tx->GetHash());
+    if (it == mapRelayTxElements.end()) {
+        if (vRelayTxElementsOrder.size() >= MAX_RELAY_TX_ELEMENTS) {
+            mapRelayTxElements.erase(vRelayTxElementsOrder.front());
+            vRelayTxElementsOrder.pop_front();
+        }
+        it = mapRelayTxElements.emplace(tx->GetHash(), std::make_shared<const RelayTxElements>(tx)).first;
+        vRelayTxElementsOrder.push_back(tx->GetHash());
+    }
+    return it->second->elements;
+}
+
+/**
+ * Return the data for building merkleblocks of pblock, computing it at most
+ * once, or nullptr if pblock is no longer the most recent block.
+ */
+static std::shared_ptr<const CFilteredBlockData> GetRecentFilteredBlockData(const std::shared_ptr<const CBlock>& pblock)
+{
+    LOCK(cs_most_recent_block);
+    if (most_recent_block != pblock)
+        return nullptr;
+    if (!most_recent_filtered_block) {
+        most_recent_filtered_block = std::make_shared<const CFilteredBlockData>(pblock);
+    }
+    return most_recent_filtered_block;
+}
 
 /**
  * Maintain state about the best-seen block and fast-announce a compact block
@@ -1110,12 +1166,17 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         most_recent_block = pblock;
         most_recent_compact_block = pcmpctblock;
         fWitnessesPresentInMostRecentCompactBlock = fWitnessEnabled;
+        most_recent_block_msg.reset();
+        most_recent_block_msg_no_witness.reset();
+        most_recent_filtered_block.reset();
     }
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
+    // Serialized once, on the first peer it is announced to
+    std::unique_ptr<CSharedNetMsg> cmpctblock_msg;
+
+    connman->ForEachNode([this, &pcmpctblock, &cmpctblock_msg, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
         AssertLockHeld(cs_main);
 
-        // TODO: Avoid the repeated-serialization here
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
@@ -1127,7 +1188,9 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
 
             LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->GetId());
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            if (!cmpctblock_msg)
+                cmpctblock_msg = MakeUnique<CSharedNetMsg>(msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            connman->PushMessage(pnode, *cmpctblock_msg);
             state.pindexBestHeaderSent = pindex;
         }
     });
@@ -1208,6 +1271,22 @@ void PeerLogicValidation::BlockChecked(const CBlock& block, const CValidationSta
 //
 
 
+/**
+ * Record that node announced txhash. Announcements from outbound and
+ * whitelisted peers are preferred; others become requestable after
+ * NONPREF_PEER_TX_DELAY.
+ */
+void static RequestTx(const CNode* node, const uint256& txhash, int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const NodeId nodeid = node->GetId();
+    if (g_txrequest.Count(nodeid) >= MAX_PEER_TX_ANNOUNCEMENTS) {
+        // Too many outstanding announcements from this peer; ignore it.
+        return;
+    }
+    const bool preferred = !node->fInbound || node->fWhitelisted;
+    g_txrequest.ReceivedInv(nodeid, txhash, preferred, preferred ? nNow : nNow + NONPREF_PEER_TX_DELAY);
+}
+
 bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     switch (inv.type)
@@ -1228,7 +1307,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
             {
                 LOCK(g_cs_orphans);
-                if (mapOrphanTransactions.count(inv.hash)) return true;
+                if (g_orphanage.HaveTx(inv.hash)) return true;
             }
 
             return recentRejects->contains(inv.hash) ||
@@ -1246,11 +1325,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
 static void RelayTransaction(const CTransaction& tx, CConnman* connman)
 {
-    CInv inv(MSG_TX, tx.GetHash());
-    connman->ForEachNode([&inv](CNode* pnode)
-    {
-        pnode->PushInventory(inv);
-    });
+    g_tx_announce_queue.Push(tx.GetHash());
 }
 
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connman)
@@ -1359,17 +1434,19 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
     // it's available before trying to send.
     if (send && (pindex->nStatus & BLOCK_HAVE_DATA))
     {
+        // Class of the message the block was sent in, for the inv that follows it
+        SendClass block_class = SendClass::BLOCK;
         std::shared_ptr<const CBlock> pblock;
         if (a_recent_block && a_recent_block->GetHash() == pindex->GetBlockHash()) {
             pblock = a_recent_block;
-        } else if (inv.type == MSG_WITNESS_BLOCK) {
-            // Fast-path: in this case it is possible to serve the block directly from disk,
-            // as the network format matches the format on disk
-            std::vector<uint8_t> block_data;
-            if (!ReadRawBlockFromDisk(block_data, pindex, chainparams.MessageStart())) {
+        } else if (inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_BLOCK) {
+            // Fast-path: serve the serialized block from the block serving cache,
+            // or straight from disk when the network format matches the format on disk
+            std::shared_ptr<const CSharedNetMsg> block_msg = GetBlockMsg(pindex, inv.type == MSG_WITNESS_BLOCK, chainparams);
+            if (!block_msg) {
                 assert(!"cannot load block from disk");
             }
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
+            connman->PushMessage(pfrom, *block_msg);
             // Don't set pblock as we've sent the block
         } else {
             // Send block from disk
@@ -1379,10 +1456,16 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
             pblock = pblockRead;
         }
         if (pblock) {
-            if (inv.type == MSG_BLOCK)
-                connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
-            else if (inv.type == MSG_WITNESS_BLOCK)
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
+            if (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK) {
+                bool fWitness = inv.type == MSG_WITNESS_BLOCK;
+                std::shared_ptr<const CSharedNetMsg> recent_block_msg;
+                if (pblock == a_recent_block)
+                    recent_block_msg = GetRecentBlockMsg(pblock, fWitness);
+                if (recent_block_msg)
+                    connman->PushMessage(pfrom, *recent_block_msg);
+                else
+                    connman->PushMessage(pfrom, msgMaker.Make(fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
+            }
             else if (inv.type == MSG_FILTERED_BLOCK)
             {
                 bool sendMerkleBlock = false;
@@ -1391,10 +1474,17 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
                     LOCK(pfrom->cs_filter);
                     if (pfrom->pfilter) {
                         sendMerkleBlock = true;
-                        merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
+                        std::shared_ptr<const CFilteredBlockData> filtered_block_data;
+                        if (pblock == a_recent_block)
+                            filtered_block_data = GetRecentFilteredBlockData(pblock);
+                        if (filtered_block_data)
+                            merkleBlock = CMerkleBlock(*filtered_block_data, *pfrom->pfilter);
+                        else
+                            merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
                     }
                 }
                 if (sendMerkleBlock) {
+                    block_class = GetSendClass(NetMsgType::MERKLEBLOCK);
                     connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
                     // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                     // This avoids hurting performance by pointlessly requiring a round-trip
@@ -1418,6 +1508,7 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
                 bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
                 int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
                 if (CanDirectFetch(consensusParams) && pindex->nHeight >= ::ChainActive().Height() - MAX_CMPCTBLOCK_DEPTH) {
+                    block_class = GetSendClass(NetMsgType::CMPCTBLOCK);
                     if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == pindex->GetBlockHash()) {
                         connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
                     } else {
@@ -1435,10 +1526,11 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
         {
             // Bypass PushInventory, this must send even if redundant,
             // and we want it right after the last block so they don't
-            // wait for other stuff first.
+            // wait for other stuff first. Queued with the block so it
+            // can't overtake it.
             std::vector<CInv> vInv;
             vInv.push_back(CInv(MSG_BLOCK, ::ChainActive().Tip()->GetBlockHash()));
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv), block_class);
             pfrom->hashContinue.SetNull();
         }
     }
@@ -1532,6 +1624,47 @@ inline void static SendBlockTransactions(const CBlock& block, const BlockTransac
     connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
+/**
+ * Validate, in order, the headers sync segments that connect to the headers
+ * chain. The peer that sent the last header of a segment is known to have its
+ * blocks, so block download can use it.
+ */
+static void ProcessHeadersSegments(const CChainParams& chainparams)
+{
+    std::vector<CBlockHeader> headers;
+    NodeId peer;
+    while (true) {
+        {
+            LOCK(cs_main);
+            auto have_header = [](const uint256& hash) {
+                AssertLockHeld(cs_main);
+                return LookupBlockIndex(hash) != nullptr;
+            };
+            if (!g_headers_sync.PopReady(have_header, headers, peer)) return;
+        }
+
+        const CBlockIndex *pindexLast = nullptr;
+        for (size_t i = 0; i < headers.size(); i += MAX_HEADERS_RESULTS) {
+            const std::vector<CBlockHeader> batch(headers.begin() + i, headers.begin() + std::min(headers.size(), i + MAX_HEADERS_RESULTS));
+            CValidationState state;
+            if (!ProcessNewBlockHeaders(batch, state, chainparams, &pindexLast)) {
+                // Don't guess which peer is to blame; the sync peer will
+                // fetch (and validate) this range itself.
+                LOCK(cs_main);
+                LogPrint(BCLog::NET, "invalid headers segment (%s), last sent by peer=%d; dropping headers sync segments\n", FormatStateMessage(state), peer);
+                g_headers_sync.Clear();
+                return;
+            }
+        }
+
+        LOCK(cs_main);
+        LogPrint(BCLog::NET, "validated headers segment up to (%d)\n", pindexLast->nHeight);
+        if (State(peer) != nullptr) {
+            UpdateBlockAvailability(peer, pindexLast->GetBlockHash());
+        }
+    }
+}
+
 bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::vector<CBlockHeader>& headers, const CChainParams& chainparams, bool via_compact_block)
 {
     const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
@@ -1600,6 +1733,10 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
         }
     }
 
+    // These headers may have reached the start of a headers sync segment;
+    // validate it before asking this peer for more.
+    ProcessHeadersSegments(chainparams);
+
     {
         LOCK(cs_main);
         CNodeState *nodestate = State(pfrom->GetId());
@@ -1621,10 +1758,14 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
 
         if (nCount == MAX_HEADERS_RESULTS) {
             // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of ::ChainActive().Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrint(BCLog::NET, "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->GetId(), pfrom->nStartingHeight);
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, ::ChainActive().GetLocator(pindexLast), uint256()));
+            // If headers past pindexLast are already known (e.g. validated
+            // from a parallel headers sync segment), continue from there instead.
+            const CBlockIndex* pindexNext = pindexLast;
+            if (pindexBestHeader->GetAncestor(pindexLast->nHeight) == pindexLast) {
+                pindexNext = pindexBestHeader;
+            }
+            LogPrint(BCLog::NET, "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexNext->nHeight, pfrom->GetId(), pfrom->nStartingHeight);
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, ::ChainActive().GetLocator(pindexNext), uint256()));
         }
 
         bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
@@ -1633,8 +1774,9 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
         if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) && ::ChainActive().Tip()->nChainWork <= pindexLast->nChainWork) {
             std::vector<const CBlockIndex*> vToFetch;
             const CBlockIndex *pindexWalk = pindexLast;
-            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
-            while (pindexWalk && !::ChainActive().Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            // Calculate all the blocks we'd need to switch to pindexLast, up to
+            // as many as this peer may have in flight.
+            while (pindexWalk && !::ChainActive().Contains(pindexWalk) && vToFetch.size() <= (size_t)nodestate->m_max_blocks_in_flight) {
                 if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
                         !mapBlocksInFlight.count(pindexWalk->GetBlockHash()) &&
                         (!IsWitnessEnabled(pindexWalk->pprev, chainparams.GetConsensus()) || State(pfrom->GetId())->fHaveWitness)) {
@@ -1655,7 +1797,7 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
                 std::vector<CInv> vGetData;
                 // Download as much as possible, from earliest to latest.
                 for (const CBlockIndex *pindex : reverse_iterate(vToFetch)) {
-                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    if (nodestate->nBlocksInFlight >= nodestate->m_max_blocks_in_flight) {
                         // Can't download any more from this peer
                         break;
                     }
@@ -1713,88 +1855,261 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
     return true;
 }
 
-void static ProcessOrphanTx(CConnman* connman, std::set<uint256>& orphan_work_set, std::list<CTransactionRef>& removed_txn) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+/**
+ * Offer a batch of the orphans queued on peer's work set to the mempool.
+ * Returns whether the peer has more orphans left to reconsider.
+ */
+bool static ProcessOrphanTx(CConnman* connman, NodeId peer, std::list<CTransactionRef>& removed_txn) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
 {
     AssertLockHeld(cs_main);
     AssertLockHeld(g_cs_orphans);
-    std::set<NodeId> setMisbehaving;
-    bool done = false;
-    while (!done && !orphan_work_set.empty()) {
-        const uint256 orphanHash = *orphan_work_set.begin();
-        orphan_work_set.erase(orphan_work_set.begin());
-
-        auto orphan_it = mapOrphanTransactions.find(orphanHash);
-        if (orphan_it == mapOrphanTransactions.end()) continue;
-
-        const CTransactionRef porphanTx = orphan_it->second.tx;
-        const CTransaction& orphanTx = *porphanTx;
-        NodeId fromPeer = orphan_it->second.fromPeer;
-        bool fMissingInputs2 = false;
-<<<<<<< HEAD
-        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-        // anyone relaying LegitTxX banned)
-        CValidationState stateDummy;
 
-        if (setMisbehaving.count(fromPeer)) continue;
-        if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, &removed_txn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
-=======
-        // Use a new CValidationState because orphans come from different peers (and we call
-        // MaybePunishNode based on the source peer from the orphan map, not based on the peer
-        // that relayed the previous transaction).
-        CValidationState orphan_state;
+    // Offer the orphans in the work set to the mempool as one batch, together
+    // with the orphans spending their outputs (recursively), so that a chain
+    // of orphans is resolved parents first. The batch is bounded so that an
+    // orphan storm is spread over several message handler iterations.
+    std::vector<CTransactionRef> batch;
+    std::vector<NodeId> batch_peers;
+    for (const auto& orphan : g_orphanage.GetTxsToReconsider(peer, MAX_ORPHAN_RECONSIDER_BATCH)) {
+        batch.push_back(orphan.first);
+        batch_peers.push_back(orphan.second);
+    }
+    if (batch.empty()) return g_orphanage.HaveTxToReconsider(peer);
 
-        if (setMisbehaving.count(fromPeer)) continue;
-        if (AcceptToMemoryPool(mempool, orphan_state, porphanTx, &fMissingInputs2, &removed_txn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
->>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
+    // Use new CValidationStates because orphans come from different peers (and we call
+    // MaybePunishNode based on the source peer from the orphan map, not based on the peer
+    // that relayed the previous transaction).
+    std::vector<CValidationState> orphan_states;
+    std::vector<bool> missing_inputs;
+    const std::vector<bool> accepted = AcceptToMemoryPoolBatch(mempool, orphan_states, batch, missing_inputs, &removed_txn,
+                                                               false /* bypass_limits */, {} /* nAbsurdFees */);
+
+    std::set<NodeId> setMisbehaving;
+    for (size_t i = 0; i < batch.size(); i++) {
+        const CTransaction& orphanTx = *batch[i];
+        const uint256& orphanHash = orphanTx.GetHash();
+        const CValidationState& orphan_state = orphan_states[i];
+        if (accepted[i]) {
             LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
             RelayTransaction(orphanTx, connman);
-            for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(orphanHash, i));
-                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
-                    for (const auto& elem : it_by_prev->second) {
-                        orphan_work_set.insert(elem->first);
-                    }
-                }
-            }
-            EraseOrphanTx(orphanHash);
-            done = true;
-        } else if (!fMissingInputs2) {
-<<<<<<< HEAD
-            int nDos = 0;
-            if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                // Punish peer that gave us an invalid orphan tx
-                Misbehaving(fromPeer, nDos);
-                setMisbehaving.insert(fromPeer);
-=======
+            g_orphanage.EraseTx(orphanHash);
+        } else if (!missing_inputs[i]) {
             if (orphan_state.IsInvalid()) {
                 // Punish peer that gave us an invalid orphan tx
-                if (MaybePunishNode(fromPeer, orphan_state, /*via_compact_block*/ false)) {
-                    setMisbehaving.insert(fromPeer);
+                if (!setMisbehaving.count(batch_peers[i]) && MaybePunishNode(batch_peers[i], orphan_state, /*via_compact_block*/ false)) {
+                    setMisbehaving.insert(batch_peers[i]);
                 }
->>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
                 LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
             }
             // Has inputs but not accepted to mempool
             // Probably non-standard or insufficient fee
             LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
-<<<<<<< HEAD
-            if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
-=======
             assert(IsTransactionReason(orphan_state.GetReason()));
             if (!orphanTx.HasWitness() && orphan_state.GetReason() != ValidationInvalidReason::TX_WITNESS_MUTATED) {
->>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
                 // Do not use rejection cache for witness transactions or
                 // witness-stripped transactions, as they can have been malleated.
                 // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
                 assert(recentRejects);
                 recentRejects->insert(orphanHash);
             }
-            EraseOrphanTx(orphanHash);
-            done = true;
+            g_orphanage.EraseTx(orphanHash);
         }
-        mempool.check(pcoinsTip.get());
     }
+    mempool.check(pcoinsTip.get());
+    return g_orphanage.HaveTxToReconsider(peer);
+}
+
+/**
+ * Validates a getcfilters, getcfheaders or getcfcheckpt request and looks up
+ * the block index of its stop hash and the filter index serving it. Peers
+ * sending invalid requests are disconnected.
+ *
+ * @param[in]   pfrom           The peer that we received the request from
+ * @param[in]   filter_type     The filter type the request is for. Must be basic filters.
+ * @param[in]   start_height    The start height for the request
+ * @param[in]   stop_hash       The stop_hash for the request
+ * @param[in]   max_height_diff The maximum number of items permitted to request, as specified in BIP 157
+ * @param[out]  stop_index      The CBlockIndex for the stop_hash block, if the request can be serviced.
+ * @param[out]  filter_index    The filter index, if the request can be serviced.
+ * @return                      True if the request can be serviced.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, const CChainParams& chainparams,
+                                      BlockFilterType filter_type, uint32_t start_height,
+                                      const uint256& stop_hash, uint32_t max_height_diff,
+                                      const CBlockIndex*& stop_index,
+                                      BlockFilterIndex*& filter_index)
+{
+    const bool supported_filter_type =
+        (filter_type == BlockFilterType::BASIC &&
+         (pfrom->GetLocalServices() & NODE_COMPACT_FILTERS));
+    if (!supported_filter_type) {
+        LogPrint(BCLog::NET, "peer %d requested unsupported block filter type: %d\n",
+                 pfrom->GetId(), static_cast<uint8_t>(filter_type));
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        stop_index = LookupBlockIndex(stop_hash);
+
+        // Check that the stop block exists and the peer would be allowed to fetch it.
+        if (!stop_index || !BlockRequestAllowed(stop_index, chainparams.GetConsensus())) {
+            LogPrint(BCLog::NET, "peer %d requested invalid block hash: %s\n",
+                     pfrom->GetId(), stop_hash.ToString());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+    }
+
+    uint32_t stop_height = stop_index->nHeight;
+    if (start_height > stop_height) {
+        LogPrint(BCLog::NET, "peer %d sent invalid getcfilters/getcfheaders with "
+                 "start height %d and stop height %d\n",
+                 pfrom->GetId(), start_height, stop_height);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    if (stop_height - start_height >= max_height_diff) {
+        LogPrint(BCLog::NET, "peer %d requested too many cfilters/cfheaders: %d / %d\n",
+                 pfrom->GetId(), stop_height - start_height + 1, max_height_diff);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    filter_index = GetBlockFilterIndex(filter_type);
+    if (!filter_index) {
+        LogPrint(BCLog::NET, "Filter index for supported type %s not found\n", BlockFilterTypeName(filter_type));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Handle a getcfilters request. The filters of the whole range are read
+ * with one range lookup in the index and sent as cfilter messages.
+ */
+static void ProcessGetCFilters(CNode* pfrom, CDataStream& vRecv, const CChainParams& chainparams,
+                               CConnman* connman)
+{
+    uint8_t filter_type_ser;
+    uint32_t start_height;
+    uint256 stop_hash;
+
+    vRecv >> filter_type_ser >> start_height >> stop_hash;
+
+    const BlockFilterType filter_type = static_cast<BlockFilterType>(filter_type_ser);
+
+    const CBlockIndex* stop_index;
+    BlockFilterIndex* filter_index;
+    if (!PrepareBlockFilterRequest(pfrom, chainparams, filter_type, start_height, stop_hash,
+                                   MAX_GETCFILTERS_SIZE, stop_index, filter_index)) {
+        return;
+    }
+
+    std::vector<BlockFilter> filters;
+    if (!filter_index->LookupFilterRange(start_height, stop_index, filters)) {
+        LogPrint(BCLog::NET, "Failed to find block filter in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(filter_type), start_height, stop_hash.ToString());
+        return;
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    for (const auto& filter : filters) {
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFILTER, filter));
+    }
+}
+
+/**
+ * Handle a getcfheaders request: the filter header preceding the range,
+ * followed by the filter hashes of the range.
+ */
+static void ProcessGetCFHeaders(CNode* pfrom, CDataStream& vRecv, const CChainParams& chainparams,
+                                CConnman* connman)
+{
+    uint8_t filter_type_ser;
+    uint32_t start_height;
+    uint256 stop_hash;
+
+    vRecv >> filter_type_ser >> start_height >> stop_hash;
+
+    const BlockFilterType filter_type = static_cast<BlockFilterType>(filter_type_ser);
+
+    const CBlockIndex* stop_index;
+    BlockFilterIndex* filter_index;
+    if (!PrepareBlockFilterRequest(pfrom, chainparams, filter_type, start_height, stop_hash,
+                                   MAX_GETCFHEADERS_SIZE, stop_index, filter_index)) {
+        return;
+    }
+
+    uint256 prev_header;
+    if (start_height > 0) {
+        const CBlockIndex* const prev_block =
+            stop_index->GetAncestor(static_cast<int>(start_height - 1));
+        if (!filter_index->LookupFilterHeader(prev_block, prev_header)) {
+            LogPrint(BCLog::NET, "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(filter_type), prev_block->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    std::vector<uint256> filter_hashes;
+    if (!filter_index->LookupFilterHashRange(start_height, stop_index, filter_hashes)) {
+        LogPrint(BCLog::NET, "Failed to find block filter hashes in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(filter_type), start_height, stop_hash.ToString());
+        return;
+    }
+
+    connman->PushMessage(pfrom, CNetMsgMaker(pfrom->GetSendVersion()).Make(NetMsgType::CFHEADERS,
+                                                                          filter_type_ser,
+                                                                          stop_index->GetBlockHash(),
+                                                                          prev_header,
+                                                                          filter_hashes));
+}
+
+/**
+ * Handle a getcfcheckpt request: the filter headers at every
+ * CFCHECKPT_INTERVAL blocks up to the stop block, which BlockFilterIndex
+ * keeps cached in memory.
+ */
+static void ProcessGetCFCheckPt(CNode* pfrom, CDataStream& vRecv, const CChainParams& chainparams,
+                                CConnman* connman)
+{
+    uint8_t filter_type_ser;
+    uint256 stop_hash;
+
+    vRecv >> filter_type_ser >> stop_hash;
+
+    const BlockFilterType filter_type = static_cast<BlockFilterType>(filter_type_ser);
+
+    const CBlockIndex* stop_index;
+    BlockFilterIndex* filter_index;
+    if (!PrepareBlockFilterRequest(pfrom, chainparams, filter_type, /*start_height=*/0, stop_hash,
+                                   /*max_height_diff=*/std::numeric_limits<uint32_t>::max(),
+                                   stop_index, filter_index)) {
+        return;
+    }
+
+    std::vector<uint256> headers(stop_index->nHeight / CFCHECKPT_INTERVAL);
+
+    // Populate headers.
+    const CBlockIndex* block_index = stop_index;
+    for (int i = headers.size() - 1; i >= 0; i--) {
+        int height = (i + 1) * CFCHECKPT_INTERVAL;
+        block_index = block_index->GetAncestor(height);
+
+        if (!filter_index->LookupFilterHeader(block_index, headers[i])) {
+            LogPrint(BCLog::NET, "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(filter_type), block_index->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    connman->PushMessage(pfrom, CNetMsgMaker(pfrom->GetSendVersion()).Make(NetMsgType::CFCHECKPT,
+                                                                          filter_type_ser,
+                                                                          stop_index->GetBlockHash(),
+                                                                          headers));
 }
 
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc, bool enable_bip61)
@@ -2180,6 +2495,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         LOCK(cs_main);
 
         uint32_t nFetchFlags = GetFetchFlags(pfrom);
+        const int64_t nNow = GetTimeMicros();
 
         for (CInv &inv : vInv)
         {
@@ -2211,7 +2527,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 if (fBlocksOnly) {
                     LogPrint(BCLog::NET, "transaction (%s) inv sent in violation of protocol peer=%d\n", inv.hash.ToString(), pfrom->GetId());
                 } else if (!fAlreadyHave && !fImporting && !fReindex && !IsInitialBlockDownload()) {
-                    pfrom->AskFor(inv);
+                    RequestTx(pfrom, inv.hash, nNow);
                 }
             }
         }
@@ -2449,23 +2765,18 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         bool fMissingInputs = false;
         CValidationState state;
 
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv.hash);
+        g_txrequest.ReceivedResponse(pfrom->GetId(), inv.hash);
 
         std::list<CTransactionRef> lRemovedTxn;
 
         if (!AlreadyHave(inv) &&
             AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
             mempool.check(pcoinsTip.get());
+            g_txrequest.ForgetTxHash(inv.hash);
             RelayTransaction(tx, connman);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(inv.hash, i));
-                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
-                    for (const auto& elem : it_by_prev->second) {
-                        pfrom->orphan_work_set.insert(elem->first);
-                    }
-                }
-            }
+            // Orphans that depended on this one are reconsidered from
+            // ProcessMessages, a bounded batch per message handler iteration.
+            g_orphanage.AddChildrenToWorkSet(tx);
 
             pfrom->nLastTXTime = GetTime();
 
@@ -2473,75 +2784,6 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 pfrom->GetId(),
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
-
-            // Recursively process any orphan transactions that depended on this one
-<<<<<<< HEAD
-<<<<<<< HEAD
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
-                    const CTransaction& orphanTx = *porphanTx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
-                        LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee
-                        LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for witness transactions or
-                            // witness-stripped transactions, as they can have been malleated.
-                            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip.get());
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
-=======
-            ProcessOrphanTx(connman, pfrom->orphan_work_set, lRemovedTxn);
->>>>>>> upstream/0.18
-=======
-            ProcessOrphanTx(connman, pfrom->orphan_work_set, lRemovedTxn);
->>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
         }
         else if (fMissingInputs)
         {
@@ -2554,16 +2796,20 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             }
             if (!fRejectedParents) {
                 uint32_t nFetchFlags = GetFetchFlags(pfrom);
+                int64_t nNow = GetTimeMicros();
                 for (const CTxIn& txin : tx.vin) {
                     CInv _inv(MSG_TX | nFetchFlags, txin.prevout.hash);
                     pfrom->AddInventoryKnown(_inv);
-                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
+                    if (!AlreadyHave(_inv)) RequestTx(pfrom, _inv.hash, nNow);
+                }
+                if (g_orphanage.AddTx(ptx, pfrom->GetId())) {
+                    AddToCompactExtraTransactions(ptx);
                 }
-                AddOrphanTx(ptx, pfrom->GetId());
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                // DoS prevention: do not allow the orphan pool to grow unbounded
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, gArgs.GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                int64_t nMaxOrphanWeight = std::max((int64_t)0, gArgs.GetArg("-maxorphanweight", DEFAULT_MAX_ORPHAN_WEIGHT));
+                unsigned int nEvicted = g_orphanage.LimitOrphans(nMaxOrphanTx, nMaxOrphanWeight);
                 if (nEvicted > 0) {
                     LogPrint(BCLog::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
                 }
@@ -2746,7 +2992,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         // We want to be a bit conservative just to be extra careful about DoS
         // possibilities in compact block processing...
         if (pindex->nHeight <= ::ChainActive().Height() + 2) {
-            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < nodestate->m_max_blocks_in_flight) ||
                  (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
                 std::list<QueuedBlock>::iterator* queuedBlockIt = nullptr;
                 if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex, &queuedBlockIt)) {
@@ -2981,6 +3227,32 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        bool fSegment = false;
+        {
+            LOCK(cs_main);
+            uint256 locator_hash, stop_hash;
+            HeadersSyncSegments::Result result = g_headers_sync.AddHeaders(pfrom->GetId(), headers, chainparams.GetConsensus(), locator_hash, stop_hash);
+            if (result == HeadersSyncSegments::Result::INVALID) {
+                Misbehaving(pfrom->GetId(), 20, "invalid headers segment");
+                return false;
+            }
+            if (result == HeadersSyncSegments::Result::BUFFERED) {
+                fSegment = true;
+                if (!locator_hash.IsNull()) {
+                    LogPrint(BCLog::NET, "more segment getheaders (%s) to peer=%d\n", locator_hash.ToString(), pfrom->GetId());
+                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, CBlockLocator(std::vector<uint256>{locator_hash}), stop_hash));
+                }
+            } else if (g_headers_sync.IsLateAnswer(pfrom->GetId(), headers) && !LookupBlockIndex(headers[0].hashPrevBlock)) {
+                // A late answer to a segment request that was given to another peer.
+                LogPrint(BCLog::NET, "ignoring unconnecting headers from peer=%d after headers segment timeout\n", pfrom->GetId());
+                return true;
+            }
+        }
+
+        if (fSegment) {
+            ProcessHeadersSegments(chainparams);
+            return true;
+        }
         return ProcessHeadersMessage(pfrom, connman, headers, chainparams, /*via_compact_block=*/false);
     }
 
@@ -2997,6 +3269,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
 
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        const size_t nBlockSize = vRecv.size();
         vRecv >> *pblock;
 
         LogPrint(BCLog::NET, "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->GetId());
@@ -3005,6 +3278,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         const uint256 hash(pblock->GetHash());
         {
             LOCK(cs_main);
+            RecordBlockDownload(pfrom->GetId(), hash, nBlockSize);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
             forceProcessing |= MarkBlockAsReceived(hash);
@@ -3043,7 +3317,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman->GetAddresses();
         FastRandomContext insecure_rand;
 <<<<<<< HEAD
@@ -3230,9 +3507,31 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
     }
 
+    else if (strCommand == NetMsgType::GETCFILTERS) {
+        ProcessGetCFilters(pfrom, vRecv, chainparams, connman);
+    }
+
+    else if (strCommand == NetMsgType::GETCFHEADERS) {
+        ProcessGetCFHeaders(pfrom, vRecv, chainparams, connman);
+    }
+
+    else if (strCommand == NetMsgType::GETCFCHECKPT) {
+        ProcessGetCFCheckPt(pfrom, vRecv, chainparams, connman);
+    }
+
     else if (strCommand == NetMsgType::NOTFOUND) {
-        // We do not care about the NOTFOUND message, but logging an Unknown Command
-        // message would be undesirable as we transmit it ourselves.
+        // Let transactions the peer doesn't have be requested from other announcers
+        // without waiting for the request to time out.
+        std::vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() <= MAX_INV_SZ) {
+            LOCK(cs_main);
+            for (const CInv& inv : vInv) {
+                if (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) {
+                    g_txrequest.ReceivedResponse(pfrom->GetId(), inv.hash);
+                }
+            }
+        }
     }
 
     else {
@@ -3293,10 +3592,15 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams, connman, interruptMsgProc);
 
-    if (!pfrom->orphan_work_set.empty()) {
+    bool fMoreOrphanWork;
+    {
+        LOCK(g_cs_orphans);
+        fMoreOrphanWork = g_orphanage.HaveTxToReconsider(pfrom->GetId());
+    }
+    if (fMoreOrphanWork) {
         std::list<CTransactionRef> removed_txn;
         LOCK2(cs_main, g_cs_orphans);
-        ProcessOrphanTx(connman, pfrom->orphan_work_set, removed_txn);
+        fMoreOrphanWork = ProcessOrphanTx(connman, pfrom->GetId(), removed_txn);
         for (const CTransactionRef& removedTx : removed_txn) {
             AddToCompactExtraTransactions(removedTx);
         }
@@ -3307,7 +3611,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return true;
-    if (!pfrom->orphan_work_set.empty()) return true;
+    if (fMoreOrphanWork) return true;
 
     // Don't bother if send buffer is too full to respond anyway
     if (pfrom->fPauseSend)
@@ -3360,6 +3664,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
 
     // Process message
     bool fRet = false;
+    const int64_t nProcessStart = GetTimeMicros();
     try
     {
         fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc, m_enable_bip61);
@@ -3401,6 +3706,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (!fRet) {
         LogPrint(BCLog::NET, "%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->GetId());
     }
+    connman->RecordMessageProcessed(pfrom, strCommand, GetTimeMicros() - nProcessStart);
 
     LOCK(cs_main);
     SendRejectsAndCheckIfBanned(pfrom, connman, m_enable_bip61);
@@ -3542,25 +3848,6 @@ void PeerLogicValidation::CheckForStaleTipAndEvictPeers(const Consensus::Params
     }
 }
 
-namespace {
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    explicit CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-}
-
 bool PeerLogicValidation::SendMessages(CNode* pto)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -3601,9 +3888,10 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
             }
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
-            return true;
+        // Acquire cs_main for IsInitialBlockDownload() and CNodeState(). With
+        // several message handler workers, cs_main is often held by another
+        // worker; a peer skipped here would wait for its next wake-up.
+        LOCK(cs_main);
 
         if (SendRejectsAndCheckIfBanned(pto, connman, m_enable_bip61))
             return true;
@@ -3621,6 +3909,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -3670,6 +3959,20 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
             }
         }
 
+        // While the sync peer fetches headers up to the first anchor, fetch
+        // the ranges between later anchors from other peers.
+        if (!state.fSyncStarted && !pto->fClient && !fImporting && !fReindex && pindexBestHeader->GetBlockTime() <= GetAdjustedTime() - 24 * 60 * 60) {
+            if (!g_headers_sync.IsStarted()) {
+                size_t segments = g_headers_sync.Start(pindexBestHeader->nHeight);
+                LogPrint(BCLog::NET, "parallel headers sync with %u segments above (%d)\n", segments, pindexBestHeader->nHeight);
+            }
+            uint256 locator_hash, stop_hash;
+            if (g_headers_sync.Assign(pto->GetId(), pto->nStartingHeight, locator_hash, stop_hash)) {
+                LogPrint(BCLog::NET, "segment getheaders (%s) to (%s) to peer=%d (startheight:%d)\n", locator_hash.ToString(), stop_hash.ToString(), pto->GetId(), pto->nStartingHeight);
+                connman->PushMessage(pto, msgMaker.Make(NetMsgType::GETHEADERS, CBlockLocator(std::vector<uint256>{locator_hash}), stop_hash));
+            }
+        }
+
         //
         // Try sending block announcements via headers
         //
@@ -3842,7 +4145,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) g_tx_announce_queue.SkipToEnd(pto->GetId());
             }
 
             // Respond to BIP35 mempool requests
@@ -3860,7 +4163,6 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                 for (const auto& txinfo : vtxinfo) {
                     const uint256& hash = txinfo.tx->GetHash();
                     CInv inv(MSG_TX, hash);
-                    pto->setInventoryTxToSend.erase(hash);
                     if (filterrate) {
                         if (txinfo.feeRate.GetFeePerK() < filterrate)
                             continue;
@@ -3880,67 +4182,63 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
+                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
+                // Transactions relayed since the last trickle of any peer are sorted once here, and
+                // every peer then walks the shared announcement log from its own cursor.
+                g_tx_announce_queue.Seal([](std::vector<uint256>& txids) { mempool.SortByDepthAndScore(txids); });
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
-                    // Check if not in the filter already
-                    if (pto->filterInventoryKnown.contains(hash)) {
-                        continue;
-                    }
-                    // Not in the mempool anymore? don't bother sending it.
-                    auto txinfo = mempool.info(hash);
-                    if (!txinfo.tx) {
-                        continue;
-                    }
-                    if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
-                        continue;
-                    }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
-                    // Send
-                    vInv.push_back(CInv(MSG_TX, hash));
-                    nRelayedTransactions++;
-                    {
-                        // Expire old relay messages
-                        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
-                        {
-                            mapRelay.erase(vRelayExpiration.front().second);
-                            vRelayExpiration.pop_front();
+                std::vector<uint256> vTxToAnnounce;
+                while (nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                    uint64_t nCursor = g_tx_announce_queue.Get(pto->GetId(), 4 * INVENTORY_BROADCAST_MAX, vTxToAnnounce);
+                    if (vTxToAnnounce.empty()) break;
+                    size_t nConsumed = 0;
+                    for (const uint256& hash : vTxToAnnounce) {
+                        if (nRelayedTransactions >= INVENTORY_BROADCAST_MAX) break;
+                        ++nConsumed;
+                        // Check if not in the filter already
+                        if (pto->filterInventoryKnown.contains(hash)) {
+                            continue;
+                        }
+                        // Not in the mempool anymore? don't bother sending it.
+                        auto txinfo = mempool.info(hash);
+                        if (!txinfo.tx) {
+                            continue;
                         }
+                        if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
+                            continue;
+                        }
+                        if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(GetRelayTxElements(txinfo.tx))) continue;
+                        // Send
+                        vInv.push_back(CInv(MSG_TX, hash));
+                        nRelayedTransactions++;
+                        {
+                            // Expire old relay messages
+                            while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
+                            {
+                                mapRelay.erase(vRelayExpiration.front().second);
+                                vRelayExpiration.pop_front();
+                            }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
-                        if (ret.second) {
-                            vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
+                            auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                            if (ret.second) {
+                                vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
+                            }
                         }
+                        if (vInv.size() == MAX_INV_SZ) {
+                            connman->PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
+                            vInv.clear();
+                        }
+                        pto->filterInventoryKnown.insert(hash);
                     }
-                    if (vInv.size() == MAX_INV_SZ) {
-                        connman->PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
-                        vInv.clear();
-                    }
-                    pto->filterInventoryKnown.insert(hash);
+                    g_tx_announce_queue.SetCursor(pto->GetId(), nCursor + nConsumed);
                 }
             }
         }
@@ -4012,10 +4310,11 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.m_max_blocks_in_flight) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexWaitingFor = nullptr;
+            FindNextBlocksToDownload(pto->GetId(), state.m_max_blocks_in_flight - state.nBlocksInFlight, vToDownload, staller, pindexWaitingFor, consensusParams);
             for (const CBlockIndex *pindex : vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -4023,6 +4322,19 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                 LogPrint(BCLog::NET, "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->GetId());
             }
+            // Nothing new to fetch from this peer: if the lowest block we are
+            // waiting for is straggling at a slower peer, take it over before it
+            // holds up the download window.
+            if (vToDownload.empty() && pindexWaitingFor && IsStragglingBlock(pto->GetId(), pindexWaitingFor, GetMockableTimeMicros())) {
+                const uint256& hash = pindexWaitingFor->GetBlockHash();
+                NodeId holder = mapBlocksInFlight[hash].first;
+                State(holder)->m_blocks_rerequested++;
+                uint32_t nFetchFlags = GetFetchFlags(pto);
+                vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, hash));
+                MarkBlockAsInFlight(pto->GetId(), hash, pindexWaitingFor);
+                LogPrint(BCLog::NET, "Re-requesting straggling block %s (%d) peer=%d, was in flight from peer=%d\n", hash.ToString(),
+                    pindexWaitingFor->nHeight, pto->GetId(), holder);
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -4034,23 +4346,22 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
-        {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(inv))
-            {
+        uint32_t nTxFetchFlags = GetFetchFlags(pto);
+        for (const uint256& txhash : g_txrequest.GetRequestable(pto->GetId(), nNow)) {
+            const CInv inv(MSG_TX | nTxFetchFlags, txhash);
+            if (!AlreadyHave(inv)) {
                 LogPrint(BCLog::NET, "Requesting %s peer=%d\n", inv.ToString(), pto->GetId());
                 vGetData.push_back(inv);
+                g_txrequest.RequestedTx(pto->GetId(), txhash, nNow + TX_REQUEST_TIMEOUT);
                 if (vGetData.size() >= 1000)
                 {
                     connman->PushMessage(pto, msgMaker.Make(NetMsgType::GETDATA, vGetData));
                     vGetData.clear();
                 }
             } else {
-                //If we're not going to ask, don't expect a response.
-                pto->setAskFor.erase(inv.hash);
+                // We already have it (or rejected it); no announcer needs to be asked.
+                g_txrequest.ForgetTxHash(txhash);
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
         if (!vGetData.empty())
             connman->PushMessage(pto, msgMaker.Make(NetMsgType::GETDATA, vGetData));
@@ -4085,14 +4396,3 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
     }
     return true;
 }
-
-class CNetProcessingCleanup
-{
-public:
-    CNetProcessingCleanup() {}
-    ~CNetProcessingCleanup() {
-        // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
-    }
-} instance_of_cnetprocessingcleanup;
@@ -12,8 +12,14 @@
 
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphanweight, maximum total weight of orphan transactions kept in memory */
+static const int64_t DEFAULT_MAX_ORPHAN_WEIGHT = 4000000;
+/** Maximum number of orphans a peer's work set offers to the mempool per message handler iteration */
+static constexpr size_t MAX_ORPHAN_RECONSIDER_BATCH = 50;
 /** Default number of orphan+recently-replaced txn to keep around for block reconstruction */
 static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
+/** Default for -peerblockfilters, serving BIP 157 compact block filters to peers */
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 /** Default for BIP61 (sending reject messages) */
 <<<<<<< HEAD
 static constexpr bool DEFAULT_ENABLE_BIP61 = true;
@@ -83,6 +89,12 @@ struct CNodeStateStats {
     int nSyncHeight = -1;
     int nCommonHeight = -1;
     std::vector<int> vHeightInFlight;
+    int nMaxBlocksInFlight = 0;
+    int64_t nBlockServiceTime = 0;
+    int64_t nBlockLatency = 0;
+    uint64_t nBlocksDownloaded = 0;
+    uint64_t nBlockBytesDownloaded = 0;
+    uint64_t nBlocksReRequested = 0;
 };
 
 /** Get statistics from node state */
@@ -0,0 +1,87 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/blockcache.h>
+
+#include <chain.h>
+#include <chainparams.h>
+#include <net.h>
+#include <protocol.h>
+#include <validation.h>
+
+std::unique_ptr<BlockMsgCache> g_block_msg_cache;
+
+static size_t MsgSize(const CSharedNetMsg& msg)
+{
+    return msg.header->size() + msg.data->size();
+}
+
+BlockMsgCache::BlockMsgCache(size_t max_bytes) : m_max_bytes(max_bytes), m_bytes(0), m_hits(0), m_misses(0) {}
+
+std::shared_ptr<const CSharedNetMsg> BlockMsgCache::Get(const uint256& hash, bool witness)
+{
+    LOCK(m_cs);
+    auto it = m_index.find(Key(hash, witness));
+    if (it == m_index.end()) {
+        ++m_misses;
+        return nullptr;
+    }
+    ++m_hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+}
+
+void BlockMsgCache::Insert(const uint256& hash, bool witness, std::shared_ptr<const CSharedNetMsg> msg)
+{
+    size_t size = MsgSize(*msg);
+    if (size > m_max_bytes) return;
+
+    LOCK(m_cs);
+    Key key(hash, witness);
+    if (m_index.count(key)) return;
+
+    while (!m_lru.empty() && m_bytes + size > m_max_bytes) {
+        m_bytes -= MsgSize(*m_lru.back().second);
+        m_index.erase(m_lru.back().first);
+        m_lru.pop_back();
+    }
+    m_lru.emplace_front(key, std::move(msg));
+    m_index.emplace(key, m_lru.begin());
+    m_bytes += size;
+}
+
+BlockMsgCache::Stats BlockMsgCache::GetStats() const
+{
+    LOCK(m_cs);
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.entries = m_lru.size();
+    stats.bytes = m_bytes;
+    stats.max_bytes = m_max_bytes;
+    return stats;
+}
+
+std::shared_ptr<const CSharedNetMsg> GetBlockMsg(const CBlockIndex* pindex, bool witness, const CChainParams& chainparams)
+{
+    const uint256 hash = pindex->GetBlockHash();
+    if (g_block_msg_cache) {
+        std::shared_ptr<const CSharedNetMsg> msg = g_block_msg_cache->Get(hash, witness);
+        if (msg) return msg;
+    }
+
+    // The network format matches the format on disk, less the witnesses if
+    // those aren't wanted, so the block never needs to be deserialized.
+    CSerializedNetMsg raw;
+    raw.command = NetMsgType::BLOCK;
+    if (!ReadRawBlockFromDisk(raw.data, pindex, chainparams.MessageStart(), witness)) {
+        return nullptr;
+    }
+    std::shared_ptr<const CSharedNetMsg> msg = std::make_shared<const CSharedNetMsg>(std::move(raw));
+
+    if (g_block_msg_cache) {
+        g_block_msg_cache->Insert(hash, witness, msg);
+    }
+    return msg;
+}
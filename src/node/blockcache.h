@@ -0,0 +1,72 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NODE_BLOCKCACHE_H
+#define BITCOIN_NODE_BLOCKCACHE_H
+
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <utility>
+
+class CBlockIndex;
+class CChainParams;
+struct CSharedNetMsg;
+
+/** Default for -blockservecache, in MiB */
+static const int64_t DEFAULT_BLOCK_SERVE_CACHE = 32;
+
+/**
+ * LRU cache of serialized "block" messages, keyed by block hash and witness
+ * mode, so that blocks requested by many peers (e.g. during their IBD) are
+ * read from disk and serialized once.
+ */
+class BlockMsgCache
+{
+public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        size_t entries;
+        size_t bytes;
+        size_t max_bytes;
+    };
+
+    explicit BlockMsgCache(size_t max_bytes);
+
+    /** Return the cached message, or nullptr, and mark it most recently used. */
+    std::shared_ptr<const CSharedNetMsg> Get(const uint256& hash, bool witness);
+    /** Add a message, evicting least recently used ones to stay within the size limit. */
+    void Insert(const uint256& hash, bool witness, std::shared_ptr<const CSharedNetMsg> msg);
+
+    Stats GetStats() const;
+
+private:
+    typedef std::pair<uint256, bool> Key;
+    typedef std::list<std::pair<Key, std::shared_ptr<const CSharedNetMsg>>> LruList;
+
+    mutable CCriticalSection m_cs;
+    const size_t m_max_bytes;
+    size_t m_bytes GUARDED_BY(m_cs);
+    LruList m_lru GUARDED_BY(m_cs);
+    std::map<Key, LruList::iterator> m_index GUARDED_BY(m_cs);
+    uint64_t m_hits GUARDED_BY(m_cs);
+    uint64_t m_misses GUARDED_BY(m_cs);
+};
+
+/** Cache used for getdata block serving; null when -blockservecache=0. */
+extern std::unique_ptr<BlockMsgCache> g_block_msg_cache;
+
+/**
+ * Return the "block" message for pindex in the requested witness mode,
+ * served from g_block_msg_cache when possible and read from disk otherwise.
+ * Returns nullptr if the block can't be read.
+ */
+std::shared_ptr<const CSharedNetMsg> GetBlockMsg(const CBlockIndex* pindex, bool witness, const CChainParams& chainparams);
+
+#endif // BITCOIN_NODE_BLOCKCACHE_H
@@ -0,0 +1,187 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/headerssync.h>
+
+#include <logging.h>
+#include <pow.h>
+#include <utilstrencodings.h>
+#include <utiltime.h>
+
+#include <assert.h>
+#include <iterator>
+
+bool ParseHeadersAnchor(const std::string& str, int& height, uint256& hash)
+{
+    size_t colon = str.find(':');
+    if (colon == std::string::npos) return false;
+    const std::string hex = str.substr(colon + 1);
+    if (!ParseInt32(str.substr(0, colon), &height) || height < 0) return false;
+    if (hex.size() != 64 || !IsHex(hex)) return false;
+    hash = uint256S(hex);
+    return true;
+}
+
+void HeadersSyncSegments::AddAnchor(int height, const uint256& hash)
+{
+    assert(!m_started);
+    m_anchors[height] = hash;
+}
+
+size_t HeadersSyncSegments::Start(int best_height)
+{
+    if (m_started) return m_segments.size();
+    m_started = true;
+
+    auto it = m_anchors.upper_bound(best_height);
+    if (it == m_anchors.end()) return 0;
+    for (auto next = std::next(it); next != m_anchors.end(); it = next++) {
+        Segment& segment = m_segments[next->first];
+        segment.start_height = it->first;
+        segment.start_hash = it->second;
+        segment.end_height = next->first;
+        segment.end_hash = next->second;
+        segment.last_hash = it->second;
+    }
+    return m_segments.size();
+}
+
+void HeadersSyncSegments::Release(Segment& segment)
+{
+    if (segment.peer == -1) return;
+    m_peer_segment.erase(segment.peer);
+    segment.peer = -1;
+}
+
+void HeadersSyncSegments::Fail(NodeId peer, Segment& segment)
+{
+    m_failed_peers[peer] = FailedRequest{segment.last_hash, GetTime()};
+    Release(segment);
+}
+
+bool HeadersSyncSegments::Assign(NodeId peer, int peer_height, uint256& locator_hash, uint256& stop_hash)
+{
+    if (m_peer_segment.count(peer) || m_failed_peers.count(peer)) return false;
+
+    const int64_t now = GetTime();
+    for (auto& entry : m_segments) {
+        Segment& segment = entry.second;
+        if (segment.peer != -1) {
+            if (segment.request_time + HEADERS_SEGMENT_TIMEOUT > now) continue;
+            LogPrint(BCLog::NET, "headers segment (%d) to (%d) timed out, peer=%d\n", segment.start_height, segment.end_height, segment.peer);
+            Fail(segment.peer, segment);
+        }
+        if (segment.Complete() || segment.end_height > peer_height) continue;
+        // Don't fetch further ahead than we're willing to buffer.
+        if (m_buffered >= MAX_HEADERS_SEGMENT_BUFFER) return false;
+
+        segment.peer = peer;
+        segment.request_time = now;
+        m_peer_segment[peer] = entry.first;
+        locator_hash = segment.last_hash;
+        stop_hash = segment.end_hash;
+        return true;
+    }
+    return false;
+}
+
+HeadersSyncSegments::Result HeadersSyncSegments::AddHeaders(NodeId peer, const std::vector<CBlockHeader>& headers, const Consensus::Params& consensus_params, uint256& locator_hash, uint256& stop_hash)
+{
+    locator_hash.SetNull();
+    auto peer_it = m_peer_segment.find(peer);
+    if (peer_it == m_peer_segment.end()) return Result::NOT_SEGMENT;
+    Segment& segment = m_segments.at(peer_it->second);
+
+    if (headers.empty()) {
+        // The peer doesn't have the segment.
+        Fail(peer, segment);
+        return Result::NOT_SEGMENT;
+    }
+    if (headers[0].hashPrevBlock != segment.last_hash) return Result::NOT_SEGMENT;
+
+    uint256 hash = segment.last_hash;
+    size_t count = 0;
+    for (const CBlockHeader& header : headers) {
+        if (header.hashPrevBlock != hash) {
+            Fail(peer, segment);
+            return Result::INVALID;
+        }
+        hash = header.GetHash();
+        // Buffered headers are only validated later, so they could otherwise
+        // be made up for free.
+        if (!CheckProofOfWork(hash, header.nBits, consensus_params)) {
+            Fail(peer, segment);
+            return Result::INVALID;
+        }
+        ++count;
+        // Anything past the end anchor is left to the next segment.
+        if (hash == segment.end_hash) break;
+    }
+    segment.headers.insert(segment.headers.end(), headers.begin(), headers.begin() + count);
+    segment.last_hash = hash;
+    segment.from_peer = peer;
+    segment.request_time = GetTime();
+    m_buffered += count;
+
+    if (segment.Complete()) {
+        LogPrint(BCLog::NET, "headers segment (%d) to (%d) downloaded, peer=%d\n", segment.start_height, segment.end_height, peer);
+        Release(segment);
+    } else if (m_buffered >= MAX_HEADERS_SEGMENT_BUFFER) {
+        // Resumed, possibly by another peer, once buffered headers are validated.
+        Release(segment);
+    } else {
+        locator_hash = segment.last_hash;
+        stop_hash = segment.end_hash;
+    }
+    return Result::BUFFERED;
+}
+
+bool HeadersSyncSegments::IsLateAnswer(NodeId peer, const std::vector<CBlockHeader>& headers) const
+{
+    auto it = m_failed_peers.find(peer);
+    if (it == m_failed_peers.end() || headers.empty()) return false;
+    return headers[0].hashPrevBlock == it->second.locator_hash && GetTime() < it->second.time + HEADERS_SEGMENT_TIMEOUT;
+}
+
+bool HeadersSyncSegments::PopReady(const std::function<bool(const uint256&)>& have_header, std::vector<CBlockHeader>& headers, NodeId& peer)
+{
+    for (auto it = m_segments.begin(); it != m_segments.end();) {
+        Segment& segment = it->second;
+        if (have_header(segment.end_hash)) {
+            // The headers chain got past this segment without it.
+            m_buffered -= segment.headers.size();
+            Release(segment);
+            it = m_segments.erase(it);
+            continue;
+        }
+        if (!segment.headers.empty() && have_header(segment.start_hash)) {
+            headers.clear();
+            headers.swap(segment.headers);
+            m_buffered -= headers.size();
+            peer = segment.from_peer;
+            segment.start_height += headers.size();
+            segment.start_hash = segment.last_hash;
+            if (segment.Complete()) m_segments.erase(it);
+            return true;
+        }
+        ++it;
+    }
+    return false;
+}
+
+void HeadersSyncSegments::DisconnectedPeer(NodeId peer)
+{
+    auto peer_it = m_peer_segment.find(peer);
+    if (peer_it != m_peer_segment.end()) {
+        Release(m_segments.at(peer_it->second));
+    }
+    m_failed_peers.erase(peer);
+}
+
+void HeadersSyncSegments::Clear()
+{
+    m_segments.clear();
+    m_peer_segment.clear();
+    m_buffered = 0;
+}
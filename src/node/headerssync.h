@@ -0,0 +1,152 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NODE_HEADERSSYNC_H
+#define BITCOIN_NODE_HEADERSSYNC_H
+
+#include <consensus/params.h>
+#include <net.h>
+#include <primitives/block.h>
+#include <uint256.h>
+
+#include <functional>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Time in seconds a peer has to answer a getheaders for its segment before the
+ * segment is handed to another peer, and for which a late answer is then ignored
+ */
+static constexpr int64_t HEADERS_SEGMENT_TIMEOUT = 2 * 60;
+/** Maximum number of headers buffered ahead of the validated headers chain */
+static constexpr size_t MAX_HEADERS_SEGMENT_BUFFER = 200000;
+
+/** Parse a -headersanchor value of the form <height>:<hash>. */
+bool ParseHeadersAnchor(const std::string& str, int& height, uint256& hash);
+
+/**
+ * Header ranges fetched from several peers at once during initial sync.
+ *
+ * Normally headers are requested from a single sync peer, 2000 at a time,
+ * each request waiting for the previous answer. When the hashes of blocks at
+ * later heights are known in advance (checkpoints, or -headersanchor hints),
+ * the ranges between consecutive anchors (segments) can be downloaded from
+ * other peers in the meantime: a segment is requested with a getheaders whose
+ * locator is the start anchor and whose stop hash is the end anchor.
+ *
+ * Headers received for a segment are buffered until the validated headers
+ * chain reaches its start, and are then validated in order like any other
+ * headers. Anchors only steer the download; nothing is trusted because of
+ * them. The range below the first anchor and above the last one is left to
+ * the sync peer.
+ *
+ * Not thread-safe; callers provide locking.
+ */
+class HeadersSyncSegments
+{
+public:
+    enum class Result {
+        NOT_SEGMENT, //!< not an answer to a segment request; process normally
+        BUFFERED,    //!< headers were taken for the peer's segment
+        INVALID,     //!< headers continue the peer's segment but are not a chain or lack proof of work
+    };
+
+    /** Add a block hash known to be in the best chain at height. Must be called before Start. */
+    void AddAnchor(int height, const uint256& hash);
+
+    /**
+     * Create the segments between consecutive anchors above best_height.
+     * Only the first call has an effect. Returns the number of segments.
+     */
+    size_t Start(int best_height);
+    bool IsStarted() const { return m_started; }
+
+    /**
+     * Assign the lowest idle segment that peer_height covers to peer, unless
+     * the peer already has one or failed one before. Segments whose request
+     * timed out are taken from their peer first. On success, sets the locator
+     * and stop hash of the getheaders to send.
+     */
+    bool Assign(NodeId peer, int peer_height, uint256& locator_hash, uint256& stop_hash);
+
+    /**
+     * Offer a headers message received from peer. Headers are taken if they
+     * continue the peer's segment and each has the proof of work its nBits
+     * claims; the segment is released if the peer answered with nothing. When
+     * BUFFERED and the segment is not complete, locator_hash and stop_hash are
+     * set for the next getheaders (otherwise locator_hash is null).
+     */
+    Result AddHeaders(NodeId peer, const std::vector<CBlockHeader>& headers, const Consensus::Params& consensus_params, uint256& locator_hash, uint256& stop_hash);
+
+    /**
+     * Take the buffered headers of the lowest segment whose start is known
+     * (have_header returns true for it), in chain order, along with the peer
+     * that sent the last of them. Segments whose end is already known are
+     * dropped. Returns false if no headers are ready.
+     */
+    bool PopReady(const std::function<bool(const uint256&)>& have_header, std::vector<CBlockHeader>& headers, NodeId& peer);
+
+    /** Release the segment of a disconnected peer; its buffered headers are kept. */
+    void DisconnectedPeer(NodeId peer);
+
+    /** Drop all segments, leaving the rest of the sync to the sync peer. */
+    void Clear();
+
+    /** Number of segments left. */
+    size_t Size() const { return m_segments.size(); }
+    /** Number of headers buffered. */
+    size_t BufferedCount() const { return m_buffered; }
+    /** Whether peer is fetching a segment. */
+    bool HasSegment(NodeId peer) const { return m_peer_segment.count(peer) != 0; }
+    /** Whether peer timed out on, didn't have or sent invalid headers for a segment. */
+    bool HasFailed(NodeId peer) const { return m_failed_peers.count(peer) != 0; }
+    /**
+     * Whether headers from peer look like a late answer to the segment
+     * request it failed: they continue from that request's locator and
+     * arrive within HEADERS_SEGMENT_TIMEOUT of the failure.
+     */
+    bool IsLateAnswer(NodeId peer, const std::vector<CBlockHeader>& headers) const;
+
+private:
+    struct Segment {
+        int start_height;
+        uint256 start_hash;
+        int end_height;
+        uint256 end_hash;
+        /** Buffered headers, continuing from start_hash. */
+        std::vector<CBlockHeader> headers;
+        /** Hash of the last buffered header, or start_hash. */
+        uint256 last_hash;
+        /** Peer fetching the segment, -1 if none. */
+        NodeId peer{-1};
+        /** Peer that sent the last buffered header. */
+        NodeId from_peer{-1};
+        int64_t request_time{0};
+        bool Complete() const { return last_hash == end_hash; }
+    };
+
+    /** A segment request that peer failed. */
+    struct FailedRequest {
+        uint256 locator_hash;
+        int64_t time;
+    };
+
+    void Release(Segment& segment);
+    /** Release the segment of peer, and don't give it another. */
+    void Fail(NodeId peer, Segment& segment);
+
+    std::map<int, uint256> m_anchors;
+    /** Segments by end height. */
+    std::map<int, Segment> m_segments;
+    /** End height of the segment each peer is fetching. */
+    std::map<NodeId, int> m_peer_segment;
+    /** Peers that didn't deliver a segment; they aren't given another. */
+    std::map<NodeId, FailedRequest> m_failed_peers;
+    size_t m_buffered{0};
+    bool m_started{false};
+};
+
+#endif // BITCOIN_NODE_HEADERSSYNC_H
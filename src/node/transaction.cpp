@@ -69,10 +69,83 @@ TransactionError BroadcastTransaction(const CTransactionRef tx, uint256& hashTx,
         return TransactionError::P2P_DISABLED;
     }
 
-    CInv inv(MSG_TX, hashTx);
-    g_connman->ForEachNode([&inv](CNode* pnode) {
-        pnode->PushInventory(inv);
-    });
+    g_tx_announce_queue.Push(hashTx);
 
     return TransactionError::OK;
 }
+
+std::vector<TransactionError> BroadcastTransactions(const std::vector<CTransactionRef>& txs, std::vector<std::string>& err_strings, const std::vector<CAmount>& highfees)
+{
+    assert(highfees.size() == txs.size());
+    std::vector<TransactionError> errors(txs.size(), TransactionError::OK);
+    err_strings.assign(txs.size(), "");
+    std::promise<void> promise;
+
+    { // cs_main scope
+    LOCK(cs_main);
+    CCoinsViewCache &view = *pcoinsTip;
+    std::vector<size_t> submitted;
+    std::vector<CTransactionRef> submitted_txs;
+    std::vector<CAmount> submitted_highfees;
+    for (size_t i = 0; i < txs.size(); i++) {
+        const uint256& hashTx = txs[i]->GetHash();
+        bool fHaveChain = false;
+        for (size_t o = 0; !fHaveChain && o < txs[i]->vout.size(); o++) {
+            const Coin& existingCoin = view.AccessCoin(COutPoint(hashTx, o));
+            fHaveChain = !existingCoin.IsSpent();
+        }
+        if (fHaveChain) {
+            errors[i] = TransactionError::ALREADY_IN_CHAIN;
+        } else if (!mempool.exists(hashTx)) {
+            submitted.push_back(i);
+            submitted_txs.push_back(txs[i]);
+            submitted_highfees.push_back(highfees[i]);
+        }
+    }
+
+    // push to local node and sync with wallets
+    std::vector<CValidationState> states;
+    std::vector<bool> missing_inputs;
+    const std::vector<bool> accepted = AcceptToMemoryPoolBatch(mempool, states, submitted_txs, missing_inputs,
+                                                               nullptr /* plTxnReplaced */, false /* bypass_limits */, submitted_highfees);
+    bool any_accepted = false;
+    for (size_t j = 0; j < submitted.size(); j++) {
+        const size_t i = submitted[j];
+        if (accepted[j]) {
+            any_accepted = true;
+        } else if (states[j].IsInvalid()) {
+            err_strings[i] = FormatStateMessage(states[j]);
+            errors[i] = TransactionError::MEMPOOL_REJECTED;
+        } else if (missing_inputs[j]) {
+            errors[i] = TransactionError::MISSING_INPUTS;
+        } else {
+            err_strings[i] = FormatStateMessage(states[j]);
+            errors[i] = TransactionError::MEMPOOL_ERROR;
+        }
+    }
+
+    if (any_accepted) {
+        // See BroadcastTransaction: make sure wallets have seen the new
+        // transactions before returning.
+        CallFunctionInValidationInterfaceQueue([&promise] {
+            promise.set_value();
+        });
+    } else {
+        promise.set_value();
+    }
+
+    } // cs_main
+
+    promise.get_future().wait();
+
+    for (size_t i = 0; i < txs.size(); i++) {
+        if (errors[i] != TransactionError::OK) continue;
+        if (!g_connman) {
+            errors[i] = TransactionError::P2P_DISABLED;
+            continue;
+        }
+        g_tx_announce_queue.Push(txs[i]->GetHash());
+    }
+
+    return errors;
+}
@@ -10,6 +10,9 @@
 #include <uint256.h>
 #include <util/error.h>
 
+#include <string>
+#include <vector>
+
 /**
  * Broadcast a transaction
  *
@@ -21,4 +24,14 @@
  */
 NODISCARD TransactionError BroadcastTransaction(CTransactionRef tx, uint256& txid, std::string& err_string, const CAmount& highfee);
 
+/**
+ * Broadcast a batch of transactions, which may spend each other's outputs
+ *
+ * @param[in]  txs the transactions to broadcast
+ * @param[out] &err_strings reference to a vector filled with one error string per transaction, if available
+ * @param[in]  highfees Reject each tx with fees higher than the corresponding entry (if 0, accept any fee)
+ * return one error per transaction, in the order of txs
+ */
+std::vector<TransactionError> BroadcastTransactions(const std::vector<CTransactionRef>& txs, std::vector<std::string>& err_strings, const std::vector<CAmount>& highfees);
+
 #endif // BITCOIN_NODE_TRANSACTION_H
@@ -0,0 +1,230 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/txorphanage.h>
+
+#include <consensus/validation.h>
+#include <logging.h>
+#include <policy/policy.h>
+#include <primitives/block.h>
+#include <utiltime.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <deque>
+
+bool TxOrphanage::AddTx(const CTransactionRef& tx, NodeId peer)
+{
+    const uint256& hash = tx->GetHash();
+    if (m_orphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    // 100 orphans, each of which is at most 100,000 bytes big is
+    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
+    int64_t weight = GetTransactionWeight(*tx);
+    if (weight > MAX_STANDARD_TX_WEIGHT)
+    {
+        LogPrint(BCLog::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", weight, hash.ToString());
+        return false;
+    }
+
+    auto ret = m_orphans.emplace(hash, OrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, weight, m_sequence});
+    assert(ret.second);
+    PeerInfo& peerinfo = m_peers[peer];
+    peerinfo.orphans.emplace(m_sequence++, ret.first);
+    peerinfo.weight += weight;
+    m_total_weight += weight;
+    for (const CTxIn& txin : tx->vin) {
+        m_outpoint_to_orphan[txin.prevout].insert(ret.first);
+    }
+
+    LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (mapsz %u outsz %u peer=%d peerweight %d)\n", hash.ToString(),
+             m_orphans.size(), m_outpoint_to_orphan.size(), peer, peerinfo.weight);
+    return true;
+}
+
+bool TxOrphanage::HaveTx(const uint256& txid) const
+{
+    return m_orphans.count(txid) > 0;
+}
+
+int TxOrphanage::EraseTx(const uint256& txid)
+{
+    OrphanMap::iterator it = m_orphans.find(txid);
+    if (it == m_orphans.end())
+        return 0;
+    for (const CTxIn& txin : it->second.tx->vin)
+    {
+        auto itPrev = m_outpoint_to_orphan.find(txin.prevout);
+        if (itPrev == m_outpoint_to_orphan.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            m_outpoint_to_orphan.erase(itPrev);
+    }
+
+    auto peerit = m_peers.find(it->second.from_peer);
+    assert(peerit != m_peers.end());
+    PeerInfo& peerinfo = peerit->second;
+    peerinfo.orphans.erase(it->second.sequence);
+    peerinfo.work_set.erase(txid);
+    peerinfo.weight -= it->second.weight;
+    if (peerinfo.orphans.empty()) {
+        assert(peerinfo.weight == 0 && peerinfo.work_set.empty());
+        m_peers.erase(peerit);
+    }
+    m_total_weight -= it->second.weight;
+
+    m_orphans.erase(it);
+    return 1;
+}
+
+int TxOrphanage::EraseForPeer(NodeId peer)
+{
+    auto peerit = m_peers.find(peer);
+    if (peerit == m_peers.end())
+        return 0;
+    std::vector<uint256> to_erase;
+    for (const auto& entry : peerit->second.orphans) {
+        to_erase.push_back(entry.second->first);
+    }
+    int nErased = 0;
+    for (const uint256& hash : to_erase) {
+        nErased += EraseTx(hash);
+    }
+    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx from peer=%d\n", nErased, peer);
+    return nErased;
+}
+
+int TxOrphanage::EraseForBlock(const CBlock& block)
+{
+    std::vector<uint256> vOrphanErase;
+
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+
+        // Which orphan pool entries must we evict?
+        for (const auto& txin : tx.vin) {
+            auto itByPrev = m_outpoint_to_orphan.find(txin.prevout);
+            if (itByPrev == m_outpoint_to_orphan.end()) continue;
+            for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                vOrphanErase.push_back((*mi)->first);
+            }
+        }
+    }
+
+    // Erase orphan transactions included or precluded by this block
+    int nErased = 0;
+    for (const uint256& orphanHash : vOrphanErase) {
+        nErased += EraseTx(orphanHash);
+    }
+    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    return nErased;
+}
+
+unsigned int TxOrphanage::LimitOrphans(unsigned int max_orphans, int64_t max_weight)
+{
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (m_next_sweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        OrphanMap::iterator iter = m_orphans.begin();
+        while (iter != m_orphans.end())
+        {
+            OrphanMap::iterator maybeErase = iter++;
+            if (maybeErase->second.time_expire <= nNow) {
+                nErased += EraseTx(maybeErase->first);
+            } else {
+                nMinExpTime = std::min(maybeErase->second.time_expire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        m_next_sweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx due to expiration\n", nErased);
+    }
+    while (!m_orphans.empty() && (m_orphans.size() > max_orphans || m_total_weight > max_weight))
+    {
+        // Evict the oldest orphan of the peer using the most weight
+        auto heaviest = m_peers.begin();
+        for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
+            if (it->second.weight > heaviest->second.weight) heaviest = it;
+        }
+        assert(heaviest != m_peers.end());
+        EraseTx(heaviest->second.orphans.begin()->second->first);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+void TxOrphanage::AddChildrenToWorkSet(const CTransaction& tx)
+{
+    const uint256& hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        auto it_by_prev = m_outpoint_to_orphan.find(COutPoint(hash, i));
+        if (it_by_prev == m_outpoint_to_orphan.end()) continue;
+        for (const auto& elem : it_by_prev->second) {
+            m_peers[elem->second.from_peer].work_set.insert(elem->first);
+        }
+    }
+}
+
+bool TxOrphanage::HaveTxToReconsider(NodeId peer) const
+{
+    auto peerit = m_peers.find(peer);
+    return peerit != m_peers.end() && !peerit->second.work_set.empty();
+}
+
+std::vector<std::pair<CTransactionRef, NodeId>> TxOrphanage::GetTxsToReconsider(NodeId peer, size_t max_txs)
+{
+    std::vector<std::pair<CTransactionRef, NodeId>> ret;
+    auto peerit = m_peers.find(peer);
+    if (peerit == m_peers.end()) return ret;
+
+    std::set<uint256> in_batch;
+    std::deque<uint256> to_add(peerit->second.work_set.begin(), peerit->second.work_set.end());
+    peerit->second.work_set.clear();
+    while (!to_add.empty()) {
+        const uint256 orphanHash = to_add.front();
+        to_add.pop_front();
+        if (in_batch.count(orphanHash)) continue;
+        auto orphan_it = m_orphans.find(orphanHash);
+        if (orphan_it == m_orphans.end()) continue;
+        if (ret.size() >= max_txs) {
+            // Leave the rest for a later call.
+            m_peers[orphan_it->second.from_peer].work_set.insert(orphanHash);
+            continue;
+        }
+
+        in_batch.insert(orphanHash);
+        ret.emplace_back(orphan_it->second.tx, orphan_it->second.from_peer);
+        for (unsigned int i = 0; i < orphan_it->second.tx->vout.size(); i++) {
+            auto it_by_prev = m_outpoint_to_orphan.find(COutPoint(orphanHash, i));
+            if (it_by_prev != m_outpoint_to_orphan.end()) {
+                for (const auto& elem : it_by_prev->second) {
+                    to_add.push_back(elem->first);
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+size_t TxOrphanage::CountForPeer(NodeId peer) const
+{
+    auto peerit = m_peers.find(peer);
+    return peerit == m_peers.end() ? 0 : peerit->second.orphans.size();
+}
+
+int64_t TxOrphanage::WeightForPeer(NodeId peer) const
+{
+    auto peerit = m_peers.find(peer);
+    return peerit == m_peers.end() ? 0 : peerit->second.weight;
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NODE_TXORPHANAGE_H
+#define BITCOIN_NODE_TXORPHANAGE_H
+
+#include <net.h>
+#include <primitives/transaction.h>
+#include <uint256.h>
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CBlock;
+
+/** Expiration time for orphan transactions in seconds */
+static constexpr int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static constexpr int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+/**
+ * Transactions whose inputs are missing, kept until their parents arrive.
+ *
+ * Orphans are accounted to the peer that sent them: when the pool exceeds
+ * its count or weight limit, the peer using the most weight loses its oldest
+ * orphan first, so one peer flooding orphans can't evict everyone else's.
+ *
+ * When a transaction is accepted, the orphans spending it are queued on a
+ * per-peer work set (that of the peer that sent each orphan), and are
+ * reconsidered a bounded batch at a time by the message handler rather than
+ * all at once.
+ *
+ * Not thread-safe; callers provide locking.
+ */
+class TxOrphanage
+{
+public:
+    /** Add an orphan sent by peer. Returns false if it is already known or too large. */
+    bool AddTx(const CTransactionRef& tx, NodeId peer);
+
+    /** Whether txid is in the orphan pool. */
+    bool HaveTx(const uint256& txid) const;
+
+    /** Erase an orphan; returns the number of orphans erased (0 or 1). */
+    int EraseTx(const uint256& txid);
+
+    /** Erase all orphans sent by peer and drop its work set. */
+    int EraseForPeer(NodeId peer);
+
+    /** Erase orphans included in or conflicted by block. */
+    int EraseForBlock(const CBlock& block);
+
+    /**
+     * Erase expired orphans, then evict orphans of the heaviest peers until
+     * at most max_orphans orphans weighing at most max_weight remain.
+     * Returns the number of orphans evicted (not counting expired ones).
+     */
+    unsigned int LimitOrphans(unsigned int max_orphans, int64_t max_weight);
+
+    /** Queue the orphans spending outputs of tx for reconsideration. */
+    void AddChildrenToWorkSet(const CTransaction& tx);
+
+    /** Whether peer has queued orphans to reconsider. */
+    bool HaveTxToReconsider(NodeId peer) const;
+
+    /**
+     * Take up to max_txs orphans off peer's work set, followed by the
+     * orphans spending them (recursively), so a chain can be offered to the
+     * mempool parents first. Orphans that don't fit stay queued on their
+     * sender's work set. Returns (orphan, sending peer) pairs.
+     */
+    std::vector<std::pair<CTransactionRef, NodeId>> GetTxsToReconsider(NodeId peer, size_t max_txs);
+
+    size_t Size() const { return m_orphans.size(); }
+    int64_t TotalWeight() const { return m_total_weight; }
+    /** Number of orphans sent by peer. */
+    size_t CountForPeer(NodeId peer) const;
+    /** Total weight of the orphans sent by peer. */
+    int64_t WeightForPeer(NodeId peer) const;
+
+private:
+    struct OrphanTx {
+        CTransactionRef tx;
+        NodeId from_peer;
+        int64_t time_expire;
+        int64_t weight;
+        uint64_t sequence;
+    };
+    typedef std::map<uint256, OrphanTx> OrphanMap;
+
+    struct IteratorComparator
+    {
+        template<typename I>
+        bool operator()(const I& a, const I& b) const
+        {
+            return &(*a) < &(*b);
+        }
+    };
+
+    struct PeerInfo {
+        int64_t weight{0};
+        /** The peer's orphans, in order of arrival. */
+        std::map<uint64_t, OrphanMap::iterator> orphans;
+        std::set<uint256> work_set;
+    };
+
+    OrphanMap m_orphans;
+    std::map<COutPoint, std::set<OrphanMap::iterator, IteratorComparator>> m_outpoint_to_orphan;
+    std::map<NodeId, PeerInfo> m_peers;
+    int64_t m_total_weight{0};
+    uint64_t m_sequence{0};
+    int64_t m_next_sweep{0};
+};
+
+#endif // BITCOIN_NODE_TXORPHANAGE_H
@@ -0,0 +1,104 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/txrequest.h>
+
+#include <assert.h>
+#include <limits>
+
+void TxRequestTracker::Erase(Index::iterator it)
+{
+    auto peerit = m_peerinfo.find(it->m_peer);
+    assert(peerit != m_peerinfo.end());
+    if (it->m_state == State::REQUESTED) --peerit->second.m_requested;
+    if (--peerit->second.m_total == 0) m_peerinfo.erase(peerit);
+    m_index.erase(it);
+}
+
+void TxRequestTracker::ExpireRequests(int64_t now)
+{
+    auto& index = m_index.get<ByTime>();
+    auto it = index.lower_bound(ByTimeExtractor::result_type(State::REQUESTED, std::numeric_limits<int64_t>::min()));
+    while (it != index.end() && it->m_state == State::REQUESTED && it->m_time <= now) {
+        Erase(m_index.project<ByPeer>(it++));
+    }
+}
+
+void TxRequestTracker::ReceivedInv(NodeId peer, const uint256& txhash, bool preferred, int64_t reqtime)
+{
+    if (!m_index.insert(Announcement{txhash, reqtime, peer, m_sequence, preferred, State::CANDIDATE}).second) return;
+    ++m_sequence;
+    ++m_peerinfo[peer].m_total;
+}
+
+std::vector<uint256> TxRequestTracker::GetRequestable(NodeId peer, int64_t now)
+{
+    ExpireRequests(now);
+
+    std::vector<uint256> ret;
+    const auto& by_txhash = m_index.get<ByTxHash>();
+    const auto& index = m_index.get<ByPeerTime>();
+    auto it = index.lower_bound(ByPeerTimeExtractor::result_type(peer, State::CANDIDATE, std::numeric_limits<int64_t>::min(), 0));
+    for (; it != index.end() && it->m_peer == peer && it->m_state == State::CANDIDATE && it->m_time <= now; ++it) {
+        // Skip txids that are already being requested from some peer.
+        auto req = by_txhash.lower_bound(ByTxHashExtractor::result_type(it->m_txhash, State::REQUESTED, false, std::numeric_limits<int64_t>::min()));
+        if (req != by_txhash.end() && req->m_txhash == it->m_txhash && req->m_state == State::REQUESTED) continue;
+        // Leave the txid to a preferred announcer that is ready to request it.
+        if (!it->m_preferred) {
+            auto pref = by_txhash.lower_bound(ByTxHashExtractor::result_type(it->m_txhash, State::CANDIDATE, false, std::numeric_limits<int64_t>::min()));
+            if (pref != by_txhash.end() && pref->m_txhash == it->m_txhash && pref->m_state == State::CANDIDATE &&
+                pref->m_preferred && pref->m_time <= now) {
+                continue;
+            }
+        }
+        ret.push_back(it->m_txhash);
+    }
+    return ret;
+}
+
+void TxRequestTracker::RequestedTx(NodeId peer, const uint256& txhash, int64_t expiry)
+{
+    auto it = m_index.find(ByPeerExtractor::result_type(peer, txhash));
+    if (it == m_index.end() || it->m_state != State::CANDIDATE) return;
+    m_index.modify(it, [expiry](Announcement& ann) {
+        ann.m_state = State::REQUESTED;
+        ann.m_time = expiry;
+    });
+    ++m_peerinfo[peer].m_requested;
+}
+
+void TxRequestTracker::ReceivedResponse(NodeId peer, const uint256& txhash)
+{
+    auto it = m_index.find(ByPeerExtractor::result_type(peer, txhash));
+    if (it != m_index.end()) Erase(it);
+}
+
+void TxRequestTracker::ForgetTxHash(const uint256& txhash)
+{
+    auto& index = m_index.get<ByTxHash>();
+    auto it = index.lower_bound(ByTxHashExtractor::result_type(txhash, State::CANDIDATE, false, std::numeric_limits<int64_t>::min()));
+    while (it != index.end() && it->m_txhash == txhash) {
+        Erase(m_index.project<ByPeer>(it++));
+    }
+}
+
+void TxRequestTracker::DisconnectedPeer(NodeId peer)
+{
+    auto it = m_index.lower_bound(ByPeerExtractor::result_type(peer, uint256()));
+    while (it != m_index.end() && it->m_peer == peer) {
+        Erase(it++);
+    }
+}
+
+size_t TxRequestTracker::Count(NodeId peer) const
+{
+    auto it = m_peerinfo.find(peer);
+    return it == m_peerinfo.end() ? 0 : it->second.m_total;
+}
+
+size_t TxRequestTracker::CountInFlight(NodeId peer) const
+{
+    auto it = m_peerinfo.find(peer);
+    return it == m_peerinfo.end() ? 0 : it->second.m_requested;
+}
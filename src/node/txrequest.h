@@ -0,0 +1,141 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NODE_TXREQUEST_H
+#define BITCOIN_NODE_TXREQUEST_H
+
+#include <net.h>
+#include <uint256.h>
+
+#include <stdint.h>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+/**
+ * Tracks transaction announcements (invs) received from peers and the getdata
+ * requests issued for them.
+ *
+ * Every (peer, txid) announcement is either a CANDIDATE, waiting for its
+ * request time, or REQUESTED, waiting for a response until its expiry time.
+ * At most one announcement per txid is REQUESTED at any time, so a
+ * transaction is fetched from a single peer while the other announcers are
+ * kept as fallbacks. Once a ready candidate from a preferred (outbound or
+ * whitelisted) peer exists, non-preferred announcers don't request it.
+ *
+ * All operations are O(log n) in the number of tracked announcements, plus
+ * the size of the result for GetRequestable. The class is not thread-safe;
+ * callers provide locking.
+ */
+class TxRequestTracker
+{
+public:
+    enum class State : uint8_t {
+        CANDIDATE,
+        REQUESTED,
+    };
+
+    TxRequestTracker() = default;
+    TxRequestTracker(const TxRequestTracker&) = delete;
+    TxRequestTracker& operator=(const TxRequestTracker&) = delete;
+
+    /** Add a candidate announcement of txhash by peer, requestable from reqtime (in microseconds).
+     *  Ignored if peer already announced txhash. */
+    void ReceivedInv(NodeId peer, const uint256& txhash, bool preferred, int64_t reqtime);
+
+    /**
+     * Return the txids that should be requested from peer now, in order of
+     * announcement. Requests that expired by now are dropped first, which
+     * makes their txids requestable from the other announcers. The caller is
+     * expected to call RequestedTx or ForgetTxHash for each returned txid.
+     */
+    std::vector<uint256> GetRequestable(NodeId peer, int64_t now);
+
+    /** Mark the announcement of txhash by peer as requested, expiring at expiry (in microseconds). */
+    void RequestedTx(NodeId peer, const uint256& txhash, int64_t expiry);
+
+    /** A response (tx or notfound) for txhash was received from peer; drop its announcement. */
+    void ReceivedResponse(NodeId peer, const uint256& txhash);
+
+    /** Drop all announcements of txhash, e.g. once we have the transaction. */
+    void ForgetTxHash(const uint256& txhash);
+
+    /** Drop all announcements made by peer. */
+    void DisconnectedPeer(NodeId peer);
+
+    /** Number of announcements tracked for peer, in any state. */
+    size_t Count(NodeId peer) const;
+    /** Number of announcements of peer in the REQUESTED state. */
+    size_t CountInFlight(NodeId peer) const;
+    /** Total number of tracked announcements. */
+    size_t Size() const { return m_index.size(); }
+
+private:
+    struct Announcement {
+        uint256 m_txhash;
+        /** Request time for CANDIDATE, expiry time for REQUESTED. */
+        int64_t m_time;
+        NodeId m_peer;
+        /** Announcement order, used to break ties between equal times. */
+        uint64_t m_sequence;
+        bool m_preferred;
+        State m_state;
+    };
+
+    // (peer, txhash): unique, for lookups of a single announcement.
+    struct ByPeer {};
+    struct ByPeerExtractor {
+        typedef std::tuple<NodeId, const uint256&> result_type;
+        result_type operator()(const Announcement& ann) const { return result_type(ann.m_peer, ann.m_txhash); }
+    };
+
+    // (peer, state, time, sequence): a peer's ready candidates, in request order.
+    struct ByPeerTime {};
+    struct ByPeerTimeExtractor {
+        typedef std::tuple<NodeId, State, int64_t, uint64_t> result_type;
+        result_type operator()(const Announcement& ann) const { return result_type(ann.m_peer, ann.m_state, ann.m_time, ann.m_sequence); }
+    };
+
+    // (txhash, state, non-preferred, time): whether a txid is in flight, and
+    // its earliest preferred candidate.
+    struct ByTxHash {};
+    struct ByTxHashExtractor {
+        typedef std::tuple<const uint256&, State, bool, int64_t> result_type;
+        result_type operator()(const Announcement& ann) const { return result_type(ann.m_txhash, ann.m_state, !ann.m_preferred, ann.m_time); }
+    };
+
+    // (state, time): requests in order of expiry.
+    struct ByTime {};
+    struct ByTimeExtractor {
+        typedef std::tuple<State, int64_t> result_type;
+        result_type operator()(const Announcement& ann) const { return result_type(ann.m_state, ann.m_time); }
+    };
+
+    typedef boost::multi_index_container<
+        Announcement,
+        boost::multi_index::indexed_by<
+            boost::multi_index::ordered_unique<boost::multi_index::tag<ByPeer>, ByPeerExtractor>,
+            boost::multi_index::ordered_non_unique<boost::multi_index::tag<ByPeerTime>, ByPeerTimeExtractor>,
+            boost::multi_index::ordered_non_unique<boost::multi_index::tag<ByTxHash>, ByTxHashExtractor>,
+            boost::multi_index::ordered_non_unique<boost::multi_index::tag<ByTime>, ByTimeExtractor>
+        >
+    > Index;
+
+    struct PeerInfo {
+        size_t m_total{0};
+        size_t m_requested{0};
+    };
+
+    void Erase(Index::iterator it);
+    void ExpireRequests(int64_t now);
+
+    Index m_index;
+    std::unordered_map<NodeId, PeerInfo> m_peerinfo;
+    uint64_t m_sequence{0};
+};
+
+#endif // BITCOIN_NODE_TXREQUEST_H
@@ -15,6 +15,13 @@
 
 static constexpr double INF_FEERATE = 1e99;
 
+/** estimateSmartFee targets recomputed after every block, covering the wallet
+ * default and the targets offered by the GUI */
+static const int PRECOMPUTED_ESTIMATE_TARGETS[] = {1, 2, 3, 4, 5, 6, 12, 24, 48, 144, 504, 1008};
+
+/** Bound on distinct estimateRawFee queries cached between blocks */
+static const size_t MAX_RAW_FEE_CACHE_SIZE = 1000;
+
 std::string StringForFeeEstimateHorizon(FeeEstimateHorizon horizon) {
     static const std::map<FeeEstimateHorizon, std::string> horizon_strings = {
         {FeeEstimateHorizon::SHORT_HALFLIFE, "short"},
@@ -485,6 +492,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash, bool inBlock)
         shortStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
         longStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
         mapMemPoolTxs.erase(hash);
+        ClearEstimateCache();
         return true;
     } else {
         return false;
@@ -619,6 +627,12 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         LogPrint(BCLog::ESTIMATEFEE, "Blockpolicy first recorded height %u\n", firstRecordedHeight);
     }
 
+    // Blocks without tracked transactions (e.g. during IBD) still decay the
+    // averages, but are not worth precomputing a table for; the cache then
+    // refills on demand.
+    ClearEstimateCache();
+    if (countedTxs > 0) RefreshEstimateCache();
+
 
     LogPrint(BCLog::ESTIMATEFEE, "Blockpolicy estimates updated by %u of %u block txs, since last block %u of %u tracked, mempool map size %u, max target %u from %s\n",
              countedTxs, entries.size(), trackedTxs, trackedTxs + untrackedTxs, mapMemPoolTxs.size(),
@@ -660,19 +674,32 @@ CFeeRate CBlockPolicyEstimator::estimateRawFee(int confTarget, double successThr
     }
     }
 
-    LOCK(cs_feeEstimator);
     // Return failure if trying to analyze a target we're not tracking
     if (confTarget <= 0 || (unsigned int)confTarget > stats->GetMaxConfirms())
         return CFeeRate(0);
     if (successThreshold > 1)
         return CFeeRate(0);
 
-    double median = stats->EstimateMedianVal(confTarget, sufficientTxs, successThreshold, true, nBestSeenHeight, result);
-
-    if (median < 0)
-        return CFeeRate(0);
+    const std::tuple<int, double, FeeEstimateHorizon> key(confTarget, successThreshold, horizon);
+    {
+        LOCK(cs_estimateCache);
+        auto it = mapRawFeeCache.find(key);
+        if (it != mapRawFeeCache.end()) {
+            if (result) *result = it->second.result;
+            return it->second.feeRate;
+        }
+    }
 
-    return CFeeRate(llround(median));
+    LOCK(cs_feeEstimator);
+    CachedRawFee cached;
+    double median = stats->EstimateMedianVal(confTarget, sufficientTxs, successThreshold, true, nBestSeenHeight, &cached.result);
+    if (median >= 0) cached.feeRate = CFeeRate(llround(median));
+    if (result) *result = cached.result;
+
+    LOCK(cs_estimateCache);
+    if (mapRawFeeCache.size() >= MAX_RAW_FEE_CACHE_SIZE) mapRawFeeCache.clear();
+    mapRawFeeCache.emplace(key, cached);
+    return cached.feeRate;
 }
 
 unsigned int CBlockPolicyEstimator::HighestTargetTracked(FeeEstimateHorizon horizon) const
@@ -786,7 +813,32 @@ double CBlockPolicyEstimator::estimateConservativeFee(unsigned int doubleTarget,
  */
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const
 {
+    const std::pair<int, bool> key(confTarget, conservative);
+    {
+        LOCK(cs_estimateCache);
+        auto it = mapSmartFeeCache.find(key);
+        if (it != mapSmartFeeCache.end()) {
+            if (feeCalc) *feeCalc = it->second.feeCalc;
+            return it->second.feeRate;
+        }
+    }
+
     LOCK(cs_feeEstimator);
+    CachedSmartFee cached;
+    cached.feeRate = computeSmartFee(confTarget, &cached.feeCalc, conservative);
+    if (feeCalc) *feeCalc = cached.feeCalc;
+
+    // Only cache targets we track, so the cache can't grow without bound
+    if (confTarget > 0 && (unsigned int)confTarget <= longStats->GetMaxConfirms()) {
+        LOCK(cs_estimateCache);
+        mapSmartFeeCache.emplace(key, cached);
+    }
+    return cached.feeRate;
+}
+
+CFeeRate CBlockPolicyEstimator::computeSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const
+{
+    AssertLockHeld(cs_feeEstimator);
 
     if (feeCalc) {
         feeCalc->desiredTarget = confTarget;
@@ -939,6 +991,7 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             nBestSeenHeight = nFileBestSeenHeight;
             historicalFirst = nFileHistoricalFirst;
             historicalBest = nFileHistoricalBest;
+            ClearEstimateCache();
         }
     }
     catch (const std::exception& e) {
@@ -948,6 +1001,28 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
     return true;
 }
 
+void CBlockPolicyEstimator::ClearEstimateCache()
+{
+    AssertLockHeld(cs_feeEstimator);
+    LOCK(cs_estimateCache);
+    mapSmartFeeCache.clear();
+    mapRawFeeCache.clear();
+}
+
+void CBlockPolicyEstimator::RefreshEstimateCache()
+{
+    AssertLockHeld(cs_feeEstimator);
+    for (int confTarget : PRECOMPUTED_ESTIMATE_TARGETS) {
+        if ((unsigned int)confTarget > longStats->GetMaxConfirms()) break;
+        for (bool conservative : {false, true}) {
+            CachedSmartFee cached;
+            cached.feeRate = computeSmartFee(confTarget, &cached.feeCalc, conservative);
+            LOCK(cs_estimateCache);
+            mapSmartFeeCache[std::make_pair(confTarget, conservative)] = cached;
+        }
+    }
+}
+
 void CBlockPolicyEstimator::FlushUnconfirmed() {
     int64_t startclear = GetTimeMicros();
     LOCK(cs_feeEstimator);
@@ -15,6 +15,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
 class CAutoFile;
@@ -255,6 +256,35 @@ private:
 
     mutable CCriticalSection cs_feeEstimator;
 
+    /** Result of an estimateSmartFee calculation */
+    struct CachedSmartFee
+    {
+        CFeeRate feeRate;
+        FeeCalculation feeCalc;
+    };
+
+    /** Result of an estimateRawFee calculation */
+    struct CachedRawFee
+    {
+        CFeeRate feeRate;
+        EstimationResult result;
+    };
+
+    /** Estimates only change when the tracked stats do (a new block, a tracked
+     * transaction leaving the mempool, reading a file), so results are cached
+     * until then and repeated calls don't need cs_feeEstimator.
+     * Lock order is cs_feeEstimator, then cs_estimateCache. */
+    mutable CCriticalSection cs_estimateCache;
+    mutable std::map<std::pair<int, bool>, CachedSmartFee> mapSmartFeeCache;
+    mutable std::map<std::tuple<int, double, FeeEstimateHorizon>, CachedRawFee> mapRawFeeCache;
+
+    /** Drop all cached estimates, must be called whenever the tracked stats change */
+    void ClearEstimateCache() EXCLUSIVE_LOCKS_REQUIRED(cs_feeEstimator);
+    /** Recompute the cached estimates for common targets */
+    void RefreshEstimateCache() EXCLUSIVE_LOCKS_REQUIRED(cs_feeEstimator);
+    /** Uncached estimateSmartFee */
+    CFeeRate computeSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const EXCLUSIVE_LOCKS_REQUIRED(cs_feeEstimator);
+
     /** Process a transaction confirmed in a block*/
     bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
 
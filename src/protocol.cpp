@@ -6,6 +6,8 @@
 
 #include <protocol.h>
 
+#include <crypto/common.h>
+
 #include <util.h>
 #include <utilstrencodings.h>
 
@@ -42,6 +44,12 @@ const char *SENDCMPCT="sendcmpct";
 const char *CMPCTBLOCK="cmpctblock";
 const char *GETBLOCKTXN="getblocktxn";
 const char *BLOCKTXN="blocktxn";
+const char *GETCFILTERS="getcfilters";
+const char *CFILTER="cfilter";
+const char *GETCFHEADERS="getcfheaders";
+const char *CFHEADERS="cfheaders";
+const char *GETCFCHECKPT="getcfcheckpt";
+const char *CFCHECKPT="cfcheckpt";
 } // namespace NetMsgType
 
 /** All known message types. Keep this in the same order as the list of
@@ -74,6 +82,12 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::CMPCTBLOCK,
     NetMsgType::GETBLOCKTXN,
     NetMsgType::BLOCKTXN,
+    NetMsgType::GETCFILTERS,
+    NetMsgType::CFILTER,
+    NetMsgType::GETCFHEADERS,
+    NetMsgType::CFHEADERS,
+    NetMsgType::GETCFCHECKPT,
+    NetMsgType::CFCHECKPT,
 };
 const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes+ARRAYLEN(allNetMessageTypes));
 
@@ -94,6 +108,14 @@ CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn, const
     memset(pchChecksum, 0, CHECKSUM_SIZE);
 }
 
+void CMessageHeader::ReadFromBuffer(const unsigned char* pch)
+{
+    memcpy(pchMessageStart, pch, MESSAGE_START_SIZE);
+    memcpy(pchCommand, pch + MESSAGE_START_SIZE, COMMAND_SIZE);
+    nMessageSize = ReadLE32(pch + MESSAGE_SIZE_OFFSET);
+    memcpy(pchChecksum, pch + CHECKSUM_OFFSET, CHECKSUM_SIZE);
+}
+
 std::string CMessageHeader::GetCommand() const
 {
     return std::string(pchCommand, pchCommand + strnlen(pchCommand, COMMAND_SIZE));
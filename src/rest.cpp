@@ -11,7 +11,9 @@
 #include <primitives/transaction.h>
 #include <validation.h>
 #include <httpserver.h>
+#include <net.h>
 #include <rpc/blockchain.h>
+#include <rpc/net.h>
 #include <rpc/server.h>
 #include <streams.h>
 #include <sync.h>
@@ -227,24 +229,29 @@ static bool rest_block(HTTPRequest* req,
 
         if (IsBlockPruned(pblockindex))
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
+    }
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+    // Binary and hex replies are built from the serialized block as stored on
+    // disk, without deserializing it
+    std::vector<uint8_t> block_data;
+    if (rf == RetFormat::BINARY || rf == RetFormat::HEX) {
+        bool witness = !(RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS);
+        if (!ReadRawBlockFromDisk(block_data, pblockindex, Params().MessageStart(), witness))
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+    } else if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus())) {
+        return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    ssBlock << block;
-
     switch (rf) {
     case RetFormat::BINARY: {
-        std::string binaryBlock = ssBlock.str();
+        std::string binaryBlock(block_data.begin(), block_data.end());
         req->WriteHeader("Content-Type", "application/octet-stream");
         req->WriteReply(HTTP_OK, binaryBlock);
         return true;
     }
 
     case RetFormat::HEX: {
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+        std::string strHex = HexStr(block_data.begin(), block_data.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
         req->WriteReply(HTTP_OK, strHex);
         return true;
@@ -326,6 +333,32 @@ static bool rest_mempool_info(HTTPRequest* req, const std::string& strURIPart)
     }
 }
 
+static bool rest_netstats(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    switch (rf) {
+    case RetFormat::JSON: {
+        if (!g_connman) {
+            return RESTERR(req, HTTP_SERVICE_UNAVAILABLE, "Peer-to-peer functionality missing or disabled");
+        }
+        // Anyone who can reach the REST server may read this; don't expose who we are connected to.
+        UniValue netStatsObject = NetStatsToJSON(*g_connman, false);
+
+        std::string strJSON = netStatsObject.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+}
+
 static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -644,6 +677,7 @@ static const struct {
       {"/rest/chaininfo", rest_chaininfo},
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
+      {"/rest/netstats", rest_netstats},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
 };
@@ -442,10 +442,8 @@ static std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-static void entryToJSON(const CTxMemPool& pool, UniValue& info, const CTxMemPoolEntry& e) EXCLUSIVE_LOCKS_REQUIRED(pool.cs)
+static void entryStateToJSON(UniValue& info, const CTxMemPoolEntry& e)
 {
-    AssertLockHeld(pool.cs);
-
     UniValue fees(UniValue::VOBJ);
     fees.pushKV("base", ValueFromAmount(e.GetFee()));
     fees.pushKV("modified", ValueFromAmount(e.GetModifiedFee()));
@@ -465,6 +463,13 @@ static void entryToJSON(const CTxMemPool& pool, UniValue& info, const CTxMemPool
     info.pushKV("ancestorcount", e.GetCountWithAncestors());
     info.pushKV("ancestorsize", e.GetSizeWithAncestors());
     info.pushKV("ancestorfees", e.GetModFeesWithAncestors());
+}
+
+static void entryToJSON(const CTxMemPool& pool, UniValue& info, const CTxMemPoolEntry& e) EXCLUSIVE_LOCKS_REQUIRED(pool.cs)
+{
+    AssertLockHeld(pool.cs);
+
+    entryStateToJSON(info, e);
     info.pushKV("wtxid", pool.vTxHashes[e.vTxHashesIdx].first.ToString());
     const CTransaction& tx = e.GetTx();
     std::set<std::string> setDepends;
@@ -512,15 +517,43 @@ static void entryToJSON(const CTxMemPool& pool, UniValue& info, const CTxMemPool
 >>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
 }
 
+/** Same output as entryToJSON, from a snapshot entry and without holding pool.cs */
+static void snapshotEntryToJSON(UniValue& info, const MempoolSnapshotEntry& snapshot_entry)
+{
+    const CTxMemPoolEntry& e = snapshot_entry.entry;
+    entryStateToJSON(info, e);
+    info.pushKV("wtxid", e.GetTx().GetWitnessHash().ToString());
+
+    std::set<std::string> setDepends;
+    for (const uint256& parent : snapshot_entry.parents) {
+        setDepends.insert(parent.ToString());
+    }
+    UniValue depends(UniValue::VARR);
+    for (const std::string& dep : setDepends) {
+        depends.push_back(dep);
+    }
+    info.pushKV("depends", depends);
+
+    UniValue spent(UniValue::VARR);
+    for (const uint256& child : snapshot_entry.children) {
+        spent.push_back(child.ToString());
+    }
+    info.pushKV("spentby", spent);
+
+    info.pushKV("bip125-replaceable", snapshot_entry.bip125_replaceable);
+}
+
 UniValue MempoolToJSON(const CTxMemPool& pool, bool verbose)
 {
+    // Serialize from a snapshot so that pool.cs is only held (if at all) while
+    // copying the entries, not while building the potentially large reply.
+    std::shared_ptr<const MempoolSnapshot> snapshot = pool.GetSnapshot();
     if (verbose) {
-        LOCK(pool.cs);
         UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : pool.mapTx) {
-            const uint256& hash = e.GetTx().GetHash();
+        for (const MempoolSnapshotEntry& e : snapshot->entries) {
+            const uint256& hash = e.entry.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
-            entryToJSON(pool, info, e);
+            snapshotEntryToJSON(info, e);
             // Mempool has unique entries so there is no advantage in using
             // UniValue::pushKV, which checks if the key already exists in O(N).
             // UniValue::__pushKV is used instead which currently is O(1).
@@ -528,12 +561,9 @@ UniValue MempoolToJSON(const CTxMemPool& pool, bool verbose)
         }
         return o;
     } else {
-        std::vector<uint256> vtxid;
-        pool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        for (const uint256& hash : vtxid)
-            a.push_back(hash.ToString());
+        for (const MempoolSnapshotEntry& e : snapshot->entries)
+            a.push_back(e.entry.GetTx().GetHash().ToString());
 
         return a;
     }
@@ -909,6 +939,22 @@ static CBlock GetBlockChecked(const CBlockIndex* pblockindex)
     return block;
 }
 
+static std::vector<uint8_t> GetRawBlockChecked(const CBlockIndex* pblockindex)
+{
+    std::vector<uint8_t> block_data;
+    if (IsBlockPruned(pblockindex)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
+    }
+
+    bool witness = !(RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS);
+    if (!ReadRawBlockFromDisk(block_data, pblockindex, Params().MessageStart(), witness)) {
+        // See GetBlockChecked
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+    }
+
+    return block_data;
+}
+
 static CBlockUndo GetUndoChecked(const CBlockIndex* pblockindex)
 {
     CBlockUndo blockUndo;
@@ -1012,6 +1058,7 @@ static UniValue getblock(const JSONRPCRequest& request)
     }
 
     CBlock block;
+    std::vector<uint8_t> block_data;
     const CBlockIndex* pblockindex;
     const CBlockIndex* tip;
     {
@@ -1023,14 +1070,16 @@ static UniValue getblock(const JSONRPCRequest& request)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
         }
 
-        block = GetBlockChecked(pblockindex);
+        if (verbosity <= 0) {
+            block_data = GetRawBlockChecked(pblockindex);
+        } else {
+            block = GetBlockChecked(pblockindex);
+        }
     }
 
     if (verbosity <= 0)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
+        std::string strHex = HexStr(block_data.begin(), block_data.end());
         return strHex;
     }
 
@@ -1637,13 +1686,14 @@ static UniValue getchaintips(const JSONRPCRequest& request)
 
 UniValue MempoolInfoToJSON(const CTxMemPool& pool)
 {
-    // Make sure this call is atomic in the pool.
-    LOCK(pool.cs);
+    // Counters come from a single snapshot, so they are consistent with each
+    // other (and with getrawmempool) without holding pool.cs.
+    std::shared_ptr<const MempoolSnapshot> snapshot = pool.GetSnapshot();
     UniValue ret(UniValue::VOBJ);
     ret.pushKV("loaded", pool.IsLoaded());
-    ret.pushKV("size", (int64_t)pool.size());
-    ret.pushKV("bytes", (int64_t)pool.GetTotalTxSize());
-    ret.pushKV("usage", (int64_t)pool.DynamicMemoryUsage());
+    ret.pushKV("size", (int64_t)snapshot->entries.size());
+    ret.pushKV("bytes", (int64_t)snapshot->total_tx_size);
+    ret.pushKV("usage", (int64_t)snapshot->usage);
     size_t maxmempool = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.pushKV("maxmempool", (int64_t) maxmempool);
     ret.pushKV("mempoolminfee", ValueFromAmount(std::max(pool.GetMinFee(maxmempool), ::minRelayTxFee).GetFeePerK()));
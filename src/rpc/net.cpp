@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <rpc/net.h>
 #include <rpc/server.h>
 
 #include <chainparams.h>
@@ -11,6 +12,7 @@
 #include <net.h>
 #include <net_processing.h>
 #include <netbase.h>
+#include <node/blockcache.h>
 #include <policy/policy.h>
 #include <policy/settings.h>
 #include <rpc/protocol.h>
@@ -102,6 +104,14 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"blockdownload\": {           (json object) Block download statistics for this peer\n"
+            "       \"window\": n,               (numeric) How many blocks may currently be in flight from this peer\n"
+            "       \"blocks\": n,               (numeric) Number of requested blocks received\n"
+            "       \"bytes\": n,                (numeric) Total size of requested blocks received\n"
+            "       \"blocktime\": n,            (numeric) Moving average of the time each block took to arrive, in seconds\n"
+            "       \"latency\": n,              (numeric) Moving average of the time from request to arrival, in seconds\n"
+            "       \"rerequested\": n           (numeric) Blocks re-requested from a faster peer after straggling at this one\n"
+            "    },\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -168,6 +178,14 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            UniValue blockdownload(UniValue::VOBJ);
+            blockdownload.pushKV("window", statestats.nMaxBlocksInFlight);
+            blockdownload.pushKV("blocks", statestats.nBlocksDownloaded);
+            blockdownload.pushKV("bytes", statestats.nBlockBytesDownloaded);
+            blockdownload.pushKV("blocktime", ((double)statestats.nBlockServiceTime) / 1e6);
+            blockdownload.pushKV("latency", ((double)statestats.nBlockLatency) / 1e6);
+            blockdownload.pushKV("rerequested", statestats.nBlocksReRequested);
+            obj.pushKV("blockdownload", blockdownload);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
 
@@ -407,6 +425,14 @@ static UniValue getnettotals(const JSONRPCRequest& request)
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"recvbufferpool\":\n"
+            "  {\n"
+            "    \"hits\": n,                  (numeric) Message payload buffers reused from the pool\n"
+            "    \"misses\": n,                (numeric) Message payload buffers freshly allocated\n"
+            "    \"pooled_bytes\": n,          (numeric) Capacity currently held by the pool\n"
+            "    \"bytes_copied\": n,          (numeric) Payload bytes copied from the socket read buffer\n"
+            "    \"bytes_in_place\": n         (numeric) Payload bytes received directly into message buffers\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -429,9 +455,119 @@ static UniValue getnettotals(const JSONRPCRequest& request)
     outboundLimit.pushKV("bytes_left_in_cycle", g_connman->GetOutboundTargetBytesLeft());
     outboundLimit.pushKV("time_left_in_cycle", g_connman->GetMaxOutboundTimeLeftInCycle());
     obj.pushKV("uploadtarget", outboundLimit);
+
+    CRecvBufferPool::Stats poolStats = g_recv_buffer_pool.GetStats();
+    UniValue recvPool(UniValue::VOBJ);
+    recvPool.pushKV("hits", poolStats.nHits);
+    recvPool.pushKV("misses", poolStats.nMisses);
+    recvPool.pushKV("pooled_bytes", poolStats.nPooledBytes);
+    recvPool.pushKV("bytes_copied", poolStats.nBytesCopied);
+    recvPool.pushKV("bytes_in_place", poolStats.nBytesInPlace);
+    obj.pushKV("recvbufferpool", recvPool);
+    return obj;
+}
+
+UniValue NetStatsToJSON(CConnman& connman, bool include_addr)
+{
+    UniValue messages(UniValue::VOBJ);
+    for (const auto& entry : connman.GetMsgNetStats()) {
+        const CNetMsgStats& stats = entry.second;
+        UniValue msg(UniValue::VOBJ);
+        msg.pushKV("msgsrecv", stats.nMsgsRecv);
+        msg.pushKV("bytesrecv", stats.nBytesRecv);
+        msg.pushKV("msgssent", stats.nMsgsSent);
+        msg.pushKV("bytessent", stats.nBytesSent);
+        msg.pushKV("processtime", stats.nProcessTimeMicros);
+        UniValue histogram(UniValue::VARR);
+        for (uint64_t nCount : stats.vProcessTimeHistogram) {
+            histogram.push_back(nCount);
+        }
+        msg.pushKV("processtime_histogram", histogram);
+        messages.pushKV(entry.first, msg);
+    }
+
+    std::vector<CPeerNetStats> vstats;
+    connman.GetPeerNetStats(vstats);
+    // Most expensive peers first
+    std::sort(vstats.begin(), vstats.end(), [](const CPeerNetStats& a, const CPeerNetStats& b) {
+        return a.nProcessTimeMicros > b.nProcessTimeMicros;
+    });
+    UniValue peers(UniValue::VARR);
+    for (const CPeerNetStats& stats : vstats) {
+        UniValue peer(UniValue::VOBJ);
+        if (include_addr)
+            peer.pushKV("addr", stats.addr.ToString());
+        peer.pushKV("connected", stats.fConnected);
+        peer.pushKV("connections", stats.nConnections);
+        peer.pushKV("lastseen", stats.nLastSeen);
+        peer.pushKV("bytessent", stats.nBytesSent);
+        peer.pushKV("bytesrecv", stats.nBytesRecv);
+        peer.pushKV("msgsprocessed", stats.nMsgsProcessed);
+        peer.pushKV("processtime", stats.nProcessTimeMicros);
+        peer.pushKV("sendqueue", (uint64_t)stats.nSendQueue);
+        peer.pushKV("processqueue", (uint64_t)stats.nProcessQueue);
+        peer.pushKV("maxsendqueue", (uint64_t)stats.nMaxSendQueue);
+        peer.pushKV("maxprocessqueue", (uint64_t)stats.nMaxProcessQueue);
+        peers.push_back(peer);
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("messages", messages);
+    obj.pushKV("peers", peers);
     return obj;
 }
 
+static UniValue getnetstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "getnetstats\n"
+            "\nReturns network statistics per message command and per peer address since startup,\n"
+            "including those of peers that have disconnected.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"messages\": {                     (json object) Commands sent or received at least once\n"
+            "    \"command\": {\n"
+            "      \"msgsrecv\": n,                (numeric) Messages received\n"
+            "      \"bytesrecv\": n,               (numeric) Bytes received, including message headers\n"
+            "      \"msgssent\": n,                (numeric) Messages sent\n"
+            "      \"bytessent\": n,               (numeric) Bytes sent, including message headers\n"
+            "      \"processtime\": n,             (numeric) Total time spent processing received messages, in microseconds\n"
+            "      \"processtime_histogram\": [    (json array) Number of messages processed in less than 1, 2, 4, ... microseconds;\n"
+            "        n,                           the last entry counts all slower messages\n"
+            "        ...\n"
+            "      ]\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"peers\": [                        (json array) Peer addresses, most processing time first\n"
+            "    {\n"
+            "      \"addr\": \"host\",              (string) The IP address of the peer\n"
+            "      \"connected\": true|false,      (boolean) Whether the peer is currently connected\n"
+            "      \"connections\": n,             (numeric) Number of connections with this address\n"
+            "      \"lastseen\": ttt,              (numeric) The time in seconds since epoch (Jan 1 1970 GMT) this address was last connected\n"
+            "      \"bytessent\": n,               (numeric) Bytes sent\n"
+            "      \"bytesrecv\": n,               (numeric) Bytes received\n"
+            "      \"msgsprocessed\": n,           (numeric) Messages processed\n"
+            "      \"processtime\": n,             (numeric) Time spent processing its messages, in microseconds\n"
+            "      \"sendqueue\": n,               (numeric) Bytes currently waiting to be sent\n"
+            "      \"processqueue\": n,            (numeric) Bytes currently waiting to be processed\n"
+            "      \"maxsendqueue\": n,            (numeric) Most bytes ever waiting to be sent\n"
+            "      \"maxprocessqueue\": n          (numeric) Most bytes ever waiting to be processed\n"
+            "    },\n"
+            "    ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetstats", "")
+            + HelpExampleRpc("getnetstats", "")
+       );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    return NetStatsToJSON(*g_connman, true);
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -481,6 +617,13 @@ static UniValue getnetworkinfo(const JSONRPCRequest& request)
             "  ],\n"
             "  \"relayfee\": x.xxxxxxxx,                (numeric) minimum relay fee for transactions in " + CURRENCY_UNIT + "/kB\n"
             "  \"incrementalfee\": x.xxxxxxxx,          (numeric) minimum fee increment for mempool limiting or BIP 125 replacement in " + CURRENCY_UNIT + "/kB\n"
+            "  \"blockservecache\": {                  (json object) cache of serialized blocks served to peers (only if -blockservecache is not 0)\n"
+            "    \"entries\": xxxxx,                    (numeric) number of cached block messages\n"
+            "    \"bytes\": xxxxx,                      (numeric) total size of the cached block messages\n"
+            "    \"maxbytes\": xxxxx,                   (numeric) cache size limit (-blockservecache)\n"
+            "    \"hits\": xxxxx,                       (numeric) blocks served from the cache\n"
+            "    \"misses\": xxxxx                      (numeric) blocks read from disk\n"
+            "  },\n"
             "  \"localaddresses\": [                    (array) list of local addresses\n"
             "  {\n"
             "    \"address\": \"xxxx\",                 (string) network address\n"
@@ -512,6 +655,16 @@ static UniValue getnetworkinfo(const JSONRPCRequest& request)
     obj.pushKV("networks",      GetNetworksInfo());
     obj.pushKV("relayfee",      ValueFromAmount(::minRelayTxFee.GetFeePerK()));
     obj.pushKV("incrementalfee", ValueFromAmount(::incrementalRelayFee.GetFeePerK()));
+    if (g_block_msg_cache) {
+        BlockMsgCache::Stats cache_stats = g_block_msg_cache->GetStats();
+        UniValue cache(UniValue::VOBJ);
+        cache.pushKV("entries", (uint64_t)cache_stats.entries);
+        cache.pushKV("bytes", (uint64_t)cache_stats.bytes);
+        cache.pushKV("maxbytes", (uint64_t)cache_stats.max_bytes);
+        cache.pushKV("hits", cache_stats.hits);
+        cache.pushKV("misses", cache_stats.misses);
+        obj.pushKV("blockservecache", cache);
+    }
     UniValue localAddresses(UniValue::VARR);
     {
         LOCK(cs_mapLocalHost);
@@ -770,6 +923,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         {"address", "nodeid"} },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       {"node"} },
     { "network",            "getnettotals",           &getnettotals,           {} },
+    { "network",            "getnetstats",            &getnetstats,            {} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         {} },
     { "network",            "setban",                 &setban,                 {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             {} },
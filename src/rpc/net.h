@@ -0,0 +1,18 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPC_NET_H
+#define BITCOIN_RPC_NET_H
+
+class CConnman;
+class UniValue;
+
+/**
+ * Network statistics per message command and per peer address, as returned by
+ * getnetstats and /rest/netstats. The unauthenticated REST interface leaves out
+ * the peer addresses (include_addr = false).
+ */
+UniValue NetStatsToJSON(CConnman& connman, bool include_addr);
+
+#endif
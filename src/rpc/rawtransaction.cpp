@@ -1404,6 +1404,88 @@ static UniValue sendrawtransaction(const JSONRPCRequest& request)
     return txid.GetHex();
 }
 
+static UniValue sendrawtransactions(const JSONRPCRequest& request)
+{
+    const RPCHelpMan help{"sendrawtransactions",
+                "\nSubmits a batch of raw transactions (serialized, hex-encoded) to local node and network.\n"
+                "\nThe transactions may spend outputs of each other, and are validated parents first whatever\n"
+                "their order in the array.\n"
+                "\nAlso see sendrawtransaction call.\n",
+                {
+                    {"rawtxs", RPCArg::Type::ARR, RPCArg::Optional::NO, "An array of hex strings of raw transactions.",
+                        {
+                            {"rawtx", RPCArg::Type::STR_HEX, RPCArg::Optional::OMITTED, ""},
+                        },
+                        },
+                    {"maxfeerate", RPCArg::Type::AMOUNT, /* default */ FormatMoney(DEFAULT_MAX_RAW_TX_FEE),
+                        "Reject transactions whose fee rate is higher than the specified value, expressed in " + CURRENCY_UNIT +
+                            "/kB.\nSet to 0 to accept any fee rate.\n"},
+                },
+                RPCResult{
+            "[                   (array) The result for each raw transaction in the input array, in the same order.\n"
+            " {\n"
+            "  \"txid\"           (string) The transaction hash in hex\n"
+            "  \"accepted\"       (boolean) Whether the transaction is in the mempool and was broadcast\n"
+            "  \"error\" : {      (json object) The error that sendrawtransaction would have raised (only present when 'accepted' is false)\n"
+            "    \"code\" : n,     (numeric) The error code\n"
+            "    \"message\" : \"str\" (string) The error message\n"
+            "  }\n"
+            " }\n"
+            "]\n"
+                },
+                RPCExamples{
+            HelpExampleCli("sendrawtransactions", "\"[\\\"signedhex\\\",\\\"signedchildhex\\\"]\"")
+            + HelpExampleRpc("sendrawtransactions", "[\"signedhex\",\"signedchildhex\"]")
+                },
+    };
+
+    if (request.fHelp || !help.IsValidNumArgs(request.params.size())) {
+        throw std::runtime_error(help.ToString());
+    }
+
+    RPCTypeCheck(request.params, {
+        UniValue::VARR,
+        UniValueType(UniValue::VNUM),
+    });
+
+    const UniValue& rawtxs = request.params[0].get_array();
+    const CFeeRate max_raw_tx_fee_rate = request.params[1].isNull() ? CFeeRate(DEFAULT_MAX_RAW_TX_FEE) : CFeeRate(AmountFromValue(request.params[1]));
+
+    std::vector<CTransactionRef> txs;
+    std::vector<CAmount> max_raw_tx_fees;
+    txs.reserve(rawtxs.size());
+    max_raw_tx_fees.reserve(rawtxs.size());
+    for (unsigned int idx = 0; idx < rawtxs.size(); idx++) {
+        CMutableTransaction mtx;
+        if (!DecodeHexTx(mtx, rawtxs[idx].get_str())) {
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("TX decode failed for tx %d", idx));
+        }
+        CTransactionRef tx(MakeTransactionRef(std::move(mtx)));
+        if (request.params[1].isNull()) {
+            max_raw_tx_fees.push_back(DEFAULT_MAX_RAW_TX_FEE);
+        } else {
+            // Same rounding as in sendrawtransaction
+            max_raw_tx_fees.push_back(max_raw_tx_fee_rate.GetFee((GetTransactionWeight(*tx) + 3) / 4));
+        }
+        txs.push_back(std::move(tx));
+    }
+
+    std::vector<std::string> err_strings;
+    const std::vector<TransactionError> errors = BroadcastTransactions(txs, err_strings, max_raw_tx_fees);
+
+    UniValue result(UniValue::VARR);
+    for (size_t i = 0; i < txs.size(); i++) {
+        UniValue entry(UniValue::VOBJ);
+        entry.pushKV("txid", txs[i]->GetHash().GetHex());
+        entry.pushKV("accepted", errors[i] == TransactionError::OK);
+        if (errors[i] != TransactionError::OK) {
+            entry.pushKV("error", JSONRPCTransactionError(errors[i], err_strings[i]));
+        }
+        result.push_back(std::move(entry));
+    }
+    return result;
+}
+
 static UniValue testmempoolaccept(const JSONRPCRequest& request)
 {
 <<<<<<< HEAD
@@ -2472,6 +2554,7 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "decoderawtransaction",         &decoderawtransaction,      {"hexstring","iswitness"} },
     { "rawtransactions",    "decodescript",                 &decodescript,              {"hexstring"} },
     { "rawtransactions",    "sendrawtransaction",           &sendrawtransaction,        {"hexstring","allowhighfees|maxfeerate"} },
+    { "rawtransactions",    "sendrawtransactions",          &sendrawtransactions,       {"rawtxs","maxfeerate"} },
     { "rawtransactions",    "combinerawtransaction",        &combinerawtransaction,     {"txs"} },
 <<<<<<< HEAD
     { "rawtransactions",    "signrawtransaction",           &signrawtransaction,        {"hexstring","prevtxs","privkeys","sighashtype"} }, /* uses wallet if enabled */
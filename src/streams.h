@@ -412,6 +412,12 @@ public:
         clear();
     }
 
+    /** Exchange the underlying buffer with v without copying, and rewind. */
+    void SwapBuffer(vector_type& v) {
+        vch.swap(v);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
@@ -6,9 +6,11 @@
 #include <string>
 #include <boost/test/unit_test.hpp>
 
+#include <clientversion.h>
 #include <hash.h>
 #include <netbase.h>
 #include <random.h>
+#include <streams.h>
 
 class CAddrManTest : public CAddrMan
 {
@@ -354,6 +356,67 @@ BOOST_AUTO_TEST_CASE(addrman_delete)
     BOOST_CHECK(info2 == nullptr);
 }
 
+BOOST_AUTO_TEST_CASE(addrman_delete_reuses_id)
+{
+    CAddrManTest addrman;
+
+    CNetAddr source = ResolveIP("250.1.2.1");
+    CAddress addr1 = CAddress(ResolveService("250.1.2.1", 8333), NODE_NONE);
+    CAddress addr2 = CAddress(ResolveService("250.1.2.2", 8333), NODE_NONE);
+    CAddress addr3 = CAddress(ResolveService("250.1.2.3", 8333), NODE_NONE);
+
+    int nId1, nId2, nId3;
+    addrman.Create(addr1, source, &nId1);
+    addrman.Create(addr2, source, &nId2);
+    addrman.Delete(nId1);
+
+    // Test: A new entry takes the place of the deleted one.
+    addrman.Create(addr3, source, &nId3);
+    BOOST_CHECK_EQUAL(nId3, nId1);
+    BOOST_CHECK_EQUAL(addrman.size(), 2U);
+    BOOST_CHECK(addrman.Find(addr1) == nullptr);
+
+    int nId;
+    CAddrInfo* info2 = addrman.Find(addr2, &nId);
+    BOOST_REQUIRE(info2 != nullptr);
+    BOOST_CHECK_EQUAL(nId, nId2);
+    BOOST_CHECK_EQUAL(info2->ToString(), "250.1.2.2:8333");
+
+    CAddrInfo* info3 = addrman.Find(addr3, &nId);
+    BOOST_REQUIRE(info3 != nullptr);
+    BOOST_CHECK_EQUAL(nId, nId3);
+    BOOST_CHECK_EQUAL(info3->ToString(), "250.1.2.3:8333");
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialization)
+{
+    CAddrManTest addrman;
+
+    CNetAddr source = ResolveIP("252.2.2.2");
+    std::vector<CService> addrs;
+    for (unsigned int i = 1; i < 200; i++) {
+        addrs.push_back(ResolveService("250.1." + std::to_string(i / 100) + "." + std::to_string(i % 100 + 1), 8333));
+        addrman.Add(CAddress(addrs.back(), NODE_NONE), source);
+        if (i % 4 == 0) addrman.Good(addrs.back());
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrManTest addrman2(false);
+    ss >> addrman2;
+
+    // Test: Every entry survives the round trip.
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    for (const CService& addr : addrs) {
+        CAddrInfo* info = addrman.Find(addr);
+        CAddrInfo* info2 = addrman2.Find(addr);
+        BOOST_CHECK_EQUAL(info == nullptr, info2 == nullptr);
+        if (info && info2) {
+            BOOST_CHECK_EQUAL(info2->ToString(), info->ToString());
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(addrman_getaddr)
 {
     CAddrManTest addrman;
@@ -0,0 +1,134 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <net.h>
+#include <node/blockcache.h>
+#include <primitives/block.h>
+#include <primitives/transaction.h>
+#include <protocol.h>
+#include <script/script.h>
+#include <streams.h>
+#include <validation.h>
+#include <version.h>
+
+#include <test/setup_common.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, TestingSetup)
+
+static std::shared_ptr<const CSharedNetMsg> MakeMsg(size_t size)
+{
+    CSerializedNetMsg msg;
+    msg.command = NetMsgType::BLOCK;
+    msg.data.resize(size);
+    return std::make_shared<const CSharedNetMsg>(std::move(msg));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    const size_t msg_size = 1000 + CMessageHeader::HEADER_SIZE;
+    BlockMsgCache cache(3 * msg_size);
+    const uint256 a = InsecureRand256(), b = InsecureRand256(), c = InsecureRand256(), d = InsecureRand256();
+
+    BOOST_CHECK(!cache.Get(a, true));
+    cache.Insert(a, true, MakeMsg(1000));
+    cache.Insert(b, true, MakeMsg(1000));
+    cache.Insert(c, true, MakeMsg(1000));
+    BOOST_CHECK(cache.Get(a, true));
+    // Witness mode is part of the key
+    BOOST_CHECK(!cache.Get(a, false));
+
+    // d evicts the least recently used entry, b
+    cache.Insert(d, true, MakeMsg(1000));
+    BOOST_CHECK(!cache.Get(b, true));
+    BOOST_CHECK(cache.Get(a, true));
+    BOOST_CHECK(cache.Get(c, true));
+    BOOST_CHECK(cache.Get(d, true));
+
+    // Entries larger than the whole cache are not stored
+    cache.Insert(b, true, MakeMsg(4 * msg_size));
+    BOOST_CHECK(!cache.Get(b, true));
+
+    BlockMsgCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.entries, 3U);
+    BOOST_CHECK_EQUAL(stats.bytes, 3 * msg_size);
+    BOOST_CHECK_EQUAL(stats.max_bytes, 3 * msg_size);
+    BOOST_CHECK_EQUAL(stats.hits, 5U);
+    BOOST_CHECK_EQUAL(stats.misses, 4U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_get_block_msg)
+{
+    g_block_msg_cache = MakeUnique<BlockMsgCache>(1 << 20);
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = ::ChainActive().Tip();
+    }
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+
+    for (bool witness : {true, false}) {
+        CDataStream expected(SER_NETWORK, PROTOCOL_VERSION | (witness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+        expected << block;
+
+        std::shared_ptr<const CSharedNetMsg> msg = GetBlockMsg(pindex, witness, Params());
+        BOOST_CHECK(msg);
+        BOOST_CHECK_EQUAL(msg->command, NetMsgType::BLOCK);
+        BOOST_CHECK(std::equal(msg->data->begin(), msg->data->end(), expected.begin()) && msg->data->size() == expected.size());
+
+        // The second request is served from the cache
+        BOOST_CHECK(GetBlockMsg(pindex, witness, Params()) == msg);
+    }
+    BOOST_CHECK_EQUAL(g_block_msg_cache->GetStats().hits, 2U);
+    g_block_msg_cache.reset();
+}
+
+BOOST_AUTO_TEST_CASE(strip_raw_block_witness)
+{
+    CBlock block;
+    block.nVersion = 42;
+    block.hashPrevBlock = InsecureRand256();
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        tx.vin[0].prevout = COutPoint(InsecureRand256(), i);
+        tx.vin[0].scriptSig = CScript() << OP_TRUE;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000 * i;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        // Middle transaction without witness, the others with
+        if (i != 1) {
+            tx.vin[1].scriptWitness.stack.push_back(std::vector<unsigned char>(300, 0xcd));
+            tx.vin[1].scriptWitness.stack.push_back(std::vector<unsigned char>(1, 0x01));
+        }
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+
+    CDataStream with_witness(SER_NETWORK, PROTOCOL_VERSION);
+    with_witness << block;
+    CDataStream without_witness(SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+    without_witness << block;
+
+    std::vector<uint8_t> raw(with_witness.begin(), with_witness.end());
+    std::vector<uint8_t> stripped;
+    BOOST_CHECK(StripRawBlockWitness(raw, stripped));
+    BOOST_CHECK(stripped == std::vector<uint8_t>(without_witness.begin(), without_witness.end()));
+
+    // Stripping is idempotent
+    std::vector<uint8_t> stripped_again;
+    BOOST_CHECK(StripRawBlockWitness(stripped, stripped_again));
+    BOOST_CHECK(stripped_again == stripped);
+
+    // Truncated and padded data are rejected
+    std::vector<uint8_t> truncated(raw.begin(), raw.end() - 1);
+    BOOST_CHECK(!StripRawBlockWitness(truncated, stripped));
+    BOOST_CHECK(stripped.empty());
+    raw.push_back(0);
+    BOOST_CHECK(!StripRawBlockWitness(raw, stripped));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -258,6 +258,16 @@ BOOST_FIXTURE_TEST_CASE(blockfilter_index_initial_sync, TestChain100Setup)
     BOOST_CHECK_EQUAL(filters.size(), tip->nHeight + 1);
     BOOST_CHECK_EQUAL(filter_hashes.size(), tip->nHeight + 1);
 
+    // Filters read in one run from disk, from the cache, or a mix of both
+    // match those looked up one by one.
+    for (const CBlockIndex* block_index = tip; block_index; block_index = block_index->pprev) {
+        BlockFilter filter;
+        BOOST_CHECK(filter_index.LookupFilter(block_index, filter));
+        BOOST_CHECK_EQUAL(filters[block_index->nHeight].GetBlockHash(), block_index->GetBlockHash());
+        BOOST_CHECK_EQUAL(filters[block_index->nHeight].GetHash(), filter.GetHash());
+        BOOST_CHECK_EQUAL(filter_hashes[block_index->nHeight], filter.GetHash());
+    }
+
     filters.clear();
     filter_hashes.clear();
 
@@ -265,6 +275,45 @@ BOOST_FIXTURE_TEST_CASE(blockfilter_index_initial_sync, TestChain100Setup)
     filter_index.Stop();
 }
 
+BOOST_FIXTURE_TEST_CASE(blockfilter_index_uncached_range, TestChain100Setup)
+{
+    // Without a filter cache, every range lookup reads its filters from disk.
+    BlockFilterIndex filter_index(BlockFilterType::BASIC, 1 << 20, true, false, 0);
+    filter_index.Start();
+
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!filter_index.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    const CBlockIndex* tip;
+    {
+        LOCK(cs_main);
+        tip = ::ChainActive().Tip();
+    }
+
+    // Read the whole chain in one run, and a range starting mid-file.
+    for (int start_height : {0, 37}) {
+        std::vector<BlockFilter> filters;
+        BOOST_CHECK(filter_index.LookupFilterRange(start_height, tip, filters));
+        BOOST_REQUIRE_EQUAL(filters.size(), tip->nHeight - start_height + 1);
+        for (const CBlockIndex* block_index = tip;
+             block_index && block_index->nHeight >= start_height;
+             block_index = block_index->pprev) {
+            BlockFilter expected_filter;
+            BOOST_REQUIRE(ComputeFilter(BlockFilterType::BASIC, block_index, expected_filter));
+            const BlockFilter& filter = filters[block_index->nHeight - start_height];
+            BOOST_CHECK_EQUAL(filter.GetBlockHash(), block_index->GetBlockHash());
+            BOOST_CHECK_EQUAL(filter.GetHash(), expected_filter.GetHash());
+        }
+    }
+
+    filter_index.Interrupt();
+    filter_index.Stop();
+}
+
 BOOST_FIXTURE_TEST_CASE(blockfilter_index_init_destroy, BasicTestingSetup)
 {
     SetDataDir("tempdir");
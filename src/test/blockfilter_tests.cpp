@@ -37,6 +37,14 @@ BOOST_AUTO_TEST_CASE(gcsfilter_test)
         BOOST_CHECK(filter.MatchAny(excluded_elements));
         excluded_elements.erase(insertion.first);
     }
+
+    // Encodings with missing or excess data are rejected.
+    std::vector<unsigned char> encoded = filter.GetEncoded();
+    BOOST_CHECK_NO_THROW(GCSFilter(filter.GetParams(), encoded));
+    encoded.push_back(0);
+    BOOST_CHECK_THROW(GCSFilter(filter.GetParams(), encoded), std::ios_base::failure);
+    encoded.resize(encoded.size() - 2);
+    BOOST_CHECK_THROW(GCSFilter(filter.GetParams(), encoded), std::ios_base::failure);
 }
 
 BOOST_AUTO_TEST_CASE(gcsfilter_default_constructor)
@@ -125,6 +133,52 @@ BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
     BOOST_CHECK(default_ctor_block_filter_1.GetEncodedFilter() == default_ctor_block_filter_2.GetEncodedFilter());
 }
 
+BOOST_AUTO_TEST_CASE(blockfilter_match_any_test)
+{
+    // Three blocks paying to a script of their own, and an empty block.
+    std::vector<CScript> scripts(3);
+    std::vector<BlockFilter> filters;
+    for (size_t i = 0; i < scripts.size(); ++i) {
+        scripts[i] << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+        CMutableTransaction tx;
+        tx.vout.emplace_back(100, scripts[i]);
+        CBlock block;
+        block.nNonce = i;
+        block.vtx.push_back(MakeTransactionRef(tx));
+        filters.emplace_back(BlockFilterType::BASIC, block, CBlockUndo());
+    }
+    CBlock empty_block;
+    empty_block.nNonce = scripts.size();
+    filters.emplace_back(BlockFilterType::BASIC, empty_block, CBlockUndo());
+    BOOST_CHECK_EQUAL(filters.back().GetFilter().GetN(), 0);
+
+    GCSFilter::ElementSet elements;
+    for (int i = 0; i < 100; ++i) {
+        GCSFilter::Element element(32);
+        element[0] = i;
+        elements.insert(std::move(element));
+    }
+
+    // Results agree with MatchAny on each filter.
+    auto match_each = [&] {
+        std::vector<size_t> matches;
+        for (size_t i = 0; i < filters.size(); ++i) {
+            if (filters[i].GetFilter().MatchAny(elements)) matches.push_back(i);
+        }
+        return matches;
+    };
+    BOOST_CHECK(MatchAnyBlockFilter(filters, elements) == match_each());
+
+    elements.emplace(scripts[1].begin(), scripts[1].end());
+    std::vector<size_t> matches = MatchAnyBlockFilter(filters, elements);
+    BOOST_CHECK(matches == match_each());
+    BOOST_CHECK(std::find(matches.begin(), matches.end(), 1) != matches.end());
+    BOOST_CHECK(std::find(matches.begin(), matches.end(), 3) == matches.end());
+
+    BOOST_CHECK(MatchAnyBlockFilter(filters, GCSFilter::ElementSet()).empty());
+}
+
 BOOST_AUTO_TEST_CASE(blockfilters_json_test)
 {
     UniValue json;
@@ -412,6 +412,22 @@ BOOST_AUTO_TEST_CASE(merkle_block_4)
     BOOST_CHECK(vMatched.size() == merkleBlock.vMatchedTxn.size());
     for (unsigned int i = 0; i < vMatched.size(); i++)
         BOOST_CHECK(vMatched[i] == merkleBlock.vMatchedTxn[i].second);
+
+    // Building from precomputed block data gives the same merkle block and
+    // updates the filter in the same way
+    CFilteredBlockData filtered_block_data(std::make_shared<const CBlock>(block));
+    CBloomFilter filter2(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter2.insert(uint256S("0x0a2a92f0bda4727d0a13eaddf4dd9ac6b5c61a1429e6b2b818f19b15df0ac154"));
+    filter2.insert(uint256S("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"));
+    CBloomFilter filter3 = filter2;
+    CMerkleBlock merkleBlock2(block, filter2);
+    CMerkleBlock merkleBlock3(filtered_block_data, filter3);
+    BOOST_CHECK(merkleBlock3.vMatchedTxn == merkleBlock2.vMatchedTxn);
+
+    CDataStream merkleStream2(SER_NETWORK, PROTOCOL_VERSION), merkleStream3(SER_NETWORK, PROTOCOL_VERSION);
+    merkleStream2 << merkleBlock2 << filter2;
+    merkleStream3 << merkleBlock3 << filter3;
+    BOOST_CHECK(merkleStream2.str() == merkleStream3.str());
 }
 
 BOOST_AUTO_TEST_CASE(merkle_block_4_test_p2pubkey_only)
@@ -435,6 +451,15 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_p2pubkey_only)
     BOOST_CHECK(filter.contains(COutPoint(uint256S("0x147caa76786596590baa4e98f5d9f48b86c7765e489f7a6ff3360fe5c674360b"), 0)));
     // ... but not the 4th transaction's output (its not pay-2-pubkey)
     BOOST_CHECK(!filter.contains(COutPoint(uint256S("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
+
+    // The same holds when matching from precomputed block data
+    CBloomFilter filter2(10, 0.000001, 0, BLOOM_UPDATE_P2PUBKEY_ONLY);
+    filter2.insert(ParseHex("04eaafc2314def4ca98ac970241bcab022b9c1e1f4ea423a20f134c876f2c01ec0f0dd5b2e86e7168cefe0d81113c3807420ce13ad1357231a2252247d97a46a91"));
+    filter2.insert(ParseHex("b6efd80d99179f4f4ff6f4dd0a007d018c385d21"));
+    CMerkleBlock merkleBlock2(CFilteredBlockData(std::make_shared<const CBlock>(block)), filter2);
+    BOOST_CHECK(merkleBlock2.vMatchedTxn == merkleBlock.vMatchedTxn);
+    BOOST_CHECK(filter2.contains(COutPoint(uint256S("0x147caa76786596590baa4e98f5d9f48b86c7765e489f7a6ff3360fe5c674360b"), 0)));
+    BOOST_CHECK(!filter2.contains(COutPoint(uint256S("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
 BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
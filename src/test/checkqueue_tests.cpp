@@ -58,6 +58,22 @@ struct FailingCheck {
     };
 };
 
+struct IndexedFailingCheck {
+    size_t index;
+    bool fails;
+    IndexedFailingCheck(size_t _index, bool _fails) : index(_index), fails(_fails){};
+    IndexedFailingCheck() : index(0), fails(false){};
+    bool operator()()
+    {
+        return !fails;
+    }
+    void swap(IndexedFailingCheck& x)
+    {
+        std::swap(index, x.index);
+        std::swap(fails, x.fails);
+    };
+};
+
 struct UniqueCheck {
     static std::mutex m;
     static std::unordered_multiset<size_t> results;
@@ -138,6 +154,7 @@ std::atomic<size_t> MemoryCheck::fake_allocated_memory{0};
 typedef CCheckQueue<FakeCheckCheckCompletion> Correct_Queue;
 typedef CCheckQueue<FakeCheck> Standard_Queue;
 typedef CCheckQueue<FailingCheck> Failing_Queue;
+typedef CCheckQueue<IndexedFailingCheck> IndexedFailing_Queue;
 typedef CCheckQueue<UniqueCheck> Unique_Queue;
 typedef CCheckQueue<MemoryCheck> Memory_Queue;
 typedef CCheckQueue<FrozenCleanupCheck> FrozenCleanup_Queue;
@@ -268,6 +285,45 @@ BOOST_AUTO_TEST_CASE(test_CheckQueue_Recovers_From_Failure)
     tg.join_all();
 }
 
+// Test that the failing check is handed back to the master, and that a
+// successful run after it doesn't report a stale failure.
+BOOST_AUTO_TEST_CASE(test_CheckQueue_Returns_Failed_Check)
+{
+    auto fail_queue = std::unique_ptr<IndexedFailing_Queue>(new IndexedFailing_Queue {QUEUE_BATCH_SIZE});
+    boost::thread_group tg;
+    for (auto x = 0; x < nScriptCheckThreads; ++x) {
+       tg.create_thread([&]{fail_queue->Thread();});
+    }
+
+    for (size_t failing : {0, 37, 999}) {
+        {
+            CCheckQueueControl<IndexedFailingCheck> control(fail_queue.get());
+            std::vector<IndexedFailingCheck> vChecks;
+            for (size_t i = 0; i < 1000; ++i) {
+                vChecks.emplace_back(i, i == failing);
+            }
+            control.Add(vChecks);
+            IndexedFailingCheck failed;
+            BOOST_REQUIRE(!control.Wait(&failed));
+            BOOST_CHECK(failed.fails);
+            BOOST_CHECK_EQUAL(failed.index, failing);
+        }
+        {
+            CCheckQueueControl<IndexedFailingCheck> control(fail_queue.get());
+            std::vector<IndexedFailingCheck> vChecks;
+            for (size_t i = 0; i < 1000; ++i) {
+                vChecks.emplace_back(i, false);
+            }
+            control.Add(vChecks);
+            IndexedFailingCheck failed;
+            BOOST_REQUIRE(control.Wait(&failed));
+            BOOST_CHECK(!failed.fails);
+        }
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
 // Test that unique checks are actually all called individually, rather than
 // just one check being called repeatedly. Test that checks are not called
 // more than once as well
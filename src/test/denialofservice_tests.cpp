@@ -5,9 +5,13 @@
 // Unit tests for denial-of-service detection/prevention code
 
 #include <chainparams.h>
+#include <consensus/merkle.h>
+#include <hash.h>
 #include <keystore.h>
 #include <net.h>
 #include <net_processing.h>
+#include <netmessagemaker.h>
+#include <node/txorphanage.h>
 #include <pow.h>
 #include <script/sign.h>
 #include <serialize.h>
@@ -21,18 +25,8 @@
 #include <boost/test/unit_test.hpp>
 
 // Tests these internal-to-net_processing.cpp methods:
-extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 extern void Misbehaving(NodeId nodeid, int howmuch, const std::string& message="");
 
-struct COrphanTx {
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-
 static CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -44,6 +38,54 @@ static NodeId id = 0;
 
 void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds);
 
+/** Queue msg on node as if it had been received from the network. */
+static void ReceiveMessage(CNode& node, CSerializedNetMsg&& msg)
+{
+    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), msg.data.size());
+    uint256 hash = Hash(msg.data.begin(), msg.data.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+
+    LOCK(node.cs_vProcessMsg);
+    node.vProcessMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    CNetMessage& received = node.vProcessMsg.back();
+    BOOST_REQUIRE_EQUAL(received.readHeader(ssHeader.data(), ssHeader.size()), (int)ssHeader.size());
+    if (!msg.data.empty()) {
+        BOOST_REQUIRE_EQUAL(received.readData(reinterpret_cast<const char*>(msg.data.data()), msg.data.size()), (int)msg.data.size());
+    }
+    BOOST_REQUIRE(received.complete());
+    node.nProcessQueueSize += received.vRecv.size() + CMessageHeader::HEADER_SIZE;
+}
+
+/** Build count valid blocks on top of tip, without processing them. */
+static std::vector<CBlock> BuildBlocks(const CBlockIndex* tip, int count)
+{
+    std::vector<CBlock> blocks;
+    uint256 prev_hash = tip->GetBlockHash();
+    for (int i = 1; i <= count; i++) {
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vin[0].prevout.SetNull();
+        coinbase.vin[0].scriptSig = CScript() << (tip->nHeight + i) << OP_0;
+        coinbase.vout.resize(1);
+        coinbase.vout[0].nValue = 0;
+        coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+        CBlock block;
+        block.nVersion = 4;
+        block.hashPrevBlock = prev_hash;
+        block.nTime = tip->GetBlockTime() + i;
+        block.nBits = tip->nBits;
+        block.vtx.push_back(MakeTransactionRef(coinbase));
+        block.hashMerkleRoot = BlockMerkleRoot(block);
+        while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())) ++block.nNonce;
+        prev_hash = block.GetHash();
+        blocks.push_back(block);
+    }
+    return blocks;
+}
+
 BOOST_FIXTURE_TEST_SUITE(denialofservice_tests, TestingSetup)
 
 // Test eviction of an outbound peer whose chain never advances
@@ -321,14 +363,9 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     peerLogic->FinalizeNode(dummyNode.GetId(), dummy);
 }
 
-static CTransactionRef RandomOrphan()
+static CTransactionRef RandomOrphan(const std::vector<CTransactionRef>& orphans)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    LOCK(cs_main);
-    it = mapOrphanTransactions.lower_bound(InsecureRand256());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return orphans[InsecureRandRange(orphans.size())];
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -338,6 +375,9 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    TxOrphanage orphanage;
+    std::vector<CTransactionRef> orphans;
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
@@ -350,13 +390,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(PKHash(key.GetPubKey()));
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        orphans.push_back(MakeTransactionRef(tx));
+        orphanage.AddTx(orphans.back(), i);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(orphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -372,13 +413,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         BOOST_CHECK(SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL));
 >>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        orphans.push_back(MakeTransactionRef(tx));
+        orphanage.AddTx(orphans.back(), i);
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(orphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -396,25 +438,182 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
+        BOOST_CHECK(!orphanage.AddTx(MakeTransactionRef(tx), i));
     }
 
-    LOCK(cs_main);
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
-    }
-
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+        size_t sizeBefore = orphanage.Size();
+        orphanage.EraseForPeer(i);
+        BOOST_CHECK(orphanage.Size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanage.CountForPeer(i), 0U);
+    }
+
+    // Test LimitOrphans() function:
+    orphanage.LimitOrphans(40, DEFAULT_MAX_ORPHAN_WEIGHT);
+    BOOST_CHECK(orphanage.Size() <= 40);
+    orphanage.LimitOrphans(10, DEFAULT_MAX_ORPHAN_WEIGHT);
+    BOOST_CHECK(orphanage.Size() <= 10);
+    orphanage.LimitOrphans(0, DEFAULT_MAX_ORPHAN_WEIGHT);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanage.TotalWeight(), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(block_download_window, TestChain100Setup)
+{
+    auto chain_height = [] {
+        LOCK(cs_main);
+        return ::ChainActive().Height();
+    };
+    std::vector<CBlock> blocks;
+    {
+        LOCK(cs_main);
+        blocks = BuildBlocks(::ChainActive().Tip(), 20);
+    }
+    const int base_height = chain_height();
+    std::vector<CBlock> headers;
+    for (const CBlock& block : blocks) {
+        headers.push_back(CBlock(block.GetBlockHeader()));
+    }
+
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    std::atomic<bool> interrupt(false);
+    std::vector<CNode*> peers;
+    for (int i = 0; i < 2; i++) {
+        CAddress addr(ip(0xa0b0c005 + i), NODE_NONE);
+        peers.push_back(new CNode(id++, ServiceFlags(NODE_NETWORK), 0, INVALID_SOCKET, addr, 0, 0, CAddress(), "", /*fInboundIn=*/ false));
+        peers.back()->SetSendVersion(PROTOCOL_VERSION);
+        peers.back()->SetRecvVersion(PROTOCOL_VERSION);
+        peerLogic->InitializeNode(peers.back());
+        peers.back()->nVersion = 1;
+        peers.back()->fSuccessfullyConnected = true;
+    }
+    CNode& slow = *peers[0];
+    CNode& fast = *peers[1];
+    auto send_messages = [&](CNode& node) {
+        LOCK2(cs_main, node.cs_sendProcessing);
+        peerLogic->SendMessages(&node);
+    };
+    auto stats = [](const CNode& node) {
+        CNodeStateStats state_stats;
+        BOOST_REQUIRE(GetNodeStateStats(node.GetId(), state_stats));
+        return state_stats;
+    };
+
+    // The slow peer announces the blocks first and gets a full initial window.
+    const int64_t start_time = GetTime();
+    SetMockTime(start_time);
+    ReceiveMessage(slow, msgMaker.Make(NetMsgType::HEADERS, headers));
+    peerLogic->ProcessMessages(&slow, interrupt);
+    send_messages(slow);
+    BOOST_CHECK_EQUAL(stats(slow).vHeightInFlight.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(stats(slow).nMaxBlocksInFlight, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Its first block takes 10 seconds: the window shrinks to the minimum.
+    SetMockTime(start_time + 10);
+    ReceiveMessage(slow, msgMaker.Make(NetMsgType::BLOCK, blocks[0]));
+    peerLogic->ProcessMessages(&slow, interrupt);
+    BOOST_CHECK_EQUAL(chain_height(), base_height + 1);
+    BOOST_CHECK_EQUAL(stats(slow).nMaxBlocksInFlight, 2);
+    BOOST_CHECK_EQUAL(stats(slow).vHeightInFlight.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER - 1);
+
+    // The fast peer gets the rest and delivers at once: its window grows.
+    // Until it has delivered something, nothing is taken over from the slow
+    // peer.
+    ReceiveMessage(fast, msgMaker.Make(NetMsgType::HEADERS, headers));
+    peerLogic->ProcessMessages(&fast, interrupt);
+    send_messages(fast);
+    const size_t rest = blocks.size() - MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    BOOST_CHECK_EQUAL(stats(fast).vHeightInFlight.size(), rest);
+    BOOST_CHECK_EQUAL(stats(fast).vHeightInFlight.front(), base_height + MAX_BLOCKS_IN_TRANSIT_PER_PEER + 1);
+    for (size_t i = MAX_BLOCKS_IN_TRANSIT_PER_PEER; i < blocks.size(); i++) {
+        ReceiveMessage(fast, msgMaker.Make(NetMsgType::BLOCK, blocks[i]));
+        peerLogic->ProcessMessages(&fast, interrupt);
+    }
+    BOOST_CHECK_EQUAL(stats(fast).nMaxBlocksInFlight, 64);
+    BOOST_CHECK(stats(fast).vHeightInFlight.empty());
+
+    // Nothing is left for the fast peer to fetch, so the lowest block still
+    // in flight at the slow peer is requested from it instead.
+    send_messages(fast);
+    BOOST_CHECK(stats(fast).vHeightInFlight == std::vector<int>{base_height + 2});
+    BOOST_CHECK_EQUAL(stats(slow).vHeightInFlight.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER - 2);
+    BOOST_CHECK_EQUAL(stats(slow).nBlocksReRequested, 1U);
+
+    // Once it arrives, the chain moves on.
+    ReceiveMessage(fast, msgMaker.Make(NetMsgType::BLOCK, blocks[1]));
+    peerLogic->ProcessMessages(&fast, interrupt);
+    BOOST_CHECK_EQUAL(chain_height(), base_height + 2);
+
+    SetMockTime(0);
+    bool dummy;
+    for (CNode* node : peers) {
+        peerLogic->FinalizeNode(node->GetId(), dummy);
+        delete node;
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(orphan_reconsider_bounded, TestChain100Setup)
+{
+    // The parent below gets more in-mempool children than the default allows.
+    gArgs.ForceSetArg("-limitdescendantcount", "100");
+
+    CAddress addr(ip(0xa0b0c004), NODE_NONE);
+    CNode dummyNode(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, CAddress(), "", /*fInboundIn=*/ true);
+    dummyNode.SetSendVersion(PROTOCOL_VERSION);
+    dummyNode.SetRecvVersion(PROTOCOL_VERSION);
+    peerLogic->InitializeNode(&dummyNode);
+    dummyNode.nVersion = 1;
+    dummyNode.fSuccessfullyConnected = true;
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+
+    // A parent with more outputs than one orphan batch, spending a mature coinbase.
+    const size_t num_children = MAX_ORPHAN_RECONSIDER_BATCH + 10;
+    const CScript coinbase_script = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].prevout = COutPoint(m_coinbase_txns[0]->GetHash(), 0);
+    parent.vout.resize(num_children);
+    for (CTxOut& txout : parent.vout) {
+        txout.nValue = COIN;
+        txout.scriptPubKey = CScript() << OP_TRUE;
+    }
+    std::vector<unsigned char> vchSig;
+    const uint256 sighash = SignatureHash(coinbase_script, parent, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    BOOST_CHECK(coinbaseKey.Sign(sighash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    parent.vin[0].scriptSig << vchSig;
+
+    // Its children arrive first and become orphans.
+    std::atomic<bool> interrupt(false);
+    for (size_t i = 0; i < num_children; i++) {
+        CMutableTransaction child;
+        child.vin.resize(1);
+        child.vin[0].prevout = COutPoint(parent.GetHash(), i);
+        child.vout.resize(1);
+        child.vout[0].nValue = COIN - 10 * CENT;
+        child.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        ReceiveMessage(dummyNode, msgMaker.Make(NetMsgType::TX, CTransaction(child)));
+        peerLogic->ProcessMessages(&dummyNode, interrupt);
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    // Accepting the parent queues all children, but each call only offers a
+    // bounded batch of them and reports that more work is left.
+    ReceiveMessage(dummyNode, msgMaker.Make(NetMsgType::TX, CTransaction(parent)));
+    BOOST_CHECK(!peerLogic->ProcessMessages(&dummyNode, interrupt));
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+    BOOST_CHECK(peerLogic->ProcessMessages(&dummyNode, interrupt));
+    BOOST_CHECK_EQUAL(mempool.size(), 1 + MAX_ORPHAN_RECONSIDER_BATCH);
+    BOOST_CHECK(!peerLogic->ProcessMessages(&dummyNode, interrupt));
+    BOOST_CHECK_EQUAL(mempool.size(), 1 + num_children);
+    BOOST_CHECK(!dummyNode.fDisconnect);
+
+    bool dummy;
+    peerLogic->FinalizeNode(dummyNode.GetId(), dummy);
+    mempool.clear();
+    gArgs.ForceSetArg("-limitdescendantcount", std::to_string(DEFAULT_DESCENDANT_LIMIT));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,191 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <node/headerssync.h>
+#include <pow.h>
+#include <primitives/block.h>
+#include <utiltime.h>
+
+#include <test/setup_common.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+
+struct RegtestingSetup : public BasicTestingSetup {
+    RegtestingSetup() : BasicTestingSetup(CBaseChainParams::REGTEST) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(headerssync_tests, RegtestingSetup)
+
+static std::vector<CBlockHeader> MakeChain(int length)
+{
+    std::vector<CBlockHeader> chain(length);
+    for (int i = 0; i < length; i++) {
+        chain[i].nTime = 1231006505 + i;
+        chain[i].nBits = 0x207fffff;
+        if (i > 0) chain[i].hashPrevBlock = chain[i - 1].GetHash();
+        while (!CheckProofOfWork(chain[i].GetHash(), chain[i].nBits, Params().GetConsensus())) ++chain[i].nNonce;
+    }
+    return chain;
+}
+
+static std::vector<CBlockHeader> Range(const std::vector<CBlockHeader>& chain, int begin, int end)
+{
+    return std::vector<CBlockHeader>(chain.begin() + begin, chain.begin() + end);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_anchor_parsing)
+{
+    int height;
+    uint256 hash;
+    const std::string hex = "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f";
+    BOOST_CHECK(ParseHeadersAnchor("11111:" + hex, height, hash));
+    BOOST_CHECK_EQUAL(height, 11111);
+    BOOST_CHECK_EQUAL(hash.GetHex(), hex);
+    BOOST_CHECK(!ParseHeadersAnchor(hex, height, hash));
+    BOOST_CHECK(!ParseHeadersAnchor("-1:" + hex, height, hash));
+    BOOST_CHECK(!ParseHeadersAnchor("11111:" + hex.substr(1), height, hash));
+    BOOST_CHECK(!ParseHeadersAnchor("11111:" + hex.substr(1) + "g", height, hash));
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_segments)
+{
+    const std::vector<CBlockHeader> chain = MakeChain(31);
+    const Consensus::Params& consensus = Params().GetConsensus();
+    HeadersSyncSegments segments;
+    for (int height : {0, 10, 20, 30}) {
+        segments.AddAnchor(height, chain[height].GetHash());
+    }
+    // Anchors at or below our best header don't start a segment.
+    BOOST_CHECK_EQUAL(segments.Start(5), 2U);
+    BOOST_CHECK_EQUAL(segments.Start(0), 2U);
+
+    // Segments go to peers that have them, lowest first, one per peer.
+    uint256 locator_hash, stop_hash;
+    BOOST_CHECK(!segments.Assign(0, 15, locator_hash, stop_hash));
+    BOOST_CHECK(segments.Assign(0, 30, locator_hash, stop_hash));
+    BOOST_CHECK(locator_hash == chain[10].GetHash());
+    BOOST_CHECK(stop_hash == chain[20].GetHash());
+    BOOST_CHECK(!segments.Assign(0, 30, locator_hash, stop_hash));
+    BOOST_CHECK(segments.Assign(1, 30, locator_hash, stop_hash));
+    BOOST_CHECK(locator_hash == chain[20].GetHash());
+    BOOST_CHECK(!segments.Assign(2, 30, locator_hash, stop_hash));
+
+    // Headers that don't continue the peer's segment are left alone.
+    BOOST_CHECK(segments.AddHeaders(2, Range(chain, 11, 15), consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::NOT_SEGMENT);
+    BOOST_CHECK(segments.AddHeaders(0, Range(chain, 1, 5), consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::NOT_SEGMENT);
+
+    // A partial answer asks for the rest of the segment.
+    BOOST_CHECK(segments.AddHeaders(0, Range(chain, 11, 15), consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::BUFFERED);
+    BOOST_CHECK(locator_hash == chain[14].GetHash());
+    BOOST_CHECK(stop_hash == chain[20].GetHash());
+    // Headers past the end anchor are not taken.
+    BOOST_CHECK(segments.AddHeaders(0, Range(chain, 15, 25), consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::BUFFERED);
+    BOOST_CHECK(locator_hash.IsNull());
+    BOOST_CHECK(!segments.HasSegment(0));
+    BOOST_CHECK_EQUAL(segments.BufferedCount(), 10U);
+
+    // Headers are only handed out once the chain reaches the segment start.
+    std::set<uint256> known;
+    auto have_header = [&known](const uint256& hash) { return known.count(hash) != 0; };
+    std::vector<CBlockHeader> ready;
+    NodeId from_peer;
+    BOOST_CHECK(!segments.PopReady(have_header, ready, from_peer));
+    for (int i = 0; i <= 10; i++) known.insert(chain[i].GetHash());
+    BOOST_CHECK(segments.PopReady(have_header, ready, from_peer));
+    BOOST_CHECK_EQUAL(ready.size(), 10U);
+    BOOST_CHECK(ready.front().GetHash() == chain[11].GetHash());
+    BOOST_CHECK(ready.back().GetHash() == chain[20].GetHash());
+    BOOST_CHECK_EQUAL(from_peer, 0);
+    BOOST_CHECK_EQUAL(segments.Size(), 1U);
+    BOOST_CHECK_EQUAL(segments.BufferedCount(), 0U);
+
+    // A broken chain is invalid, and the peer isn't given another segment.
+    std::vector<CBlockHeader> broken = Range(chain, 21, 25);
+    broken[2] = chain[28];
+    BOOST_CHECK(segments.AddHeaders(1, broken, consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::INVALID);
+    BOOST_CHECK(!segments.HasSegment(1));
+    BOOST_CHECK(segments.HasFailed(1));
+    BOOST_CHECK(!segments.Assign(1, 30, locator_hash, stop_hash));
+
+    // A disconnected peer's buffered headers are kept for the next peer.
+    BOOST_CHECK(segments.Assign(2, 30, locator_hash, stop_hash));
+    BOOST_CHECK(segments.AddHeaders(2, Range(chain, 21, 25), consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::BUFFERED);
+    segments.DisconnectedPeer(2);
+    BOOST_CHECK(segments.Assign(3, 30, locator_hash, stop_hash));
+    BOOST_CHECK(locator_hash == chain[24].GetHash());
+
+    // Segments overtaken by the headers chain are dropped.
+    for (int i = 11; i <= 30; i++) known.insert(chain[i].GetHash());
+    BOOST_CHECK(!segments.PopReady(have_header, ready, from_peer));
+    BOOST_CHECK_EQUAL(segments.Size(), 0U);
+    BOOST_CHECK(!segments.HasSegment(3));
+    BOOST_CHECK_EQUAL(segments.BufferedCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_timeout)
+{
+    const std::vector<CBlockHeader> chain = MakeChain(21);
+    const Consensus::Params& consensus = Params().GetConsensus();
+    HeadersSyncSegments segments;
+    segments.AddAnchor(10, chain[10].GetHash());
+    segments.AddAnchor(20, chain[20].GetHash());
+    BOOST_CHECK_EQUAL(segments.Start(0), 1U);
+
+    uint256 locator_hash, stop_hash;
+    BOOST_CHECK(segments.Assign(0, 20, locator_hash, stop_hash));
+    BOOST_CHECK(!segments.Assign(1, 20, locator_hash, stop_hash));
+
+    // A peer answering with nothing doesn't have the segment.
+    BOOST_CHECK(segments.AddHeaders(0, {}, consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::NOT_SEGMENT);
+    BOOST_CHECK(segments.HasFailed(0));
+    BOOST_CHECK(segments.Assign(1, 20, locator_hash, stop_hash));
+
+    // A peer that doesn't answer in time loses the segment.
+    const int64_t timeout_time = GetTime() + HEADERS_SEGMENT_TIMEOUT;
+    SetMockTime(timeout_time);
+    BOOST_CHECK(segments.Assign(2, 20, locator_hash, stop_hash));
+    BOOST_CHECK(!segments.HasSegment(1));
+    BOOST_CHECK(segments.HasFailed(1));
+
+    // Its late answer is recognized for a while; other headers from it aren't.
+    BOOST_CHECK(segments.IsLateAnswer(1, Range(chain, 11, 15)));
+    BOOST_CHECK(!segments.IsLateAnswer(1, Range(chain, 12, 15)));
+    BOOST_CHECK(!segments.IsLateAnswer(2, Range(chain, 11, 15)));
+    SetMockTime(timeout_time + HEADERS_SEGMENT_TIMEOUT);
+    BOOST_CHECK(!segments.IsLateAnswer(1, Range(chain, 11, 15)));
+    BOOST_CHECK(segments.HasFailed(1));
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_proof_of_work)
+{
+    const std::vector<CBlockHeader> chain = MakeChain(21);
+    const Consensus::Params& consensus = Params().GetConsensus();
+    HeadersSyncSegments segments;
+    segments.AddAnchor(10, chain[10].GetHash());
+    segments.AddAnchor(20, chain[20].GetHash());
+    BOOST_CHECK_EQUAL(segments.Start(0), 1U);
+
+    uint256 locator_hash, stop_hash;
+    BOOST_CHECK(segments.Assign(0, 20, locator_hash, stop_hash));
+
+    // A header that connects but lacks its proof of work is not buffered.
+    std::vector<CBlockHeader> headers = Range(chain, 11, 15);
+    while (CheckProofOfWork(headers[3].GetHash(), headers[3].nBits, consensus)) ++headers[3].nNonce;
+    BOOST_CHECK(segments.AddHeaders(0, headers, consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::INVALID);
+    BOOST_CHECK(!segments.HasSegment(0));
+    BOOST_CHECK(segments.HasFailed(0));
+    BOOST_CHECK_EQUAL(segments.BufferedCount(), 0U);
+
+    // The segment is fetched from its start again by another peer.
+    BOOST_CHECK(segments.Assign(1, 20, locator_hash, stop_hash));
+    BOOST_CHECK(locator_hash == chain[10].GetHash());
+    BOOST_CHECK(segments.AddHeaders(1, Range(chain, 11, 15), consensus, locator_hash, stop_hash) == HeadersSyncSegments::Result::BUFFERED);
+    BOOST_CHECK_EQUAL(segments.BufferedCount(), 4U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -749,4 +749,78 @@ BOOST_AUTO_TEST_CASE(MempoolAncestryTests)
     BOOST_CHECK_EQUAL(descendants, 6ULL);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    // Empty pool
+    std::shared_ptr<const MempoolSnapshot> snapshot = pool.GetSnapshot();
+    BOOST_CHECK(snapshot->entries.empty());
+    BOOST_CHECK_EQUAL(snapshot->total_tx_size, 0U);
+    // Unchanged pool hands out the same snapshot
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+
+    // [tx1].0 <- [tx2] (signals RBF) <- [tx3]
+    CTransactionRef tx1 = make_tx(/* output_values */ {10 * COIN});
+    CMutableTransaction mtx2 = CMutableTransaction(*make_tx(/* output_values */ {5 * COIN}, /* inputs */ {tx1}));
+    mtx2.vin[0].nSequence = 0;
+    CTransactionRef tx2 = MakeTransactionRef(mtx2);
+    CTransactionRef tx3 = make_tx(/* output_values */ {4 * COIN}, /* inputs */ {tx2});
+    {
+        LOCK(pool.cs);
+        pool.addUnchecked(tx1->GetHash(), entry.Fee(10000LL).FromTx(tx1));
+        pool.addUnchecked(tx2->GetHash(), entry.Fee(20000LL).FromTx(tx2));
+        pool.addUnchecked(tx3->GetHash(), entry.Fee(30000LL).FromTx(tx3));
+    }
+
+    // Readers holding the old snapshot keep seeing the old state
+    BOOST_CHECK(snapshot->entries.empty());
+
+    snapshot = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->entries.size(), 3U);
+    BOOST_CHECK_EQUAL(snapshot->total_tx_size, pool.GetTotalTxSize());
+    BOOST_CHECK_EQUAL(snapshot->usage, pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+
+    // Parents come before children
+    const MempoolSnapshotEntry& e1 = snapshot->entries[0];
+    const MempoolSnapshotEntry& e2 = snapshot->entries[1];
+    const MempoolSnapshotEntry& e3 = snapshot->entries[2];
+    BOOST_CHECK(e1.entry.GetTx().GetHash() == tx1->GetHash());
+    BOOST_CHECK(e2.entry.GetTx().GetHash() == tx2->GetHash());
+    BOOST_CHECK(e3.entry.GetTx().GetHash() == tx3->GetHash());
+
+    BOOST_CHECK(e1.parents.empty());
+    BOOST_CHECK(e1.children == std::vector<uint256>{tx2->GetHash()});
+    BOOST_CHECK(e2.parents == std::vector<uint256>{tx1->GetHash()});
+    BOOST_CHECK(e2.children == std::vector<uint256>{tx3->GetHash()});
+    BOOST_CHECK(e3.parents == std::vector<uint256>{tx2->GetHash()});
+    BOOST_CHECK(e3.children.empty());
+
+    BOOST_CHECK_EQUAL(e1.entry.GetModFeesWithDescendants(), 60000LL);
+    BOOST_CHECK_EQUAL(e3.entry.GetCountWithAncestors(), 3U);
+
+    // Replaceability is inherited from in-mempool ancestors only
+    BOOST_CHECK(!e1.bip125_replaceable);
+    BOOST_CHECK(e2.bip125_replaceable);
+    BOOST_CHECK(e3.bip125_replaceable);
+
+    // Prioritisation changes modified fees, so it publishes a new snapshot
+    pool.PrioritiseTransaction(tx3->GetHash(), 5000LL);
+    std::shared_ptr<const MempoolSnapshot> prioritised = pool.GetSnapshot();
+    BOOST_CHECK(prioritised != snapshot);
+    BOOST_CHECK_EQUAL(prioritised->entries[0].entry.GetModFeesWithDescendants(), 65000LL);
+    BOOST_CHECK_EQUAL(snapshot->entries[0].entry.GetModFeesWithDescendants(), 60000LL);
+
+    {
+        LOCK(pool.cs);
+        pool.removeRecursive(*tx2);
+    }
+    snapshot = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->entries.size(), 1U);
+    BOOST_CHECK(snapshot->entries[0].children.empty());
+    BOOST_CHECK_EQUAL(prioritised->entries.size(), 3U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
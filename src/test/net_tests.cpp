@@ -189,6 +189,414 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CRecvBufferPool pool(1024 * 1024);
+
+    // An empty pool can only miss.
+    CSerializeData buf = pool.Acquire(100 * 1000);
+    BOOST_CHECK(buf.empty());
+    BOOST_CHECK_EQUAL(pool.GetStats().nMisses, 1U);
+    buf.resize(100 * 1000);
+    const size_t nCapacity = buf.capacity();
+
+    // A released buffer is handed out again for any size it can hold.
+    pool.Release(std::move(buf));
+    BOOST_CHECK_EQUAL(pool.GetStats().nPooledBytes, nCapacity);
+    CSerializeData buf2 = pool.Acquire(90 * 1000);
+    BOOST_CHECK(buf2.empty());
+    BOOST_CHECK_EQUAL(buf2.capacity(), nCapacity);
+    BOOST_CHECK_EQUAL(pool.GetStats().nHits, 1U);
+    BOOST_CHECK_EQUAL(pool.GetStats().nPooledBytes, 0U);
+
+    // Too small for the request: miss, and the pooled buffer stays put.
+    pool.Release(std::move(buf2));
+    CSerializeData buf3 = pool.Acquire(nCapacity + 1);
+    BOOST_CHECK_EQUAL(pool.GetStats().nMisses, 2U);
+    BOOST_CHECK_EQUAL(pool.GetStats().nPooledBytes, nCapacity);
+
+    // The pool never holds more than its limit.
+    buf3.resize(1024 * 1024);
+    pool.Release(std::move(buf3));
+    BOOST_CHECK_EQUAL(pool.GetStats().nPooledBytes, nCapacity);
+}
+
+BOOST_AUTO_TEST_CASE(cnode_receive_in_place)
+{
+    std::unique_ptr<CNode> pnode = MakeUnique<CNode>(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress{}, std::string{}, false);
+
+    std::vector<unsigned char> payload(200 * 1000, 0x5a);
+    CMessageHeader hdr(Params().MessageStart(), NetMsgType::BLOCK, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+
+    // Header and the start of the payload arrive through the copying path.
+    char* pch = nullptr;
+    unsigned int nMax = 0x10000;
+    BOOST_CHECK(!pnode->GetRecvBuffer(pch, nMax));
+    bool complete = false;
+    BOOST_CHECK(pnode->ReceiveMsgBytes(ssHeader.data(), ssHeader.size(), complete));
+    BOOST_CHECK(!complete);
+    const char* data = reinterpret_cast<const char*>(payload.data());
+    BOOST_CHECK(pnode->ReceiveMsgBytes(data, 1000, complete));
+
+    // The bulk lands directly in the message buffer until only a small tail is left.
+    size_t nPos = 1000;
+    while (nMax = 0x10000, pnode->GetRecvBuffer(pch, nMax)) {
+        BOOST_CHECK(nMax > 0 && nPos + nMax <= payload.size());
+        memcpy(pch, data + nPos, nMax);
+        BOOST_CHECK(pnode->ReceiveMsgBytesInPlace(nMax, complete));
+        nPos += nMax;
+    }
+    BOOST_CHECK(nPos > 1000);
+    BOOST_CHECK(pnode->ReceiveMsgBytes(data + nPos, payload.size() - nPos, complete));
+    BOOST_CHECK(complete);
+}
+
+BOOST_AUTO_TEST_CASE(net_message_read_batched)
+{
+    // Three messages back to back, as one read would return them.
+    std::vector<std::vector<unsigned char>> payloads{std::vector<unsigned char>(1000, 0x01), {}, std::vector<unsigned char>(70000, 0x02)};
+    const char* commands[] = {NetMsgType::TX, NetMsgType::VERACK, NetMsgType::BLOCK};
+    std::vector<char> wire;
+    for (size_t i = 0; i < payloads.size(); i++) {
+        CMessageHeader hdr(Params().MessageStart(), commands[i], payloads[i].size());
+        uint256 hash = Hash(payloads[i].begin(), payloads[i].end());
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+        CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+        ssHeader << hdr;
+
+        // The fixed layout parser reads what the stream serialized.
+        CMessageHeader parsed(Params().MessageStart());
+        parsed.ReadFromBuffer(reinterpret_cast<const unsigned char*>(ssHeader.data()));
+        BOOST_CHECK_EQUAL(parsed.GetCommand(), commands[i]);
+        BOOST_CHECK_EQUAL(parsed.nMessageSize, payloads[i].size());
+        BOOST_CHECK(memcmp(parsed.pchChecksum, hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+        BOOST_CHECK(parsed.IsValid(Params().MessageStart()));
+
+        wire.insert(wire.end(), ssHeader.begin(), ssHeader.end());
+        wire.insert(wire.end(), payloads[i].begin(), payloads[i].end());
+    }
+
+    // Split the first header across reads, then hand over everything else at once.
+    std::list<CNetMessage> msgs;
+    auto receive = [&](const char* pch, unsigned int nBytes) {
+        while (nBytes > 0) {
+            if (msgs.empty() || msgs.back().complete())
+                msgs.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+            CNetMessage& msg = msgs.back();
+            int handled = msg.in_data ? msg.readData(pch, nBytes) : msg.readHeader(pch, nBytes);
+            BOOST_REQUIRE(handled > 0);
+            pch += handled;
+            nBytes -= handled;
+        }
+    };
+    receive(wire.data(), 5);
+    receive(wire.data() + 5, 10);
+    BOOST_CHECK(!msgs.back().in_data);
+    receive(wire.data() + 15, wire.size() - 15);
+
+    BOOST_CHECK_EQUAL(msgs.size(), payloads.size());
+    size_t i = 0;
+    for (const CNetMessage& msg : msgs) {
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), commands[i]);
+        BOOST_CHECK(msg.GetMessageHash() == Hash(payloads[i].begin(), payloads[i].end()));
+        i++;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(shared_net_msg)
+{
+    std::vector<unsigned char> payload(1000, 0xab);
+    CSerializedNetMsg msg;
+    msg.command = NetMsgType::BLOCK;
+    msg.data = payload;
+    const CSharedNetMsg shared(std::move(msg));
+
+    BOOST_CHECK_EQUAL(shared.command, NetMsgType::BLOCK);
+    BOOST_CHECK(*shared.data == payload);
+    BOOST_CHECK_EQUAL(shared.header->size(), CMessageHeader::HEADER_SIZE);
+
+    CMessageHeader hdr(Params().MessageStart());
+    CDataStream ssHeader(*shared.header, SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::BLOCK);
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    BOOST_CHECK(memcmp(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(send_class)
+{
+    BOOST_CHECK(GetSendClass(NetMsgType::CMPCTBLOCK) == SendClass::CMPCTBLOCK);
+    BOOST_CHECK(GetSendClass(NetMsgType::HEADERS) == SendClass::CMPCTBLOCK);
+    BOOST_CHECK(GetSendClass(NetMsgType::INV) == SendClass::TX);
+    BOOST_CHECK(GetSendClass(NetMsgType::ADDR) == SendClass::ADDR);
+    BOOST_CHECK(GetSendClass(NetMsgType::BLOCK) == SendClass::BLOCK);
+    BOOST_CHECK(GetSendClass(NetMsgType::MERKLEBLOCK) == SendClass::TX);
+    BOOST_CHECK(GetSendClass(NetMsgType::PING) == SendClass::CONTROL);
+
+    SendClass send_class;
+    BOOST_CHECK(GetSendClassByName("block", send_class));
+    BOOST_CHECK(send_class == SendClass::BLOCK);
+    BOOST_CHECK(!GetSendClassByName("ping", send_class));
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket)
+{
+    const int64_t start = 1000000000;
+    CTokenBucket bucket;
+    // The bucket starts full, holding one second's worth.
+    bucket.Refill(1000, start);
+    BOOST_CHECK(bucket.HasTokens());
+    bucket.Consume(999);
+    BOOST_CHECK(bucket.HasTokens());
+    // A message larger than what is left still goes out, leaving the bucket in debt.
+    bucket.Consume(5000);
+    BOOST_CHECK(!bucket.HasTokens());
+    // The debt is paid back at the configured rate.
+    bucket.Refill(1000, start + 4000000);
+    BOOST_CHECK(!bucket.HasTokens());
+    // Time going backwards adds nothing.
+    bucket.Refill(1000, start);
+    BOOST_CHECK(!bucket.HasTokens());
+    bucket.Refill(1000, start + 5000000);
+    BOOST_CHECK(bucket.HasTokens());
+    // The bucket holds at most one second's worth, however long it has been.
+    bucket.Refill(1000, start + 100000000);
+    bucket.Consume(1000);
+    BOOST_CHECK(!bucket.HasTokens());
+}
+
+static CSerializedNetMsg MakeSendMsg(const std::string& command, size_t size)
+{
+    CSerializedNetMsg msg;
+    msg.command = command;
+    msg.data.resize(size);
+    return msg;
+}
+
+// Take everything scheduled for sending as if the socket wrote it, returning the commands in order.
+static std::vector<std::string> DrainSendMsg(CNode& node)
+{
+    std::vector<std::string> commands;
+    LOCK(node.cs_vSend);
+    for (auto it = node.vSendMsg.begin(); it != node.vSendMsg.end(); ++it) {
+        CMessageHeader hdr(Params().MessageStart());
+        hdr.ReadFromBuffer((*it)->data());
+        commands.push_back(hdr.GetCommand());
+        node.nSendSize -= hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+        if (hdr.nMessageSize) ++it;
+    }
+    node.vSendMsg.clear();
+    node.nSendOffset = 0;
+    return commands;
+}
+
+BOOST_AUTO_TEST_CASE(schedule_send_data)
+{
+    // The socket is invalid, so scheduled messages stay in vSendMsg.
+    CConnman connman(0x1337, 0x1337);
+    connman.Init(CConnman::Options());
+    std::unique_ptr<CNode> pnode = MakeUnique<CNode>(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress{}, std::string{}, false);
+
+    // A large block fills the send buffer, so what follows waits in its class queue.
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::BLOCK, 100 * 1000));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::BLOCK, 1000));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::INV, 37), SendClass::BLOCK);
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::MERKLEBLOCK, 200));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::TX, 250));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::ADDR, 31));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::CMPCTBLOCK, 500));
+    BOOST_CHECK(DrainSendMsg(*pnode) == std::vector<std::string>({NetMsgType::BLOCK}));
+
+    // Classes go out in priority order, each in the order it was queued: the
+    // ping overtakes the block, but the inv queued with the block stays behind
+    // it, and the transaction stays behind the merkle block.
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::PING, 8));
+    BOOST_CHECK(DrainSendMsg(*pnode) == std::vector<std::string>({NetMsgType::CMPCTBLOCK, NetMsgType::PING, NetMsgType::MERKLEBLOCK, NetMsgType::TX, NetMsgType::ADDR, NetMsgType::BLOCK, NetMsgType::INV}));
+    BOOST_CHECK_EQUAL(pnode->nSendQueuedSize, 0U);
+    BOOST_CHECK_EQUAL(pnode->nSendSize, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(schedule_send_data_rate_limited)
+{
+    CConnman::Options options;
+    options.m_peer_upload_rate = 10000;
+    options.m_peer_class_upload_rate[(int)SendClass::ADDR] = 1000;
+    CConnman connman(0x1337, 0x1337);
+    connman.Init(options);
+    std::unique_ptr<CNode> pnode = MakeUnique<CNode>(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress{}, std::string{}, false);
+
+    // The first block goes out on the full buckets, leaving the peer in debt.
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::BLOCK, 100 * 1000));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::ADDR, 2000));
+    BOOST_CHECK(DrainSendMsg(*pnode) == std::vector<std::string>({NetMsgType::BLOCK}));
+
+    // Rate limited classes are held in their queues; control messages are not.
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::BLOCK, 1000));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::INV, 37));
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::PING, 8));
+    BOOST_CHECK(DrainSendMsg(*pnode) == std::vector<std::string>({NetMsgType::PING}));
+    BOOST_CHECK_EQUAL(pnode->vSendQueue[(int)SendClass::BLOCK].size(), 1U);
+    BOOST_CHECK_EQUAL(pnode->vSendQueue[(int)SendClass::TX].size(), 1U);
+    BOOST_CHECK_EQUAL(pnode->vSendQueue[(int)SendClass::ADDR].size(), 1U);
+    BOOST_CHECK_EQUAL(pnode->nSendQueuedSize, 1000U + 37 + 2000 + 3 * CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(pnode->nSendSize, pnode->nSendQueuedSize);
+
+    // Without the peer limit, only the class limit holds messages back.
+    CConnman::Options class_options;
+    class_options.m_peer_class_upload_rate[(int)SendClass::ADDR] = 1000;
+    CConnman class_connman(0x1337, 0x1337);
+    class_connman.Init(class_options);
+    std::unique_ptr<CNode> pnode2 = MakeUnique<CNode>(1, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress{}, std::string{}, false);
+    class_connman.PushMessage(pnode2.get(), MakeSendMsg(NetMsgType::ADDR, 10000));
+    BOOST_CHECK(DrainSendMsg(*pnode2) == std::vector<std::string>({NetMsgType::ADDR}));
+    class_connman.PushMessage(pnode2.get(), MakeSendMsg(NetMsgType::ADDR, 31));
+    class_connman.PushMessage(pnode2.get(), MakeSendMsg(NetMsgType::BLOCK, 1000));
+    BOOST_CHECK(DrainSendMsg(*pnode2) == std::vector<std::string>({NetMsgType::BLOCK}));
+    BOOST_CHECK_EQUAL(pnode2->vSendQueue[(int)SendClass::ADDR].size(), 1U);
+
+    // Whitelisted peers are not limited.
+    pnode->fWhitelisted = true;
+    connman.PushMessage(pnode.get(), MakeSendMsg(NetMsgType::PING, 8));
+    BOOST_CHECK(DrainSendMsg(*pnode) == std::vector<std::string>({NetMsgType::PING, NetMsgType::INV, NetMsgType::ADDR, NetMsgType::BLOCK}));
+    BOOST_CHECK_EQUAL(pnode->nSendQueuedSize, 0U);
+}
+
+static CNetAddr ResolveIP(const std::string& ip)
+{
+    CNetAddr addr;
+    LookupHost(ip.c_str(), addr, false);
+    return addr;
+}
+
+BOOST_AUTO_TEST_CASE(net_stats)
+{
+    CNetStats stats;
+    BOOST_CHECK(stats.GetMsgStats().empty());
+
+    stats.RecordRecv(NetMsgType::TX, 300);
+    stats.RecordRecv(NetMsgType::TX, 200);
+    stats.RecordSend(NetMsgType::INV, 61);
+    stats.RecordRecv("unknown", 24);
+    stats.RecordProcessed(NetMsgType::TX, 0);
+    stats.RecordProcessed(NetMsgType::TX, 3);
+    stats.RecordProcessed(NetMsgType::TX, 1000000000);
+
+    std::map<std::string, CNetMsgStats> msg_stats = stats.GetMsgStats();
+    BOOST_CHECK_EQUAL(msg_stats.size(), 3U);
+    const CNetMsgStats& tx = msg_stats[NetMsgType::TX];
+    BOOST_CHECK_EQUAL(tx.nMsgsRecv, 2U);
+    BOOST_CHECK_EQUAL(tx.nBytesRecv, 500U);
+    BOOST_CHECK_EQUAL(tx.nMsgsSent, 0U);
+    BOOST_CHECK_EQUAL(tx.nProcessTimeMicros, 1000000003U);
+    BOOST_CHECK_EQUAL(tx.vProcessTimeHistogram[0], 1U);
+    BOOST_CHECK_EQUAL(tx.vProcessTimeHistogram[2], 1U);
+    BOOST_CHECK_EQUAL(tx.vProcessTimeHistogram[CNetMsgStats::TIME_BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(msg_stats[NetMsgType::INV].nBytesSent, 61U);
+    BOOST_CHECK_EQUAL(msg_stats["*other*"].nMsgsRecv, 1U);
+
+    // Connections are summed up per address.
+    CPeerNetStats conn;
+    conn.addr = ResolveIP("1.2.3.4");
+    conn.fConnected = true;
+    conn.nConnections = 1;
+    conn.nLastSeen = 100;
+    conn.nBytesSent = 1000;
+    conn.nSendQueue = 10;
+    conn.nMaxSendQueue = 5000;
+    stats.RecordDisconnect(conn);
+    conn.nLastSeen = 200;
+    conn.nMaxSendQueue = 3000;
+    stats.RecordDisconnect(conn);
+
+    std::map<CNetAddr, CPeerNetStats> peer_stats = stats.GetPeerStats();
+    BOOST_CHECK_EQUAL(peer_stats.size(), 1U);
+    const CPeerNetStats& peer = peer_stats[conn.addr];
+    BOOST_CHECK(peer.addr == conn.addr);
+    BOOST_CHECK(!peer.fConnected);
+    BOOST_CHECK_EQUAL(peer.nConnections, 2U);
+    BOOST_CHECK_EQUAL(peer.nLastSeen, 200);
+    BOOST_CHECK_EQUAL(peer.nBytesSent, 2000U);
+    BOOST_CHECK_EQUAL(peer.nSendQueue, 0U);
+    BOOST_CHECK_EQUAL(peer.nMaxSendQueue, 5000U);
+
+    // The address seen longest ago is forgotten first.
+    for (size_t i = 1; i < CNetStats::MAX_PEERS; i++) {
+        conn.addr = ResolveIP(strprintf("10.0.%d.%d", i / 256, i % 256));
+        conn.nLastSeen = 1000 + i;
+        stats.RecordDisconnect(conn);
+    }
+    BOOST_CHECK_EQUAL(stats.GetPeerStats().size(), CNetStats::MAX_PEERS);
+    conn.addr = ResolveIP("5.6.7.8");
+    stats.RecordDisconnect(conn);
+    peer_stats = stats.GetPeerStats();
+    BOOST_CHECK_EQUAL(peer_stats.size(), CNetStats::MAX_PEERS);
+    BOOST_CHECK(!peer_stats.count(ResolveIP("1.2.3.4")));
+    BOOST_CHECK(peer_stats.count(ResolveIP("5.6.7.8")));
+}
+
+BOOST_AUTO_TEST_CASE(tx_announce_queue)
+{
+    CTxAnnounceQueue queue;
+    std::vector<uint256> txids;
+    const uint256 a = InsecureRand256(), b = InsecureRand256(), c = InsecureRand256();
+
+    // Nothing is queued without peers.
+    queue.Push(a);
+    queue.Seal([](std::vector<uint256>&) {});
+    BOOST_CHECK_EQUAL(queue.LogSize(), 0U);
+
+    queue.AddPeer(0);
+    queue.AddPeer(1);
+    queue.Push(a);
+    queue.Push(b);
+    queue.Push(c);
+    // Pending txids are not visible until sealed, in sorted order.
+    BOOST_CHECK_EQUAL(queue.Get(0, 10, txids), 0U);
+    BOOST_CHECK(txids.empty());
+    queue.Seal([&](std::vector<uint256>& batch) {
+        BOOST_CHECK_EQUAL(batch.size(), 3U);
+        batch = {c, a};
+    });
+    BOOST_CHECK_EQUAL(queue.Get(0, 10, txids), 0U);
+    BOOST_CHECK(txids == std::vector<uint256>({c, a}));
+
+    // Each peer walks the log from its own cursor.
+    BOOST_CHECK_EQUAL(queue.Get(1, 1, txids), 0U);
+    BOOST_CHECK(txids == std::vector<uint256>({c}));
+    queue.SetCursor(1, 1);
+    BOOST_CHECK_EQUAL(queue.Get(1, 10, txids), 1U);
+    BOOST_CHECK(txids == std::vector<uint256>({a}));
+
+    // Entries every peer went through are pruned on the next seal.
+    queue.SetCursor(0, 2);
+    queue.SetCursor(1, 2);
+    queue.Push(b);
+    queue.Seal([](std::vector<uint256>&) {});
+    BOOST_CHECK_EQUAL(queue.LogSize(), 1U);
+    BOOST_CHECK_EQUAL(queue.Get(0, 10, txids), 2U);
+    BOOST_CHECK(txids == std::vector<uint256>({b}));
+
+    // A new peer only sees what is relayed after it connected.
+    queue.AddPeer(2);
+    BOOST_CHECK_EQUAL(queue.Get(2, 10, txids), 3U);
+    BOOST_CHECK(txids.empty());
+    queue.SkipToEnd(0);
+    BOOST_CHECK_EQUAL(queue.Get(0, 10, txids), 3U);
+    BOOST_CHECK(txids.empty());
+
+    queue.RemovePeer(0);
+    queue.RemovePeer(1);
+    queue.RemovePeer(2);
+    BOOST_CHECK_EQUAL(queue.LogSize(), 0U);
+}
+
 // prior to PR #14728, this test triggers an undefined behavior
 BOOST_AUTO_TEST_CASE(ipv4_peer_with_ipv6_addrMe_test)
 {
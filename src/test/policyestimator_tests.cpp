@@ -12,6 +12,8 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+
 BOOST_FIXTURE_TEST_SUITE(policyestimator_tests, BasicTestingSetup)
 
 BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
@@ -178,6 +180,117 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     for (int i = 2; i < 9; i++) { // At 9, the original estimate was already at the bottom (b/c scale = 2)
         BOOST_CHECK(feeEst.estimateFee(i).GetFeePerK() < origFeeEst[i-1] - deltaFee);
     }
+
+    // Cached smart fee estimates (precomputed targets and targets cached on
+    // first use alike) return the same answer and calculation details
+    for (int target : {2, 6, 7}) {
+        for (bool conservative : {false, true}) {
+            FeeCalculation calc1, calc2;
+            CFeeRate est1 = feeEst.estimateSmartFee(target, &calc1, conservative);
+            CFeeRate est2 = feeEst.estimateSmartFee(target, &calc2, conservative);
+            BOOST_CHECK(est1 == est2);
+            BOOST_CHECK(est1 == feeEst.estimateSmartFee(target, nullptr, conservative));
+            BOOST_CHECK(calc1.reason == calc2.reason);
+            BOOST_CHECK_EQUAL(calc1.desiredTarget, target);
+            BOOST_CHECK_EQUAL(calc1.returnedTarget, calc2.returnedTarget);
+            BOOST_CHECK_EQUAL(calc1.est.pass.withinTarget, calc2.est.pass.withinTarget);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesCache)
+{
+    // Two estimators follow the same mempool activity. One is queried after
+    // every block, so its answers come from the cache whenever it can use
+    // one; the other is only queried at the end, computing its answers from
+    // the same state. A stale cache entry shows up as a difference.
+    CBlockPolicyEstimator cachedEst, freshEst;
+    CTxMemPool cachedPool(&cachedEst), freshPool(&freshEst);
+    LOCK2(cachedPool.cs, freshPool.cs);
+    TestMemPoolEntryHelper entry;
+    const std::vector<int> targets{1, 2, 3, 7, 12, 20, 48};
+
+    CScript garbage;
+    for (unsigned int i = 0; i < 128; i++)
+        garbage.push_back('X');
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = garbage;
+    tx.vout.resize(1);
+    tx.vout[0].nValue=0LL;
+
+    auto add_txs = [&](int blocknum) {
+        std::vector<CTransactionRef> added;
+        for (int j = 0; j < 10; j++) { // For each fee multiple
+            for (int k = 0; k < 4; k++) { // add 4 fee txs
+                tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+                uint256 hash = tx.GetHash();
+                cachedPool.addUnchecked(hash, entry.Fee(2000 * (j+1)).Time(GetTime()).Height(blocknum).FromTx(tx));
+                freshPool.addUnchecked(hash, entry.Fee(2000 * (j+1)).Time(GetTime()).Height(blocknum).FromTx(tx));
+                added.push_back(cachedPool.get(hash));
+            }
+        }
+        return added;
+    };
+
+    std::vector<CTransactionRef> block;
+    std::vector<CTransactionRef> pending;
+    int blocknum = 0;
+    while (blocknum < 60) {
+        std::vector<CTransactionRef> added = add_txs(blocknum);
+        pending.insert(pending.end(), added.begin(), added.end());
+        // Higher fee txs are mined sooner; the rest wait a few blocks.
+        for (auto it = pending.begin(); it != pending.end();) {
+            const int j = ((*it)->vin[0].prevout.n % 10000) / 100;
+            if (j >= 9 - blocknum % 10) {
+                block.push_back(*it);
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        cachedPool.removeForBlock(block, blocknum + 1);
+        freshPool.removeForBlock(block, blocknum + 1);
+        block.clear();
+        ++blocknum;
+        // Tracked transactions leaving the mempool without a block change the stats too.
+        if (blocknum % 5 == 0 && !pending.empty()) {
+            cachedPool.removeRecursive(*pending.front());
+            freshPool.removeRecursive(*pending.front());
+            pending.erase(pending.begin());
+        }
+        for (int target : targets) {
+            cachedEst.estimateFee(target);
+            cachedEst.estimateSmartFee(target, nullptr, false);
+            cachedEst.estimateSmartFee(target, nullptr, true);
+        }
+    }
+
+    std::vector<CFeeRate> cachedFees;
+    for (int target : targets) {
+        BOOST_CHECK(cachedEst.estimateFee(target) == freshEst.estimateFee(target));
+        for (bool conservative : {false, true}) {
+            FeeCalculation cachedCalc, freshCalc;
+            cachedFees.push_back(cachedEst.estimateSmartFee(target, &cachedCalc, conservative));
+            BOOST_CHECK(cachedFees.back() == freshEst.estimateSmartFee(target, &freshCalc, conservative));
+            BOOST_CHECK(cachedCalc.reason == freshCalc.reason);
+            BOOST_CHECK_EQUAL(cachedCalc.returnedTarget, freshCalc.returnedTarget);
+            BOOST_CHECK_EQUAL(cachedCalc.est.pass.withinTarget, freshCalc.est.pass.withinTarget);
+        }
+    }
+    BOOST_CHECK(std::count(cachedFees.begin(), cachedFees.end(), CFeeRate(0)) < (long)cachedFees.size());
+
+    // New transactions don't change the estimates; until the next block,
+    // calls keep returning the cached values.
+    add_txs(blocknum);
+    size_t i = 0;
+    for (int target : targets) {
+        for (bool conservative : {false, true}) {
+            FeeCalculation calc;
+            BOOST_CHECK(cachedEst.estimateSmartFee(target, &calc, conservative) == cachedFees[i++]);
+            BOOST_CHECK_EQUAL(calc.desiredTarget, target);
+        }
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
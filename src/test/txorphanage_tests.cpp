@@ -0,0 +1,137 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <consensus/validation.h>
+#include <node/txorphanage.h>
+#include <primitives/block.h>
+#include <primitives/transaction.h>
+#include <script/script.h>
+
+#include <test/setup_common.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txorphanage_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(const COutPoint& prevout, unsigned int num_outputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(num_outputs);
+    for (CTxOut& txout : tx.vout) {
+        txout.nValue = 1 * CENT;
+        txout.scriptPubKey = CScript() << OP_TRUE;
+    }
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(txorphanage_peer_accounting)
+{
+    TxOrphanage orphanage;
+    std::vector<CTransactionRef> txs;
+    for (int i = 0; i < 6; i++) {
+        txs.push_back(MakeTx(COutPoint(InsecureRand256(), 0)));
+        BOOST_CHECK(orphanage.AddTx(txs.back(), i % 2));
+    }
+    BOOST_CHECK(!orphanage.AddTx(txs[0], 1));
+    BOOST_CHECK_EQUAL(orphanage.Size(), 6U);
+    BOOST_CHECK_EQUAL(orphanage.CountForPeer(0), 3U);
+    BOOST_CHECK_EQUAL(orphanage.WeightForPeer(1), 3 * GetTransactionWeight(*txs[1]));
+    BOOST_CHECK_EQUAL(orphanage.TotalWeight(), orphanage.WeightForPeer(0) + orphanage.WeightForPeer(1));
+
+    BOOST_CHECK_EQUAL(orphanage.EraseTx(txs[0]->GetHash()), 1);
+    BOOST_CHECK_EQUAL(orphanage.EraseTx(txs[0]->GetHash()), 0);
+    BOOST_CHECK(!orphanage.HaveTx(txs[0]->GetHash()));
+    BOOST_CHECK_EQUAL(orphanage.EraseForPeer(1), 3);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 2U);
+    BOOST_CHECK_EQUAL(orphanage.TotalWeight(), orphanage.WeightForPeer(0));
+
+    // Orphans spending outputs created or conflicted by a block are dropped.
+    CBlock block;
+    block.vtx.push_back(MakeTx(txs[2]->vin[0].prevout));
+    BOOST_CHECK_EQUAL(orphanage.EraseForBlock(block), 1);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(txorphanage_weight_eviction)
+{
+    TxOrphanage orphanage;
+    // Peer 0 floods the pool; peer 1 has a single orphan.
+    std::vector<CTransactionRef> flood;
+    for (int i = 0; i < 20; i++) {
+        flood.push_back(MakeTx(COutPoint(InsecureRand256(), 0)));
+        orphanage.AddTx(flood.back(), 0);
+    }
+    CTransactionRef honest = MakeTx(COutPoint(InsecureRand256(), 0));
+    orphanage.AddTx(honest, 1);
+    const int64_t weight = GetTransactionWeight(*honest);
+
+    // Evictions come from the heaviest peer, oldest first.
+    BOOST_CHECK_EQUAL(orphanage.LimitOrphans(100, 10 * weight), 11U);
+    BOOST_CHECK(orphanage.HaveTx(honest->GetHash()));
+    BOOST_CHECK(!orphanage.HaveTx(flood[10]->GetHash()));
+    BOOST_CHECK(orphanage.HaveTx(flood[11]->GetHash()));
+    BOOST_CHECK_EQUAL(orphanage.CountForPeer(0), 9U);
+    BOOST_CHECK(orphanage.TotalWeight() <= 10 * weight);
+
+    // The count limit is applied the same way.
+    BOOST_CHECK_EQUAL(orphanage.LimitOrphans(2, 10 * weight), 8U);
+    BOOST_CHECK_EQUAL(orphanage.CountForPeer(0), 1U);
+    BOOST_CHECK(orphanage.HaveTx(honest->GetHash()));
+
+    // Orphans expire.
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    BOOST_CHECK_EQUAL(orphanage.LimitOrphans(100, 10 * weight), 0U);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0U);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(txorphanage_work_set)
+{
+    TxOrphanage orphanage;
+    // A parent with a chain of ten orphans spending it, sent by peer 0,
+    // and an orphan spending another of its outputs, sent by peer 1.
+    CTransactionRef parent = MakeTx(COutPoint(InsecureRand256(), 0), 2);
+    std::vector<CTransactionRef> chain{MakeTx(COutPoint(parent->GetHash(), 0))};
+    for (int i = 1; i < 10; i++) {
+        chain.push_back(MakeTx(COutPoint(chain.back()->GetHash(), 0)));
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        orphanage.AddTx(*it, 0);
+    }
+    CTransactionRef other = MakeTx(COutPoint(parent->GetHash(), 1));
+    orphanage.AddTx(other, 1);
+
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(0));
+    orphanage.AddChildrenToWorkSet(*parent);
+    BOOST_CHECK(orphanage.HaveTxToReconsider(0));
+    BOOST_CHECK(orphanage.HaveTxToReconsider(1));
+
+    // The chain comes out parents first, a bounded batch at a time.
+    std::vector<std::pair<CTransactionRef, NodeId>> batch = orphanage.GetTxsToReconsider(0, 4);
+    BOOST_CHECK_EQUAL(batch.size(), 4U);
+    for (size_t i = 0; i < batch.size(); i++) {
+        BOOST_CHECK(batch[i].first == chain[i]);
+        BOOST_CHECK_EQUAL(batch[i].second, 0);
+        orphanage.EraseTx(batch[i].first->GetHash());
+    }
+    BOOST_CHECK(orphanage.HaveTxToReconsider(0));
+    batch = orphanage.GetTxsToReconsider(0, 100);
+    BOOST_CHECK_EQUAL(batch.size(), 6U);
+    BOOST_CHECK(batch[0].first == chain[4]);
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(0));
+
+    batch = orphanage.GetTxsToReconsider(1, 100);
+    BOOST_CHECK_EQUAL(batch.size(), 1U);
+    BOOST_CHECK(batch[0].first == other);
+
+    // Erasing a queued orphan removes it from the work set.
+    orphanage.AddChildrenToWorkSet(*parent);
+    orphanage.EraseForPeer(1);
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
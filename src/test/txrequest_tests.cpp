@@ -0,0 +1,98 @@
+// Copyright (c) 2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <node/txrequest.h>
+#include <uint256.h>
+
+#include <test/setup_common.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txrequest_tests, BasicTestingSetup)
+
+static bool Contains(const std::vector<uint256>& v, const uint256& hash)
+{
+    return std::find(v.begin(), v.end(), hash) != v.end();
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_dedup_and_expiry)
+{
+    TxRequestTracker tracker;
+    const uint256 txhash = InsecureRand256();
+
+    tracker.ReceivedInv(0, txhash, true, 100);
+    tracker.ReceivedInv(1, txhash, true, 100);
+    tracker.ReceivedInv(1, txhash, true, 50); // duplicate announcement is ignored
+    BOOST_CHECK_EQUAL(tracker.Size(), 2U);
+    BOOST_CHECK_EQUAL(tracker.Count(1), 1U);
+
+    // Nothing is requestable before its request time.
+    BOOST_CHECK(tracker.GetRequestable(0, 99).empty());
+
+    // Both announcers are candidates, but only one gets to request it.
+    BOOST_CHECK(Contains(tracker.GetRequestable(0, 100), txhash));
+    tracker.RequestedTx(0, txhash, 200);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(0), 1U);
+    BOOST_CHECK(tracker.GetRequestable(1, 150).empty());
+
+    // Once the request expires, the other announcer takes over.
+    BOOST_CHECK(Contains(tracker.GetRequestable(1, 200), txhash));
+    BOOST_CHECK_EQUAL(tracker.Count(0), 0U);
+    tracker.RequestedTx(1, txhash, 300);
+
+    // A response (e.g. notfound) also frees the txid for other announcers.
+    tracker.ReceivedInv(2, txhash, false, 200);
+    BOOST_CHECK(tracker.GetRequestable(2, 250).empty());
+    tracker.ReceivedResponse(1, txhash);
+    BOOST_CHECK(Contains(tracker.GetRequestable(2, 250), txhash));
+
+    tracker.ForgetTxHash(txhash);
+    BOOST_CHECK_EQUAL(tracker.Size(), 0U);
+    BOOST_CHECK_EQUAL(tracker.Count(2), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_preferred)
+{
+    TxRequestTracker tracker;
+    const uint256 txhash = InsecureRand256();
+
+    // A non-preferred peer doesn't request while a preferred announcer is ready...
+    tracker.ReceivedInv(0, txhash, false, 100);
+    tracker.ReceivedInv(1, txhash, true, 150);
+    BOOST_CHECK(Contains(tracker.GetRequestable(0, 120), txhash));
+    BOOST_CHECK(tracker.GetRequestable(0, 150).empty());
+    BOOST_CHECK(Contains(tracker.GetRequestable(1, 150), txhash));
+
+    // ...but falls back once the preferred peer is gone.
+    tracker.DisconnectedPeer(1);
+    BOOST_CHECK(Contains(tracker.GetRequestable(0, 150), txhash));
+}
+
+BOOST_AUTO_TEST_CASE(txrequest_order_and_disconnect)
+{
+    TxRequestTracker tracker;
+    std::vector<uint256> hashes;
+    for (int i = 0; i < 10; ++i) {
+        hashes.push_back(InsecureRand256());
+        tracker.ReceivedInv(7, hashes.back(), true, 1000 - i);
+    }
+    // Returned in order of request time.
+    std::vector<uint256> requestable = tracker.GetRequestable(7, 1000);
+    std::reverse(requestable.begin(), requestable.end());
+    BOOST_CHECK(requestable == hashes);
+
+    for (int i = 0; i < 5; ++i) tracker.RequestedTx(7, hashes[i], 2000);
+    BOOST_CHECK_EQUAL(tracker.Count(7), 10U);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(7), 5U);
+    BOOST_CHECK_EQUAL(tracker.GetRequestable(7, 1000).size(), 5U);
+
+    tracker.DisconnectedPeer(7);
+    BOOST_CHECK_EQUAL(tracker.Size(), 0U);
+    BOOST_CHECK_EQUAL(tracker.CountInFlight(7), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
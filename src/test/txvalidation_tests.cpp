@@ -10,7 +10,9 @@
 #include <txmempool.h>
 #include <amount.h>
 #include <consensus/validation.h>
+#include <key.h>
 #include <primitives/transaction.h>
+#include <script/interpreter.h>
 #include <script/script.h>
 #include <test/setup_common.h>
 
@@ -59,4 +61,99 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK(state.GetReason() == ValidationInvalidReason::CONSENSUS);
 }
 
+/**
+ * Ensure that transactions whose script checks are spread over the
+ * script-checking threads are accepted and rejected like serially checked ones.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_parallel_script_checks, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const unsigned int num_inputs = MEMPOOL_PARALLEL_SCRIPT_CHECK_MIN_INPUTS * 2;
+
+    auto sign_input = [&](CMutableTransaction& tx, unsigned int n) {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, tx, n, SIGHASH_ALL, 0, SigVersion::BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[n].scriptSig = CScript() << vchSig;
+    };
+
+    // Split a mature coinbase output into many outputs...
+    CMutableTransaction split;
+    split.nVersion = 1;
+    split.vin.resize(1);
+    split.vin[0].prevout = COutPoint(m_coinbase_txns[0]->GetHash(), 0);
+    split.vout.resize(num_inputs);
+    for (CTxOut& txout : split.vout) {
+        txout.nValue = m_coinbase_txns[0]->vout[0].nValue / (num_inputs + 1);
+        txout.scriptPubKey = scriptPubKey;
+    }
+    sign_input(split, 0);
+
+    // ...and spend all of them in one transaction.
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(num_inputs);
+    for (unsigned int i = 0; i < num_inputs; i++) {
+        spend.vin[i].prevout = COutPoint(split.GetHash(), i);
+    }
+    spend.vout.resize(1);
+    spend.vout[0].nValue = split.vout[0].nValue * num_inputs / 2;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    for (unsigned int i = 0; i < num_inputs; i++) {
+        sign_input(spend, i);
+    }
+
+    // Reuse another input's signature for the last input, which makes it invalid
+    CMutableTransaction bad_spend(spend);
+    bad_spend.vin[num_inputs - 1].scriptSig = bad_spend.vin[0].scriptSig;
+
+    LOCK(cs_main);
+
+    CValidationState state;
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(split),
+                nullptr /* pfMissingInputs */, nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+
+    BOOST_CHECK(nScriptCheckThreads > 0);
+    CValidationState parallel_state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, parallel_state, MakeTransactionRef(bad_spend),
+                nullptr /* pfMissingInputs */, nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+
+    const int script_check_threads = nScriptCheckThreads;
+    nScriptCheckThreads = 0;
+    CValidationState serial_state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, serial_state, MakeTransactionRef(bad_spend),
+                nullptr /* pfMissingInputs */, nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+    nScriptCheckThreads = script_check_threads;
+
+    BOOST_CHECK(parallel_state.IsInvalid());
+    BOOST_CHECK_EQUAL(parallel_state.GetRejectReason(), serial_state.GetRejectReason());
+    BOOST_CHECK(parallel_state.GetReason() == serial_state.GetReason());
+
+    // With several bad inputs, the lowest one is reported however the checks
+    // are spread over the threads. Its error differs from the others'.
+    CMutableTransaction multi_bad_spend(bad_spend);
+    multi_bad_spend.vin[2].scriptSig = CScript();
+    for (unsigned int i = num_inputs / 2; i < num_inputs; i++) {
+        multi_bad_spend.vin[i].scriptSig = multi_bad_spend.vin[0].scriptSig;
+    }
+    nScriptCheckThreads = 0;
+    CValidationState multi_serial_state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, multi_serial_state, MakeTransactionRef(multi_bad_spend),
+                nullptr /* pfMissingInputs */, nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+    nScriptCheckThreads = script_check_threads;
+    BOOST_CHECK(multi_serial_state.GetRejectReason() != serial_state.GetRejectReason());
+    for (int run = 0; run < 20; run++) {
+        CValidationState multi_parallel_state;
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, multi_parallel_state, MakeTransactionRef(multi_bad_spend),
+                    nullptr /* pfMissingInputs */, nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+        BOOST_CHECK_EQUAL(multi_parallel_state.GetRejectReason(), multi_serial_state.GetRejectReason());
+        BOOST_CHECK(multi_parallel_state.GetReason() == multi_serial_state.GetReason());
+    }
+
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(spend),
+                nullptr /* pfMissingInputs */, nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+    BOOST_CHECK(mempool.exists(spend.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
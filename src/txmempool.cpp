@@ -18,6 +18,7 @@
 #include <util.h>
 #include <utilmoneystr.h>
 #include <utiltime.h>
+#include <util/rbf.h>
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
@@ -778,6 +779,23 @@ std::vector<CTxMemPool::indexed_transaction_set::const_iterator> CTxMemPool::Get
     return iters;
 }
 
+void CTxMemPool::SortByDepthAndScore(std::vector<uint256>& hashes) const
+{
+    LOCK(cs);
+    setEntries entries; // also drops duplicates, e.g. a txid relayed twice
+    for (const uint256& hash : hashes) {
+        auto it = mapTx.find(hash);
+        if (it != mapTx.end()) entries.insert(it);
+    }
+    std::vector<indexed_transaction_set::const_iterator> iters(entries.begin(), entries.end());
+    std::sort(iters.begin(), iters.end(), DepthAndScoreComparator());
+
+    hashes.clear();
+    for (auto it : iters) {
+        hashes.push_back(it->GetTx().GetHash());
+    }
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid) const
 {
     LOCK(cs);
@@ -792,7 +810,8 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid) const
 }
 
 static TxMempoolInfo GetInfo(CTxMemPool::indexed_transaction_set::const_iterator it) {
-    return TxMempoolInfo{it->GetSharedTx(), it->GetTime(), CFeeRate(it->GetFee(), it->GetTxSize()), it->GetModifiedFee() - it->GetFee()};
+    return TxMempoolInfo{it->GetSharedTx(), it->GetTime(), CFeeRate(it->GetFee(), it->GetTxSize()), it->GetModifiedFee() - it->GetFee(),
+                         it->GetFee(), it->GetCountWithAncestors()};
 }
 
 std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
@@ -827,6 +846,57 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
     return GetInfo(i);
 }
 
+std::shared_ptr<const MempoolSnapshot> CTxMemPool::BuildSnapshot() const
+{
+    LOCK(cs);
+    auto iters = GetSortedDepthAndScore();
+
+    std::shared_ptr<MempoolSnapshot> snapshot = std::make_shared<MempoolSnapshot>();
+    snapshot->sequence = nTransactionsUpdated;
+    snapshot->total_tx_size = totalTxSize;
+    snapshot->usage = DynamicMemoryUsage();
+    snapshot->entries.reserve(iters.size());
+
+    // Entries are sorted parents-first, so the BIP 125 state of all in-mempool
+    // ancestors is known by the time a child is visited.
+    setEntries replaceable;
+    for (txiter it : iters) {
+        snapshot->entries.emplace_back(*it);
+        MempoolSnapshotEntry& snapshot_entry = snapshot->entries.back();
+        bool signals_rbf = SignalsOptInRBF(it->GetTx());
+        const setEntries& parents = GetMemPoolParents(it);
+        snapshot_entry.parents.reserve(parents.size());
+        for (txiter parent : parents) {
+            snapshot_entry.parents.push_back(parent->GetTx().GetHash());
+            signals_rbf = signals_rbf || replaceable.count(parent);
+        }
+        const setEntries& children = GetMemPoolChildren(it);
+        snapshot_entry.children.reserve(children.size());
+        for (txiter child : children) {
+            snapshot_entry.children.push_back(child->GetTx().GetHash());
+        }
+        if (signals_rbf) replaceable.insert(it);
+        snapshot_entry.bip125_replaceable = signals_rbf;
+    }
+
+    return snapshot;
+}
+
+std::shared_ptr<const MempoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    std::shared_ptr<const MempoolSnapshot> snapshot = std::atomic_load(&m_snapshot);
+    if (snapshot && snapshot->sequence == nTransactionsUpdated) return snapshot;
+
+    LOCK(m_snapshot_mutex);
+    // Another reader may have published a fresh snapshot while we were waiting.
+    snapshot = std::atomic_load(&m_snapshot);
+    if (snapshot && snapshot->sequence == nTransactionsUpdated) return snapshot;
+
+    snapshot = BuildSnapshot();
+    std::atomic_store(&m_snapshot, snapshot);
+    return snapshot;
+}
+
 void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeDelta)
 {
     {
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <atomic>
 #include <memory>
 #include <set>
 #include <map>
@@ -336,6 +337,51 @@ struct TxMempoolInfo
 
     /** The fee delta. */
     int64_t nFeeDelta;
+
+    /** The fee of the transaction, excluding the fee delta. */
+    CAmount nFee;
+
+    /** Number of in-mempool ancestors, including the transaction itself. */
+    uint64_t nCountWithAncestors;
+};
+
+/**
+ * Copy of a mempool entry and its in-mempool links, as seen by a MempoolSnapshot.
+ */
+struct MempoolSnapshotEntry
+{
+    explicit MempoolSnapshotEntry(const CTxMemPoolEntry& entry_in) : entry(entry_in), bip125_replaceable(false) {}
+
+    /** The entry itself, including fees, sizes and ancestor/descendant state */
+    CTxMemPoolEntry entry;
+
+    /** Txids of in-mempool parents */
+    std::vector<uint256> parents;
+
+    /** Txids of in-mempool children */
+    std::vector<uint256> children;
+
+    /** Whether the transaction or one of its in-mempool ancestors signals BIP 125 replaceability */
+    bool bip125_replaceable;
+};
+
+/**
+ * Immutable view of the whole mempool, built under the mempool lock and then
+ * shared between readers (RPC, REST) that serialize it without holding the lock.
+ */
+struct MempoolSnapshot
+{
+    /** Value of the mempool's transactions-updated counter when the snapshot was taken */
+    unsigned int sequence;
+
+    /** All entries, sorted by depth and score (parents before children) */
+    std::vector<MempoolSnapshotEntry> entries;
+
+    /** Sum of the virtual sizes of all entries */
+    uint64_t total_tx_size;
+
+    /** Dynamic memory usage of the mempool */
+    size_t usage;
 };
 
 /** Reason why a transaction was removed from the mempool,
@@ -441,7 +487,7 @@ class CTxMemPool
 {
 private:
     uint32_t nCheckFrequency GUARDED_BY(cs); //!< Value n means that n times in 2^32 we check.
-    unsigned int nTransactionsUpdated; //!< Used by getblocktemplate to trigger CreateNewBlock() invocation
+    std::atomic<unsigned int> nTransactionsUpdated; //!< Used by getblocktemplate to trigger CreateNewBlock() invocation, and to detect stale snapshots
     CBlockPolicyEstimator* minerPolicyEstimator;
 
     uint64_t totalTxSize;      //!< sum of all mempool tx's virtual sizes. Differs from serialized tx size since witness data is discounted. Defined in BIP 141.
@@ -455,6 +501,13 @@ private:
 
     bool m_is_loaded GUARDED_BY(cs){false};
 
+    /** Last published read snapshot. Accessed with std::atomic_load/std::atomic_store only. */
+    mutable std::shared_ptr<const MempoolSnapshot> m_snapshot;
+    /** Serializes rebuilding of m_snapshot, so concurrent readers of a stale snapshot copy the mempool once */
+    mutable CCriticalSection m_snapshot_mutex;
+
+    std::shared_ptr<const MempoolSnapshot> BuildSnapshot() const;
+
 public:
 
     static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
@@ -592,6 +645,8 @@ public:
     void clear();
     void _clear() EXCLUSIVE_LOCKS_REQUIRED(cs); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
+    /** Sort hashes into the order of CompareDepthAndScore, dropping those not in the mempool. */
+    void SortByDepthAndScore(std::vector<uint256>& hashes) const;
     void queryHashes(std::vector<uint256>& vtxid) const;
     bool isSpent(const COutPoint& outpoint) const;
     unsigned int GetTransactionsUpdated() const;
@@ -700,6 +755,14 @@ public:
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
+    /**
+     * Return a read snapshot of the mempool. If nothing changed since the last
+     * snapshot was taken, it is returned without locking cs; otherwise the
+     * mempool is copied once under cs and the new snapshot is published.
+     * Callers may iterate the result without holding any lock.
+     */
+    std::shared_ptr<const MempoolSnapshot> GetSnapshot() const;
+
     size_t DynamicMemoryUsage() const;
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
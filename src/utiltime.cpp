@@ -53,6 +53,13 @@ int64_t GetTimeMicros()
     return now;
 }
 
+int64_t GetMockableTimeMicros()
+{
+    int64_t mocktime = nMockTime.load(std::memory_order_relaxed);
+    if (mocktime) return mocktime * 1000000;
+    return GetTimeMicros();
+}
+
 int64_t GetSystemTimeInSeconds()
 {
     return GetTimeMicros()/1000000;
@@ -54,6 +54,7 @@
 #include <warnings.h>
 
 #include <future>
+#include <queue>
 #include <sstream>
 #include <string>
 
@@ -569,10 +570,15 @@ static void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool,
     LimitMempoolSize(mempool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags,
+                                  bool cacheFullScriptStore, PrecomputedTransactionData& txdata) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
 // Used to avoid mempool polluting consensus critical paths if CCoinsViewMempool
 // were somehow broken and returning the wrong scriptPubKeys
 static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, const CTxMemPool& pool,
-                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata) {
+                 unsigned int flags, PrecomputedTransactionData& txdata) {
     AssertLockHeld(cs_main);
 
     // pool.cs should be locked already, but go ahead and re-take the lock here
@@ -602,7 +608,7 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
         }
     }
 
-    return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
+    return CheckInputsForMempool(tx, state, view, flags, true, txdata);
 }
 
 /**
@@ -611,10 +617,17 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
  *                                for mempool acceptance. This allows the caller to optionally
  *                                remove the cache additions if the associated transaction ends
  *                                up being rejected by the mempool.
+ * @param[in]  skip_script_checks Do not execute the transaction's scripts. Only for transactions
+ *                                whose scripts are known to have passed against the current tip,
+ *                                such as a mempool.dat snapshot taken at that same tip.
+ * @param[out] added_txs          If not nullptr, the transaction is appended here when accepted
+ *                                instead of being announced through GetMainSignals(), so that
+ *                                the caller can announce a whole batch at once.
  */
 static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache, bool test_accept)
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache, bool test_accept,
+                              bool skip_script_checks, std::vector<CTransactionRef>* added_txs = nullptr)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -963,7 +976,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
+        if (!skip_script_checks && !CheckInputsForMempool(tx, state, view, scriptVerifyFlags, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
@@ -998,7 +1011,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 =======
         unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(::ChainActive().Tip(), chainparams.GetConsensus());
 >>>>>>> 3001cc61cf11e016c403ce83c9cbcfd3efcbcfd9
-        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata)) {
+        if (!skip_script_checks && !CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, txdata)) {
             return error("%s: BUG! PLEASE REPORT THIS! CheckInputs failed against latest-block but not STANDARD flags %s, %s",
                     __func__, hash.ToString(), FormatStateMessage(state));
         }
@@ -1039,7 +1052,11 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         }
     }
 
-    GetMainSignals().TransactionAddedToMempool(ptx);
+    if (added_txs) {
+        added_txs->push_back(ptx);
+    } else {
+        GetMainSignals().TransactionAddedToMempool(ptx);
+    }
 
     return true;
 }
@@ -1047,10 +1064,10 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 /** (try to) add transaction to memory pool with a specified acceptance time **/
 static bool AcceptToMemoryPoolWithTime(const CChainParams& chainparams, CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx,
                         bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                        bool bypass_limits, const CAmount nAbsurdFee, bool test_accept)
+                        bool bypass_limits, const CAmount nAbsurdFee, bool test_accept, bool skip_script_checks = false)
 {
     std::vector<COutPoint> coins_to_uncache;
-    bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache, test_accept);
+    bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache, test_accept, skip_script_checks);
     if (!res) {
         // Remove coins that were not present in the coins cache before calling ATMPW;
         // this is to prevent memory DoS in case we receive a large number of
@@ -1074,6 +1091,99 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, pfMissingInputs, GetTime(), plTxnReplaced, bypass_limits, nAbsurdFee, test_accept);
 }
 
+/**
+ * Order a batch of transactions so that each comes after the transactions of
+ * the batch whose outputs it spends, otherwise keeping the given order.
+ * Returns indices into txs.
+ */
+static std::vector<size_t> SortBatchTopologically(const std::vector<CTransactionRef>& txs)
+{
+    std::map<uint256, size_t> index_by_txid;
+    for (size_t i = 0; i < txs.size(); i++) {
+        index_by_txid.emplace(txs[i]->GetHash(), i);
+    }
+
+    std::vector<size_t> parents_left(txs.size(), 0);
+    std::vector<std::vector<size_t>> children(txs.size());
+    for (size_t i = 0; i < txs.size(); i++) {
+        std::set<size_t> parents;
+        for (const CTxIn& txin : txs[i]->vin) {
+            auto it = index_by_txid.find(txin.prevout.hash);
+            if (it != index_by_txid.end() && it->second != i) {
+                parents.insert(it->second);
+            }
+        }
+        parents_left[i] = parents.size();
+        for (size_t parent : parents) {
+            children[parent].push_back(i);
+        }
+    }
+
+    std::vector<size_t> order;
+    order.reserve(txs.size());
+    std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>> ready;
+    for (size_t i = 0; i < txs.size(); i++) {
+        if (parents_left[i] == 0) ready.push(i);
+    }
+    while (!ready.empty()) {
+        const size_t i = ready.top();
+        ready.pop();
+        order.push_back(i);
+        for (size_t child : children[i]) {
+            if (--parents_left[child] == 0) ready.push(child);
+        }
+    }
+    // A txid commits to the inputs, so spending relations can't form a cycle
+    assert(order.size() == txs.size());
+    return order;
+}
+
+std::vector<bool> AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CValidationState>& states, const std::vector<CTransactionRef>& txs,
+                                          std::vector<bool>& missing_inputs, std::list<CTransactionRef>* plTxnReplaced,
+                                          bool bypass_limits, const std::vector<CAmount>& nAbsurdFees)
+{
+    AssertLockHeld(cs_main);
+    assert(nAbsurdFees.empty() || nAbsurdFees.size() == txs.size());
+    const CChainParams& chainparams = Params();
+    const int64_t nAcceptTime = GetTime();
+
+    std::vector<bool> accepted(txs.size(), false);
+    states.assign(txs.size(), CValidationState());
+    missing_inputs.assign(txs.size(), false);
+
+    std::vector<COutPoint> coins_to_uncache;
+    {
+        LOCK(pool.cs);
+        std::vector<CTransactionRef> added_txs;
+        for (size_t i : SortBatchTopologically(txs)) {
+            bool fMissingInputs = false;
+            std::vector<COutPoint> tx_coins_to_uncache;
+            accepted[i] = AcceptToMemoryPoolWorker(chainparams, pool, states[i], txs[i], &fMissingInputs, nAcceptTime, plTxnReplaced,
+                                                   bypass_limits, nAbsurdFees.empty() ? 0 : nAbsurdFees[i], tx_coins_to_uncache,
+                                                   false /* test_accept */, false /* skip_script_checks */, &added_txs);
+            missing_inputs[i] = fMissingInputs;
+            if (!accepted[i]) {
+                coins_to_uncache.insert(coins_to_uncache.end(), tx_coins_to_uncache.begin(), tx_coins_to_uncache.end());
+            }
+        }
+
+        // A later transaction of the batch may have pushed an earlier one out
+        // of the mempool again; those were already announced as removed.
+        for (const CTransactionRef& tx : added_txs) {
+            if (pool.exists(tx->GetHash())) {
+                GetMainSignals().TransactionAddedToMempool(tx);
+            }
+        }
+    }
+
+    // See AcceptToMemoryPoolWithTime
+    for (const COutPoint& outpoint : coins_to_uncache)
+        pcoinsTip->Uncache(outpoint);
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FlushStateMode::PERIODIC);
+    return accepted;
+}
+
 /**
  * Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock.
  * If blockIndex is provided, the transaction is fetched from the corresponding block.
@@ -1234,6 +1344,131 @@ bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex
     return ReadRawBlockFromDisk(block, block_pos, message_start);
 }
 
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start, bool witness)
+{
+    if (witness) {
+        return ReadRawBlockFromDisk(block, pindex, message_start);
+    }
+    std::vector<uint8_t> block_data;
+    if (!ReadRawBlockFromDisk(block_data, pindex, message_start)) {
+        return false;
+    }
+    if (!StripRawBlockWitness(block_data, block)) {
+        return error("%s: Malformed block data for %s", __func__, pindex->GetBlockHash().ToString());
+    }
+    return true;
+}
+
+namespace {
+/**
+ * Copies a serialized block field by field, leaving out the segwit marker,
+ * flag and witness stacks of each transaction, so the result is exactly
+ * what serializing the block with SERIALIZE_TRANSACTION_NO_WITNESS gives.
+ */
+class RawBlockWitnessStripper
+{
+    const std::vector<uint8_t>& m_in;
+    size_t m_pos;
+    std::vector<uint8_t>& m_out;
+
+    const uint8_t* Take(size_t n)
+    {
+        if (m_in.size() - m_pos < n) {
+            throw std::ios_base::failure("RawBlockWitnessStripper: end of data");
+        }
+        const uint8_t* p = m_in.data() + m_pos;
+        m_pos += n;
+        return p;
+    }
+
+    void Copy(size_t n)
+    {
+        const uint8_t* p = Take(n);
+        m_out.insert(m_out.end(), p, p + n);
+    }
+
+    uint64_t CompactSize(bool copy)
+    {
+        const uint8_t* p = Take(1);
+        if (copy) m_out.push_back(*p);
+        if (*p < 253) return *p;
+        size_t n = *p == 253 ? 2 : *p == 254 ? 4 : 8;
+        p = Take(n);
+        if (copy) m_out.insert(m_out.end(), p, p + n);
+        uint64_t v = 0;
+        for (size_t i = 0; i < n; i++) {
+            v |= uint64_t(p[i]) << (8 * i);
+        }
+        return v;
+    }
+
+    void Transaction()
+    {
+        Copy(4); // nVersion
+        size_t marker_pos = m_out.size();
+        uint64_t n_in = CompactSize(true);
+        bool has_witness = false;
+        if (n_in == 0 && m_pos < m_in.size() && m_in[m_pos] != 0) {
+            // Extended format: drop the marker we just copied, and the flag
+            const uint8_t flags = *Take(1);
+            if (flags != 1) {
+                throw std::ios_base::failure("RawBlockWitnessStripper: unknown transaction optional data");
+            }
+            m_out.resize(marker_pos);
+            has_witness = true;
+            n_in = CompactSize(true);
+        }
+        for (uint64_t i = 0; i < n_in; i++) {
+            Copy(36); // prevout
+            Copy(CompactSize(true)); // scriptSig
+            Copy(4); // nSequence
+        }
+        uint64_t n_out = CompactSize(true);
+        for (uint64_t i = 0; i < n_out; i++) {
+            Copy(8); // nValue
+            Copy(CompactSize(true)); // scriptPubKey
+        }
+        if (has_witness) {
+            for (uint64_t i = 0; i < n_in; i++) {
+                uint64_t n_items = CompactSize(false);
+                for (uint64_t j = 0; j < n_items; j++) {
+                    Take(CompactSize(false));
+                }
+            }
+        }
+        Copy(4); // nLockTime
+    }
+
+public:
+    RawBlockWitnessStripper(const std::vector<uint8_t>& in, std::vector<uint8_t>& out) : m_in(in), m_pos(0), m_out(out) {}
+
+    void Block()
+    {
+        m_out.reserve(m_out.size() + m_in.size());
+        Copy(80); // header
+        uint64_t n_tx = CompactSize(true);
+        for (uint64_t i = 0; i < n_tx; i++) {
+            Transaction();
+        }
+        if (m_pos != m_in.size()) {
+            throw std::ios_base::failure("RawBlockWitnessStripper: trailing data");
+        }
+    }
+};
+} // namespace
+
+bool StripRawBlockWitness(const std::vector<uint8_t>& block, std::vector<uint8_t>& stripped)
+{
+    stripped.clear();
+    try {
+        RawBlockWitnessStripper(block, stripped).Block();
+    } catch (const std::exception&) {
+        stripped.clear();
+        return false;
+    }
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1438,6 +1673,46 @@ void InitScriptExecutionCache() {
             (nElems*sizeof(uint256)) >>20, (nMaxCacheSize*2)>>20, nElems);
 }
 
+/** Key of tx's script executions with flags in the script execution cache. */
+static uint256 ScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
+/** Set state for check, a failed script check of input nIn of tx spending txout. Always returns false. */
+static bool InvalidScriptCheck(const CScriptCheck& check, const CTxOut& txout, const CTransaction& tx, unsigned int nIn, unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata, CValidationState& state)
+{
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-standard DER encodings or non-null dummy
+        // arguments; if so, ensure we return NOT_STANDARD
+        // instead of CONSENSUS to avoid downstream users
+        // splitting the network between upgraded and
+        // non-upgraded nodes by banning CONSENSUS-failing
+        // data providers.
+        CScriptCheck check2(txout, tx, nIn,
+                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
+        if (check2())
+            return state.Invalid(ValidationInvalidReason::TX_NOT_STANDARD, false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+    }
+    // MANDATORY flag failures correspond to
+    // ValidationInvalidReason::CONSENSUS. Because CONSENSUS
+    // failures are the most serious case of validation
+    // failures, we may need to consider using
+    // RECENT_CONSENSUS_CHANGE for any script failure that
+    // could be due to non-upgraded nodes which we may want to
+    // support, to avoid splitting the network (but this
+    // depends on the details of how net_processing handles
+    // such errors).
+    return state.Invalid(ValidationInvalidReason::CONSENSUS, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+}
+
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set.
@@ -1477,11 +1752,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            const uint256 hashCacheEntry = ScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
                 return true;
@@ -1504,30 +1775,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
                 } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, ensure we return NOT_STANDARD
-                        // instead of CONSENSUS to avoid downstream users
-                        // splitting the network between upgraded and
-                        // non-upgraded nodes by banning CONSENSUS-failing
-                        // data providers.
-                        CScriptCheck check2(coin.out, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
-                        if (check2())
-                            return state.Invalid(ValidationInvalidReason::TX_NOT_STANDARD, false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // MANDATORY flag failures correspond to
-                    // ValidationInvalidReason::CONSENSUS. Because CONSENSUS
-                    // failures are the most serious case of validation
-                    // failures, we may need to consider using
-                    // RECENT_CONSENSUS_CHANGE for any script failure that
-                    // could be due to non-upgraded nodes which we may want to
-                    // support, to avoid splitting the network (but this
-                    // depends on the details of how net_processing handles
-                    // such errors).
-                    return state.Invalid(ValidationInvalidReason::CONSENSUS, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+                    return InvalidScriptCheck(check, coin.out, tx, i, flags, cacheSigStore, txdata, state);
                 }
             }
 
@@ -1542,6 +1790,54 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
     return true;
 }
 
+/**
+ * CheckInputs for mempool acceptance. The script checks of transactions with
+ * many inputs are spread over the script-checking threads. The script
+ * execution cache is consulted and, with cacheFullScriptStore, filled just as
+ * CheckInputs does. A failure is reported for the lowest failing input, as
+ * CheckInputs reports it, without checking the inputs above it again.
+ */
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags,
+                                  bool cacheFullScriptStore, PrecomputedTransactionData& txdata)
+{
+    if (!nScriptCheckThreads || tx.vin.size() < MEMPOOL_PARALLEL_SCRIPT_CHECK_MIN_INPUTS) {
+        return CheckInputs(tx, state, view, true, flags, true, cacheFullScriptStore, txdata);
+    }
+
+    // Nothing is queued on a script execution cache hit.
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, cacheFullScriptStore, txdata, &vChecks)) {
+        return false;
+    }
+    if (vChecks.empty()) {
+        return true;
+    }
+
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    CScriptCheck failed_check;
+    if (!control.Wait(&failed_check)) {
+        // Which check fails first on the worker threads depends on timing, and
+        // the remaining checks are skipped after a failure. Check the inputs
+        // below the failed one in order, so the reject reason doesn't depend
+        // on timing; those that passed hit the signature cache.
+        const unsigned int nFailedIn = failed_check.GetInputIndex();
+        for (unsigned int nIn = 0; nIn < nFailedIn; nIn++) {
+            const CTxOut& txout = view.AccessCoin(tx.vin[nIn].prevout).out;
+            CScriptCheck check(txout, tx, nIn, flags, true, &txdata);
+            if (!check())
+                return InvalidScriptCheck(check, txout, tx, nIn, flags, true, txdata, state);
+        }
+        return InvalidScriptCheck(failed_check, view.AccessCoin(tx.vin[nFailedIn].prevout).out, tx, nFailedIn, flags, true, txdata, state);
+    }
+
+    if (cacheFullScriptStore) {
+        AssertLockHeld(cs_main);
+        scriptExecutionCache.insert(ScriptExecutionCacheEntry(tx, flags));
+    }
+    return true;
+}
+
 static bool UndoWriteToDisk(const CBlockUndo& blockundo, FlatFilePos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
@@ -1752,8 +2048,6 @@ static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState&
     return true;
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 <<<<<<< HEAD
 void ThreadScriptCheck() {
     RenameThread("whive-scriptch");
@@ -4901,7 +5195,128 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(::ChainActive().Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+//! Previous mempool.dat format, without tip hash and per-transaction metadata. Still readable.
+static const uint64_t MEMPOOL_DUMP_VERSION_NO_METADATA = 1;
+//! Number of mempool.dat transactions whose scripts are verified in parallel before accepting them
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+
+/**
+ * A transaction record in mempool.dat. Besides what is needed to re-accept
+ * the transaction, the fee and ancestor count it had in the dumping node's
+ * mempool are kept so that the loader can plan its script verification.
+ */
+struct MempoolDumpEntry
+{
+    CTransactionRef tx;
+    int64_t nTime;
+    int64_t nFeeDelta;
+    //! Fee excluding the fee delta, or -1 if unknown
+    CAmount nFee;
+    //! In-mempool ancestors including the transaction itself, or 0 if unknown
+    uint64_t nCountWithAncestors;
+
+    MempoolDumpEntry() : nTime(0), nFeeDelta(0), nFee(-1), nCountWithAncestors(0) {}
+    explicit MempoolDumpEntry(const TxMempoolInfo& info) : tx(info.tx), nTime(info.nTime), nFeeDelta(info.nFeeDelta), nFee(info.nFee), nCountWithAncestors(info.nCountWithAncestors) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(tx);
+        READWRITE(nTime);
+        READWRITE(nFeeDelta);
+        READWRITE(nFee);
+        READWRITE(nCountWithAncestors);
+    }
+};
+
+/**
+ * Run the script checks of entries [begin, end) on the script check threads,
+ * storing the signatures that verify in the signature cache. The serial
+ * AcceptToMemoryPool calls that follow then mostly hit that cache instead of
+ * doing ECDSA verification while holding cs_main.
+ *
+ * Spent outputs are looked up in the snapshot itself first (for transactions
+ * that had in-mempool ancestors) and in the UTXO set otherwise. Transactions
+ * whose inputs cannot be found, or that AcceptToMemoryPool would reject on
+ * fee before reaching script verification, are skipped.
+ *
+ * The check queue stops at the first failing check, so a failed run is split
+ * in halves and each half is run again (the checks that passed now hit the
+ * signature cache) until the failing transactions are isolated. Their
+ * indices are added to failed; every other transaction is still verified.
+ */
+static void PreVerifyMempoolScripts(const CTxMemPool& pool, const std::vector<MempoolDumpEntry>& entries, size_t begin, size_t end,
+                                    const std::map<uint256, CTransactionRef>& dump_txs, std::set<size_t>& failed)
+{
+    const CFeeRate min_fee_rate = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+
+    // CScriptCheck keeps pointers into txdata, so it must not reallocate.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(end - begin);
+    // Entry index and script checks of each transaction to verify.
+    std::vector<std::pair<size_t, std::vector<CScriptCheck>>> tx_checks;
+    {
+        LOCK(cs_main);
+        for (size_t i = begin; i < end; ++i) {
+            const MempoolDumpEntry& entry = entries[i];
+            const CTransaction& tx = *entry.tx;
+            if (entry.nFee >= 0 && entry.nFee + entry.nFeeDelta < min_fee_rate.GetFee(GetVirtualTransactionSize(tx))) {
+                continue;
+            }
+
+            std::vector<CTxOut> spent_outputs;
+            spent_outputs.reserve(tx.vin.size());
+            for (const CTxIn& txin : tx.vin) {
+                if (entry.nCountWithAncestors != 1) {
+                    auto it = dump_txs.find(txin.prevout.hash);
+                    if (it != dump_txs.end()) {
+                        if (txin.prevout.n >= it->second->vout.size()) break;
+                        spent_outputs.push_back(it->second->vout[txin.prevout.n]);
+                        continue;
+                    }
+                }
+                const Coin& coin = pcoinsTip->AccessCoin(txin.prevout);
+                if (coin.IsSpent()) break;
+                spent_outputs.push_back(coin.out);
+            }
+            if (spent_outputs.size() != tx.vin.size()) {
+                continue;
+            }
+
+            txdata.emplace_back(tx);
+            tx_checks.emplace_back(i, std::vector<CScriptCheck>());
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                tx_checks.back().second.emplace_back(spent_outputs[j], tx, j, STANDARD_SCRIPT_VERIFY_FLAGS, true /* cacheStore */, &txdata.back());
+            }
+        }
+    }
+
+    std::vector<std::pair<size_t, size_t>> ranges{{0, tx_checks.size()}};
+    while (!ranges.empty()) {
+        const size_t lo = ranges.back().first, hi = ranges.back().second;
+        ranges.pop_back();
+        if (lo == hi) continue;
+
+        // The queue consumes the checks it is given; keep the originals for a retry.
+        std::vector<CScriptCheck> vChecks;
+        for (size_t k = lo; k < hi; ++k) {
+            vChecks.insert(vChecks.end(), tx_checks[k].second.begin(), tx_checks[k].second.end());
+        }
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        if (control.Wait()) continue;
+
+        if (hi - lo == 1) {
+            failed.insert(tx_checks[lo].first);
+        } else {
+            const size_t mid = lo + (hi - lo) / 2;
+            ranges.emplace_back(mid, hi);
+            ranges.emplace_back(lo, mid);
+        }
+    }
+}
 
 <<<<<<< HEAD
 bool LoadMempool(void)
@@ -4922,36 +5337,92 @@ bool LoadMempool(CTxMemPool& pool)
     int64_t expired = 0;
     int64_t failed = 0;
     int64_t already_there = 0;
+    int64_t trusted = 0;
     int64_t nNow = GetTime();
 
+    // Read the whole snapshot up front: scripts of a batch are verified in
+    // parallel before any of its transactions is accepted, and children need
+    // their (possibly not yet accepted) parents' outputs for that.
+    uint256 hashDumpTip;
+    std::vector<MempoolDumpEntry> entries;
+    std::map<uint256, CAmount> mapDeltas;
     try {
         uint64_t version;
         file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+        if (version != MEMPOOL_DUMP_VERSION && version != MEMPOOL_DUMP_VERSION_NO_METADATA) {
             return false;
         }
+        if (version == MEMPOOL_DUMP_VERSION) {
+            file >> hashDumpTip;
+        }
         uint64_t num;
         file >> num;
         while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
+            MempoolDumpEntry entry;
+            if (version == MEMPOOL_DUMP_VERSION) {
+                file >> entry;
+            } else {
+                file >> entry.tx;
+                file >> entry.nTime;
+                file >> entry.nFeeDelta;
+            }
+            entries.push_back(std::move(entry));
+        }
+        file >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    std::map<uint256, CTransactionRef> dump_txs;
+    for (const MempoolDumpEntry& entry : entries) {
+        dump_txs.emplace(entry.tx->GetHash(), entry.tx);
+    }
+
+    // If the chain has not moved since the snapshot was taken, every
+    // transaction in it already passed script verification against this
+    // exact UTXO set, and re-running the scripts can be skipped.
+    auto tip_unchanged = [&]() EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+        return !hashDumpTip.IsNull() && ::ChainActive().Tip() && ::ChainActive().Tip()->GetBlockHash() == hashDumpTip;
+    };
+
+    for (size_t batch_begin = 0; batch_begin < entries.size(); batch_begin += MEMPOOL_LOAD_BATCH_SIZE) {
+        const size_t batch_end = std::min(entries.size(), batch_begin + MEMPOOL_LOAD_BATCH_SIZE);
+
+        bool fPreVerify;
+        {
+            LOCK(cs_main);
+            fPreVerify = nScriptCheckThreads && !tip_unchanged();
+        }
+        std::set<size_t> script_failures;
+        if (fPreVerify) {
+            PreVerifyMempoolScripts(pool, entries, batch_begin, batch_end, dump_txs, script_failures);
+        }
+
+        for (size_t i = batch_begin; i < batch_end; ++i) {
+            const MempoolDumpEntry& entry = entries[i];
+            const CTransactionRef& tx = entry.tx;
+            if (script_failures.count(i)) {
+                // Its scripts don't verify against the current UTXO set;
+                // AcceptToMemoryPool would only run them again to reject it.
+                ++failed;
+                continue;
+            }
+
+            CAmount amountdelta = entry.nFeeDelta;
             if (amountdelta) {
                 pool.PrioritiseTransaction(tx->GetHash(), amountdelta);
             }
             CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
+            if (entry.nTime + nExpiryTimeout > nNow) {
                 LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, nullptr /* pfMissingInputs */, nTime,
+                const bool skip_script_checks = tip_unchanged();
+                AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, nullptr /* pfMissingInputs */, entry.nTime,
                                            nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */,
-                                           false /* test_accept */);
+                                           false /* test_accept */, skip_script_checks);
                 if (state.IsValid()) {
                     ++count;
+                    if (skip_script_checks) ++trusted;
                 } else {
                     // mempool may contain the transaction already, e.g. from
                     // wallet(s) having loaded it while we were processing
@@ -4969,18 +5440,13 @@ bool LoadMempool(CTxMemPool& pool)
             if (ShutdownRequested())
                 return false;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
+    }
 
-        for (const auto& i : mapDeltas) {
-            pool.PrioritiseTransaction(i.first, i.second);
-        }
-    } catch (const std::exception& e) {
-        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
-        return false;
+    for (const auto& i : mapDeltas) {
+        pool.PrioritiseTransaction(i.first, i.second);
     }
 
-    LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there\n", count, failed, expired, already_there);
+    LogPrintf("Imported mempool transactions from disk: %i succeeded (%i without script checks), %i failed, %i expired, %i already there\n", count, trusted, failed, expired, already_there);
     return true;
 }
 
@@ -4992,11 +5458,16 @@ bool DumpMempool(const CTxMemPool& pool)
 {
     int64_t start = GetTimeMicros();
 
+    uint256 hashTip;
     std::map<uint256, CAmount> mapDeltas;
     std::vector<TxMempoolInfo> vinfo;
 
     {
-        LOCK(pool.cs);
+        // cs_main keeps the snapshot consistent with the tip recorded in it
+        LOCK2(cs_main, pool.cs);
+        if (::ChainActive().Tip()) {
+            hashTip = ::ChainActive().Tip()->GetBlockHash();
+        }
         for (const auto &i : pool.mapDeltas) {
             mapDeltas[i.first] = i.second;
         }
@@ -5015,12 +5486,11 @@ bool DumpMempool(const CTxMemPool& pool)
 
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
+        file << hashTip;
 
         file << (uint64_t)vinfo.size();
         for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
+            file << MempoolDumpEntry(i);
             mapDeltas.erase(i.tx->GetHash());
         }
 
@@ -90,7 +90,9 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Minimum number of inputs for a transaction's mempool script checks to be spread over the script-checking threads */
+static const unsigned int MEMPOOL_PARALLEL_SCRIPT_CHECK_MIN_INPUTS = 8;
+/** Number of blocks that can be requested at any given time from a single peer, until its download rate has been measured. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
@@ -312,6 +314,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee, bool test_accept=false);
 
+/** (try to) add a batch of transactions to memory pool.
+ * Transactions are validated after any transactions of the batch whose outputs they
+ * spend, under a single mempool lock, and accepted transactions are only announced to
+ * validation interfaces once the whole batch has been processed.
+ * states and missing_inputs are filled with one entry per transaction in txs, in order.
+ * nAbsurdFees is either empty or holds the absurd fee limit of each transaction.
+ * @return whether each transaction was accepted **/
+std::vector<bool> AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CValidationState>& states, const std::vector<CTransactionRef>& txs,
+                                          std::vector<bool>& missing_inputs, std::list<CTransactionRef>* plTxnReplaced,
+                                          bool bypass_limits, const std::vector<CAmount>& nAbsurdFees) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
 /** Get the BIP9 state for a given deployment at the current tip. */
 ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::DeploymentPos pos);
 
@@ -387,6 +400,7 @@ public:
     }
 
     ScriptError GetScriptError() const { return error; }
+    unsigned int GetInputIndex() const { return nIn; }
 };
 
 /** Initializes the script-execution cache */
@@ -398,6 +412,10 @@ bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::P
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const FlatFilePos& pos, const CMessageHeader::MessageStartChars& message_start);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
+/** Read a serialized block, without witness data unless witness is set. The block is never deserialized. */
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start, bool witness);
+/** Rewrite a serialized block into its serialization without witness data. Returns false if block is malformed. */
+bool StripRawBlockWitness(const std::vector<uint8_t>& block, std::vector<uint8_t>& stripped);
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
 
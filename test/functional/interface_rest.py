@@ -317,5 +317,16 @@ class RESTTest (BitcoinTestFramework):
         json_obj = self.test_rest_request("/chaininfo")
         assert_equal(json_obj['bestblockhash'], bb_hash)
 
+        self.log.info("Test the /netstats URI")
+
+        json_obj = self.test_rest_request("/netstats")
+        net_stats = self.nodes[0].getnetstats()
+        assert_equal(set(json_obj['messages']), set(net_stats['messages']))
+        assert_equal(len(json_obj['peers']), len(net_stats['peers']))
+        # Peer addresses are only available through the RPC.
+        assert all('addr' not in peer for peer in json_obj['peers'])
+        assert all('addr' in peer for peer in net_stats['peers'])
+        assert all('sendqueue' in peer and 'processqueue' in peer for peer in json_obj['peers'])
+
 if __name__ == '__main__':
     RESTTest().main()
@@ -20,7 +20,8 @@ MAX_DESCENDANTS = 25
 class MempoolPackagesTest(BitcoinTestFramework):
     def set_test_params(self):
         self.num_nodes = 2
-        self.extra_args = [["-maxorphantx=1000"], ["-maxorphantx=1000", "-limitancestorcount=5"]]
+        # Node 1 processes its peers on several message handler threads
+        self.extra_args = [["-maxorphantx=1000"], ["-maxorphantx=1000", "-limitancestorcount=5", "-msghandlerthreads=4"]]
 
     def skip_test_if_missing_module(self):
         self.skip_if_no_wallet()
@@ -91,10 +91,11 @@ class MempoolPersistTest(BitcoinTestFramework):
         wait_until(lambda: self.nodes[0].getmempoolinfo()["loaded"])
         assert_equal(len(self.nodes[0].getrawmempool()), 0)
 
-        self.log.debug("Stop-start node0. Verify that it has the transactions in its mempool.")
+        self.log.debug("Stop-start node0. Verify that it has the transactions in its mempool, accepted without script checks as the tip is unchanged.")
         self.stop_nodes()
-        self.start_node(0)
-        wait_until(lambda: self.nodes[0].getmempoolinfo()["loaded"])
+        with self.nodes[0].assert_debug_log(['Imported mempool transactions from disk: 5 succeeded (5 without script checks)']):
+            self.start_node(0)
+            wait_until(lambda: self.nodes[0].getmempoolinfo()["loaded"])
         assert_equal(len(self.nodes[0].getrawmempool()), 5)
 
         mempooldat0 = os.path.join(self.nodes[0].datadir, 'regtest', 'mempool.dat')
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# Copyright (c) 2019 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test parallel headers sync between -headersanchor anchors.
+
+Node 1 starts with anchors at heights 400, 800 and 1200 of node 0's chain.
+A mininode becomes its sync peer and withholds headers, while node 0 is asked
+for the segments between anchors. Once the mininode delivers the headers up
+to the first anchor, the buffered segments are validated and the node syncs.
+"""
+
+import os
+
+from test_framework.messages import CBlockHeader, FromHex, msg_headers
+from test_framework.mininode import P2PInterface
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, connect_nodes, wait_until
+
+class ParallelHeadersSyncTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self):
+        self.setup_nodes()
+
+    def debug_log_contains(self, node, msg):
+        with open(os.path.join(node.datadir, 'regtest', 'debug.log'), encoding='utf-8') as dl:
+            return msg in dl.read()
+
+    def run_test(self):
+        node0, node1 = self.nodes
+        node0.generate(1200)
+        hashes = [node0.getblockhash(height) for height in range(1201)]
+
+        self.log.info("Restart node 1 with headers anchors")
+        self.restart_node(1, extra_args=["-headersanchor={}:{}".format(height, hashes[height]) for height in (400, 800, 1200)])
+        node1 = self.nodes[1]
+
+        # The first peer becomes the sync peer; it doesn't answer getheaders.
+        sync_peer = node1.add_p2p_connection(P2PInterface())
+        sync_peer.wait_for_getheaders()
+
+        self.log.info("Check that node 0 is asked for a segment while the sync peer stalls")
+        connect_nodes(node1, 0)
+        wait_until(lambda: self.debug_log_contains(node1, "headers segment (400) to (800) downloaded"))
+        assert_equal(node1.getblockchaininfo()['headers'], 0)
+
+        self.log.info("Check that segments are validated once the sync peer reaches the first anchor")
+        headers = [FromHex(CBlockHeader(), node0.getblockheader(blockhash, False)) for blockhash in hashes[1:401]]
+        sync_peer.send_and_ping(msg_headers(headers))
+        wait_until(lambda: node1.getblockchaininfo()['headers'] >= 800)
+
+        self.log.info("Check that the node syncs to the tip")
+        wait_until(lambda: node1.getbestblockhash() == hashes[1200], timeout=120)
+
+if __name__ == '__main__':
+    ParallelHeadersSyncTest().main()
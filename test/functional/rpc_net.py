@@ -13,6 +13,7 @@ from test_framework.util import (
     assert_greater_than_or_equal,
     assert_raises_rpc_error,
     connect_nodes_bi,
+    disconnect_nodes,
     p2p_port,
     wait_until,
 )
@@ -28,6 +29,7 @@ class NetTest(BitcoinTestFramework):
         self._test_getnetworkinginfo()
         self._test_getaddednodeinfo()
         self._test_getpeerinfo()
+        self._test_getnetstats()
 
     def _test_connection_count(self):
         # connect_nodes_bi connects each node to the other
@@ -95,6 +97,37 @@ class NetTest(BitcoinTestFramework):
         # the address bound to on one side will be the source address for the other node
         assert_equal(peer_info[0][0]['addrbind'], peer_info[1][0]['addr'])
         assert_equal(peer_info[1][0]['addrbind'], peer_info[0][0]['addr'])
+        # block download statistics start out with the default window and no measurements
+        for info in peer_info:
+            blockdownload = info[0]['blockdownload']
+            assert_equal(blockdownload['window'], 16)
+            assert_equal(blockdownload['rerequested'], 0)
+
+    def _test_getnetstats(self):
+        net_stats = self.nodes[0].getnetstats()
+        pong = net_stats['messages']['pong']
+        assert_greater_than_or_equal(pong['msgsrecv'], 2)
+        assert_greater_than_or_equal(pong['bytesrecv'], 32 * 2)
+        assert_greater_than_or_equal(net_stats['messages']['ping']['msgssent'], 2)
+        assert_equal(len(pong['processtime_histogram']), 24)
+        assert_greater_than_or_equal(pong['msgsrecv'], sum(pong['processtime_histogram']))
+
+        # Both connections are with the same address and are summed up
+        assert_equal(len(net_stats['peers']), 1)
+        peer = net_stats['peers'][0]
+        assert_equal(peer['addr'], '127.0.0.1')
+        assert_equal(peer['connected'], True)
+        assert_equal(peer['connections'], 2)
+        assert_greater_than_or_equal(peer['maxsendqueue'], peer['sendqueue'])
+
+        # Statistics are kept after the peer disconnects
+        disconnect_nodes(self.nodes[0], 1)
+        wait_until(lambda: not self.nodes[0].getnetstats()['peers'][0]['connected'], timeout=5)
+        peer_after = self.nodes[0].getnetstats()['peers'][0]
+        assert_equal(peer_after['connections'], 2)
+        assert_greater_than_or_equal(peer_after['bytessent'], peer['bytessent'])
+        assert_greater_than_or_equal(peer_after['msgsprocessed'], peer['msgsprocessed'])
+        assert_equal(peer_after['sendqueue'], 0)
 
 if __name__ == '__main__':
     NetTest().main()
@@ -8,6 +8,7 @@ Test the following RPCs:
    - createrawtransaction
    - signrawtransactionwithwallet
    - sendrawtransaction
+   - sendrawtransactions
    - decoderawtransaction
    - getrawtransaction
 """
@@ -462,6 +463,33 @@ class RawTransactionsTest(BitcoinTestFramework):
         assert_equal(testres['allowed'], True)
         self.nodes[2].sendrawtransaction(hexstring=rawTxSigned['hex'], maxfeerate='0.00007000')
 
+        self.log.info('sendrawtransactions with a child ahead of its parent')
+
+        txId = self.nodes[0].sendtoaddress(self.nodes[2].getnewaddress(), 1.0)
+        rawTx = self.nodes[0].getrawtransaction(txId, True)
+        vout = next(o for o in rawTx['vout'] if o['value'] == Decimal('1.00000000'))
+        self.sync_all()
+
+        rawTx = self.nodes[2].createrawtransaction([{"txid": txId, "vout": vout['n']}], {self.nodes[2].getnewaddress(): Decimal("0.99990000")})
+        parent = self.nodes[2].signrawtransactionwithwallet(rawTx)['hex']
+        decoded_parent = self.nodes[2].decoderawtransaction(parent)
+        prevtx = {"txid": decoded_parent['txid'], "vout": 0, "scriptPubKey": decoded_parent['vout'][0]['scriptPubKey']['hex'], "amount": Decimal("0.99990000")}
+        rawTx = self.nodes[2].createrawtransaction([{"txid": decoded_parent['txid'], "vout": 0}], {self.nodes[0].getnewaddress(): Decimal("0.99980000")})
+        child = self.nodes[2].signrawtransactionwithwallet(rawTx, [prevtx])['hex']
+
+        res = self.nodes[2].sendrawtransactions([child, parent])
+        assert_equal([r['accepted'] for r in res], [True, True])
+        assert_equal(res[1]['txid'], decoded_parent['txid'])
+        mempool = self.nodes[2].getrawmempool()
+        assert all(r['txid'] in mempool for r in res)
+
+        self.log.info('sendrawtransactions reports errors per transaction')
+        rawTx = self.nodes[2].createrawtransaction([{'txid': '1d1d4e24ed99057e84c3f80fd8fbec79ed9e1acee37da269356ecea000000000', 'vout': 1}], {self.nodes[0].getnewaddress(): 4.998})
+        res = self.nodes[2].sendrawtransactions([rawTx, parent])
+        assert_equal(res[0]['accepted'], False)
+        assert_equal(res[0]['error']['code'], -25)
+        assert_equal(res[1]['accepted'], True)
+
 
 if __name__ == '__main__':
     RawTransactionsTest().main()
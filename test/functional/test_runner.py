@@ -80,6 +80,7 @@ BASE_SCRIPTS = [
     'wallet_listtransactions.py',
     # vv Tests less than 60s vv
     'p2p_sendheaders.py',
+    'p2p_headers_parallel.py',
     'wallet_zapwallettxes.py',
     'wallet_importmulti.py',
     'mempool_limit.py',
@@ -135,6 +136,7 @@ BASE_SCRIPTS = [
     'wallet_txn_clone.py --mineblock',
     'feature_notifications.py',
     'rpc_getblockfilter.py',
+    'p2p_blockfilters.py',
     'rpc_invalidateblock.py',
     'feature_rbf.py',
     'mempool_packages.py',